@@ -28,102 +28,106 @@ typedef unsigned int BufType;
 namespace Fb2ToEpub
 {
 
-    bool FB2TOEPUB_DECL DecodeBase64(const char *data, OutStmI *pout)
+    // table[' '] = table['\t] = table['\r'] = table['\n']  = 0xfd (whitespaces)
+    // table['=']                                           = 0xfe (end of encoded stream)
+    // table[<any symbol used for base64 encosing>]         = <6-bit value>
+    // table[<all others>]                                  = 0xff (error or end)
+    static const unsigned char table[256] =
     {
-        // table[' '] = table['\t] = table['\r'] = table['\n']  = 0xfd (whitespaces)
-        // table['=']                                           = 0xfe (end of encoded stream)
-        // table[<any symbol used for base64 encosing>]         = <6-bit value>
-        // table[<all others>]                                  = 0xff (error or end)
-        static const unsigned char table[256] =
-        {
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfd, 0xfd, 0xff, 0xff, 0xfd, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xfd, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
-            0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff,
-            0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
-            0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
-            0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
-        };
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfd, 0xfd, 0xff, 0xff, 0xfd, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xfd, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff,
+        0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+        0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
 
-        const unsigned char *udata = reinterpret_cast<const unsigned char*>(data);
-        char buf[256+4], *p = buf, *buf_end = buf + sizeof(buf) - 4;
-        for(;;)
+    //-----------------------------------------------------------------------
+    void Base64Decoder::Flush()
+    {
+        if(p_ > buf_)
+            pout_->Write(buf_, p_ - buf_);
+        p_ = buf_;
+    }
+
+    //-----------------------------------------------------------------------
+    bool Base64Decoder::Decode(const char *data, std::size_t len)
+    {
+        const unsigned char *udata = reinterpret_cast<const unsigned char*>(data), *udata_end = udata + len;
+        const char *buf_end = buf_ + sizeof(buf_) - 4;
+        while(!end_ && udata < udata_end)
         {
-            if(!*udata)
+            if(!cnt_)
             {
-                if(p > buf)
-                    pout->Write(buf, p - buf);
-                return true;
+                // fast path: whole quads without whitespaces
+                while(udata_end - udata >= 4)
+                {
+                    BufType t0 = table[udata[0]], t1 = table[udata[1]], t2 = table[udata[2]], t3 = table[udata[3]];
+                    if((t0 | t1 | t2 | t3) >= 0x40)
+                        break;
+                    BufType obuf = (t0 << 18) + (t1 << 12) + (t2 << 6) + t3;
+                    p_[0] = static_cast<char>(obuf >> 16);
+                    p_[1] = static_cast<char>(obuf >> 8);
+                    p_[2] = static_cast<char>(obuf);
+                    p_ += 3;
+                    udata += 4;
+                    if(p_ > buf_end)
+                        Flush();
+                }
+                if(udata == udata_end)
+                    break;
             }
-#if defined (_DEBUG)
-            unsigned char c = *udata++;
-            BufType t = table[c];
-#else
+
             BufType t = table[*udata++];
-#endif
             if(t >= 0xfd)
             {
                 if(t == 0xfd)           // whitespace
                     continue;
-                if(p > buf)
-                    pout->Write(buf, p - buf);
-                return true;
-            }
-            BufType obuf = (t << 18);
 
-            while((t = table[*udata++]) >= 0xfd)
-                if(t != 0xfd)
+                // end of encoded stream is allowed at the beginning of quad,
+                // '=' is allowed after second character of quad as well
+                if(cnt_ == 1 || (cnt_ > 1 && t != 0xfe))
                     return false;
+                end_ = true;
+                break;
+            }
 
-            *p++ = (static_cast<char>((obuf += (t << 12)) >> 16));
-#if defined (_DEBUG)
-            while((t = table[c = *udata++]) >= 0xfd)
-#else
-            while((t = table[*udata++]) >= 0xfd)
-#endif
-                switch(t)
-                {
-                default:    return false;
-                case 0xfd:  continue;   // whitespace
-                case 0xfe:              // '='
-                    if(p > buf)
-                        pout->Write(buf, p - buf);
-                    return true;
-                }
-
-            *p++ = (static_cast<char>((obuf += (t << 6)) >> 8));
-#if defined (_DEBUG)
-            while((t = table[c = *udata++]) >= 0xfd)
-#else
-            while((t = table[*udata++]) >= 0xfd)
-#endif
-                switch(t)
-                {
-                default:    return false;
-                case 0xfd:  continue;   // whitespace
-                case 0xfe:              // '='
-                    if(p > buf)
-                        pout->Write(buf, p - buf);
-                    return true;
-                }
-
-            *p++ = (static_cast<char>(obuf + t));
-
-            if(p > buf_end)
+            obuf_ = (obuf_ << 6) + t;
+            switch(++cnt_)
             {
-                pout->Write(buf, p - buf);
-                p = buf;
+            case 2:
+                *p_++ = static_cast<char>(obuf_ >> 4);
+                break;
+            case 3:
+                *p_++ = static_cast<char>(obuf_ >> 2);
+                break;
+            case 4:
+                *p_++ = static_cast<char>(obuf_);
+                obuf_ = 0;
+                cnt_ = 0;
+                if(p_ > buf_end)
+                    Flush();
+                break;
             }
         }
+        return true;
+    }
+
+    //-----------------------------------------------------------------------
+    bool Base64Decoder::Finish()
+    {
+        Flush();
+        return end_ || !cnt_;
     }
 
 };  //namespace Fb2ToEpub
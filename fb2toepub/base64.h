@@ -26,7 +26,27 @@
 namespace Fb2ToEpub
 {
 
-    bool FB2TOEPUB_DECL DecodeBase64(const char *data, OutStmI *pout);
+    //-----------------------------------------------------------------------
+    // Base64 decoder
+    // Encoded data may be passed by pieces of any size.
+    //-----------------------------------------------------------------------
+    class Base64Decoder : Noncopyable
+    {
+    public:
+        explicit Base64Decoder(OutStmI *pout) : pout_(pout), obuf_(0), cnt_(0), end_(false), p_(buf_) {}
+
+        bool Decode(const char *data, std::size_t len);     // returns false on error
+        bool Finish();                                      // returns false if data ends in the middle of quad
+
+    private:
+        OutStmI         *pout_;
+        unsigned int    obuf_;          // bits of current quad
+        int             cnt_;           // number of characters of current quad
+        bool            end_;           // end of encoded stream is reached
+        char            buf_[256+4], *p_;
+
+        void Flush();
+    };
 
 };  //namespace Fb2ToEpub
 
@@ -0,0 +1,82 @@
+//
+//  Copyright (C) 2010 Alexey Bobkov
+//
+//  This file is part of Fb2toepub converter.
+//
+//  Fb2toepub converter is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Fb2toepub converter is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Fb2toepub converter.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef FB2TOEPUB__CHARSET_H
+#define FB2TOEPUB__CHARSET_H
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FB2TOEPUB_CHARSET_SSE2
+#endif
+
+namespace Fb2ToEpub
+{
+
+    //-----------------------------------------------------------------------
+    // Set of characters which stop a run of plain text
+    //-----------------------------------------------------------------------
+    class CharSet
+    {
+        bool        tbl_[256];
+#if defined(FB2TOEPUB_CHARSET_SSE2)
+        __m128i     v_[16];
+#endif
+        int         n_;
+
+    public:
+        CharSet(const char *chars, int n) : n_(n)
+        {
+            memset(tbl_, 0, sizeof(tbl_));
+            for(int i = 0; i < n; ++i)
+            {
+                tbl_[static_cast<unsigned char>(chars[i])] = true;
+#if defined(FB2TOEPUB_CHARSET_SSE2)
+                v_[i] = _mm_set1_epi8(chars[i]);
+#endif
+            }
+        }
+
+        bool Has(char c) const {return tbl_[static_cast<unsigned char>(c)];}
+
+        // Returns pointer to the first character from set or end
+        const char* Skip(const char *p, const char *end) const
+        {
+#if defined(FB2TOEPUB_CHARSET_SSE2)
+            for(; end - p >= 16; p += 16)
+            {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                __m128i m = _mm_cmpeq_epi8(x, v_[0]);
+                for(int i = 1; i < n_; ++i)
+                    m = _mm_or_si128(m, _mm_cmpeq_epi8(x, v_[i]));
+                if(_mm_movemask_epi8(m))
+                    break;
+            }
+#endif
+            while(p < end && !Has(*p))
+                ++p;
+            return p;
+        }
+    };
+
+};  //namespace Fb2ToEpub
+
+#endif
@@ -56,6 +56,110 @@
 //#define FB2TOEPUB_TOC_REFERS_FILES_ONLY 1
 
 
+//-----------------------------------------------------------------------
+// SINGLE-PASS CONVERTION
+// If the value is nonzero, input file is parsed only once: text of all
+// output files is kept in memory, and cross-references are fixed up when
+// output file layout is known at the end of the last body.
+// Otherwise, pass 1 collects document structure and pass 2 reads input again.
+// DEFAULT: ON
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_SINGLE_PASS 1
+
+
+//-----------------------------------------------------------------------
+// SPOOL DECODED INPUT
+// If the value is nonzero, zipped or non-UTF-8 input file is unpacked and
+// converted to UTF-8 only once, and pass 2 reads the spooled UTF-8 data.
+// Otherwise, input file is unpacked and converted again for pass 2.
+// In single-pass mode used only with pass 1 cache (cache key is computed
+// by reading the input before the conversion).
+// DEFAULT: ON
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_SPOOL_INPUT 1
+
+
+//-----------------------------------------------------------------------
+// MAX SIZE OF SPOOLED INPUT KEPT IN MEMORY
+// (the rest is kept in temporary file)
+// DEFAULT: 0x1000000 (16M)
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_SPOOL_MEM_SIZE 0x1000000
+
+
+//-----------------------------------------------------------------------
+// READ INPUT FILE AHEAD IN BACKGROUND THREAD
+// If the value is nonzero, next block of input file is read (and unpacked)
+// by background thread while the current one is parsed.
+// Not used for memory mapped input file.
+// DEFAULT: ON
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_READ_AHEAD 1
+
+
+//-----------------------------------------------------------------------
+// BLOCK SIZE FOR READING INPUT FILE AHEAD
+// DEFAULT: 0x40000 (256K)
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_READ_AHEAD_SIZE 0x40000
+
+
+//-----------------------------------------------------------------------
+// NUMBER OF BACKGROUND THREADS COMPRESSING OUTPUT FILES
+// If the value is greater than 1, every compressed file of epub is kept
+// in memory and deflated by one of background threads while the next
+// files are written; the files are stored to epub in the original order.
+// Otherwise, files are compressed while they are written.
+// DEFAULT: 4
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_PACK_THREADS 4
+
+
+//-----------------------------------------------------------------------
+// BUFFER SIZE FOR UNPACKING ZIPPED INPUT FILE
+// DEFAULT: 0x10000 (64K)
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_UNZIP_BUFFER_SIZE 0x10000
+
+
+//-----------------------------------------------------------------------
+// BUFFER SIZE FOR CONVERTING INPUT FILE TO UTF-8
+// DEFAULT: 0x10000 (64K)
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_CONV_BUFFER_SIZE 0x10000
+
+
+//-----------------------------------------------------------------------
+// HANDLING OF INVALID SEQUENCES IN UTF-8 INPUT FILE
+// 0 - no validation, pass input bytes as is
+// 1 - replace every invalid sequence by U+FFFD replacement character
+// 2 - stop with error
+// DEFAULT: 1
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_INVALID_UTF8 1
+
+
+//-----------------------------------------------------------------------
+// USE HAND-WRITTEN SCANNER INSTEAD OF FLEX-GENERATED ONE
+// Both scanners produce the same tokens for well-formed input, but
+// the hand-written one skips content of unused elements (e.g. annotation
+// in info mode) without tokenizing it, so errors inside skipped subtrees
+// are not reported and some malformed books are accepted which the flex
+// scanner rejects.
+// DEFAULT: ON
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_FAST_SCANNER 1
+
+
+//-----------------------------------------------------------------------
+// SIZE OF TEXT PIECES RETURNED BY SCANNER IN CHUNK MODE
+// (long text nodes like <binary> are read by pieces of about this size,
+// so they are never kept in memory as a whole)
+// DEFAULT: 0x10000 (64K)
+//-----------------------------------------------------------------------
+//#define FB2TOEPUB_DATA_CHUNK_SIZE 0x10000
+
+
 //-----------------------------------------------------------------------
 // REMOVE REFERENCES TO std::string::compare
 // (Custom option for ARM Linux)
@@ -81,6 +185,39 @@
 #ifndef FB2TOEPUB_TOC_REFERS_FILES_ONLY
 #define FB2TOEPUB_TOC_REFERS_FILES_ONLY 1
 #endif
+#ifndef FB2TOEPUB_SINGLE_PASS
+#define FB2TOEPUB_SINGLE_PASS 1
+#endif
+#ifndef FB2TOEPUB_SPOOL_INPUT
+#define FB2TOEPUB_SPOOL_INPUT 1
+#endif
+#ifndef FB2TOEPUB_SPOOL_MEM_SIZE
+#define FB2TOEPUB_SPOOL_MEM_SIZE 0x1000000
+#endif
+#ifndef FB2TOEPUB_READ_AHEAD
+#define FB2TOEPUB_READ_AHEAD 1
+#endif
+#ifndef FB2TOEPUB_READ_AHEAD_SIZE
+#define FB2TOEPUB_READ_AHEAD_SIZE 0x40000
+#endif
+#ifndef FB2TOEPUB_PACK_THREADS
+#define FB2TOEPUB_PACK_THREADS 4
+#endif
+#ifndef FB2TOEPUB_UNZIP_BUFFER_SIZE
+#define FB2TOEPUB_UNZIP_BUFFER_SIZE 0x10000
+#endif
+#ifndef FB2TOEPUB_CONV_BUFFER_SIZE
+#define FB2TOEPUB_CONV_BUFFER_SIZE 0x10000
+#endif
+#ifndef FB2TOEPUB_INVALID_UTF8
+#define FB2TOEPUB_INVALID_UTF8 1
+#endif
+#ifndef FB2TOEPUB_FAST_SCANNER
+#define FB2TOEPUB_FAST_SCANNER 1
+#endif
+#ifndef FB2TOEPUB_DATA_CHUNK_SIZE
+#define FB2TOEPUB_DATA_CHUNK_SIZE 0x10000
+#endif
 #ifndef FB2TOEPUB_NO_STD_STRING_COMPARE
 #define FB2TOEPUB_NO_STD_STRING_COMPARE 0
 #endif
@@ -0,0 +1,324 @@
+//
+//  Copyright (C) 2010 Alexey Bobkov
+//
+//  This file is part of Fb2toepub converter.
+//
+//  Fb2toepub converter is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Fb2toepub converter is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Fb2toepub converter.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "hdr.h"
+
+#include "converter.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+namespace Fb2ToEpub
+{
+
+// Cache file starts with signature.
+// Change format version whenever Unit or pass 1 is changed!
+static const char CACHE_SIGNATURE[] = "fb2toepub pass 1 cache, format 2\n";
+
+
+//-----------------------------------------------------------------------
+// Writing and reading of cache file data
+//-----------------------------------------------------------------------
+static void PutNumber(OutStm *stm, std::size_t n)
+{
+    // 7 bits per byte, high bit set if there are more bytes
+    for(; n >= 0x80; n >>= 7)
+        stm->PutChar(static_cast<char>((n & 0x7f) | 0x80));
+    stm->PutChar(static_cast<char>(n));
+}
+
+static void PutString(OutStm *stm, const String &s)
+{
+    PutNumber(stm, s.size());
+    stm->Write(s.data(), s.size());
+}
+
+static std::size_t GetNumber(InStm *stm)
+{
+    std::size_t n = 0;
+    for(int shift = 0;; shift += 7)
+    {
+        if(shift >= static_cast<int>(sizeof(n) * 8))
+            ExternalError("pass 1 cache: bad number");
+        unsigned char c = stm->GetUChar();
+        n |= static_cast<std::size_t>(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            return n;
+    }
+}
+
+static String GetString(InStm *stm)
+{
+    std::size_t size = GetNumber(stm);
+    String s;
+    while(s.size() < size)
+    {
+        char buf[0x400];
+        std::size_t cnt = size - s.size();
+        if(cnt > sizeof(buf))
+            cnt = sizeof(buf);
+        if(stm->Read(buf, cnt) != cnt)
+            ExternalError("pass 1 cache: unexpected end of file");
+        s.append(buf, cnt);
+    }
+    return s;
+}
+
+//-----------------------------------------------------------------------
+static String CacheFileName(const String &cacheDir, const String &key)
+{
+    char last = cacheDir[cacheDir.length() - 1];
+    return cacheDir + ((last == '/' || last == '\\') ? "" : "/") + key + ".p1";
+}
+
+
+//-----------------------------------------------------------------------
+// SHA-256 digest (FIPS 180-4) of cache key.
+// Key must identify input contents reliably: collision would convert
+// the book with layout of another one.
+//-----------------------------------------------------------------------
+class Sha256 : Noncopyable
+{
+public:
+    Sha256();
+
+    void Update(const unsigned char *p, std::size_t cnt);
+    void Final(unsigned char digest[32]);
+
+private:
+    typedef unsigned int uint32;    // at least 32 bits, values are masked
+
+    uint32              h_[8];
+    unsigned char       block_[64];
+    std::size_t         blockLen_;
+    unsigned long long  total_;
+
+    void Transform();
+};
+
+//-----------------------------------------------------------------------
+#define SHA256_MASK(x)      ((x) & 0xffffffffU)
+#define SHA256_ROTR(x, n)   SHA256_MASK(((x) >> (n)) | ((x) << (32 - (n))))
+
+static const unsigned int sha256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+Sha256::Sha256() : blockLen_(0), total_(0)
+{
+    h_[0] = 0x6a09e667; h_[1] = 0xbb67ae85; h_[2] = 0x3c6ef372; h_[3] = 0xa54ff53a;
+    h_[4] = 0x510e527f; h_[5] = 0x9b05688c; h_[6] = 0x1f83d9ab; h_[7] = 0x5be0cd19;
+}
+
+void Sha256::Transform()
+{
+    uint32 w[64];
+    for(int i = 0; i < 16; ++i)
+        w[i] = (static_cast<uint32>(block_[i * 4]) << 24) | (static_cast<uint32>(block_[i * 4 + 1]) << 16) |
+               (static_cast<uint32>(block_[i * 4 + 2]) << 8) | static_cast<uint32>(block_[i * 4 + 3]);
+    for(int i = 16; i < 64; ++i)
+    {
+        uint32 s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32 s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = SHA256_MASK(w[i - 16] + s0 + w[i - 7] + s1);
+    }
+
+    uint32 a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4], f = h_[5], g = h_[6], h = h_[7];
+    for(int i = 0; i < 64; ++i)
+    {
+        uint32 s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25);
+        uint32 ch = (e & f) ^ (~e & g);
+        uint32 t1 = SHA256_MASK(h + s1 + ch + sha256K[i] + w[i]);
+        uint32 s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22);
+        uint32 maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32 t2 = SHA256_MASK(s0 + maj);
+        h = g; g = f; f = e; e = SHA256_MASK(d + t1);
+        d = c; c = b; b = a; a = SHA256_MASK(t1 + t2);
+    }
+    h_[0] = SHA256_MASK(h_[0] + a); h_[1] = SHA256_MASK(h_[1] + b);
+    h_[2] = SHA256_MASK(h_[2] + c); h_[3] = SHA256_MASK(h_[3] + d);
+    h_[4] = SHA256_MASK(h_[4] + e); h_[5] = SHA256_MASK(h_[5] + f);
+    h_[6] = SHA256_MASK(h_[6] + g); h_[7] = SHA256_MASK(h_[7] + h);
+}
+
+void Sha256::Update(const unsigned char *p, std::size_t cnt)
+{
+    total_ += cnt;
+    while(cnt > 0)
+    {
+        std::size_t n = sizeof(block_) - blockLen_;
+        if(n > cnt)
+            n = cnt;
+        memcpy(block_ + blockLen_, p, n);
+        blockLen_ += n;
+        p += n;
+        cnt -= n;
+        if(blockLen_ == sizeof(block_))
+        {
+            Transform();
+            blockLen_ = 0;
+        }
+    }
+}
+
+void Sha256::Final(unsigned char digest[32])
+{
+    // padding: 0x80, zeros, 64-bit big-endian message length in bits
+    unsigned long long bits = total_ * 8;
+    static const unsigned char pad[64] = {0x80};
+    Update(pad, (blockLen_ < 56 ? 56 : 120) - blockLen_);
+    unsigned char len[8];
+    for(int i = 0; i < 8; ++i)
+        len[i] = static_cast<unsigned char>(bits >> (56 - i * 8));
+    Update(len, 8);
+
+    for(int i = 0; i < 8; ++i)
+    {
+        digest[i * 4]     = static_cast<unsigned char>(h_[i] >> 24);
+        digest[i * 4 + 1] = static_cast<unsigned char>(h_[i] >> 16);
+        digest[i * 4 + 2] = static_cast<unsigned char>(h_[i] >> 8);
+        digest[i * 4 + 3] = static_cast<unsigned char>(h_[i]);
+    }
+}
+
+#undef SHA256_ROTR
+#undef SHA256_MASK
+
+
+//-----------------------------------------------------------------------
+String FB2TOEPUB_DECL Pass1CacheKey(InStm *pin)
+{
+    // SHA-256 of input contents, and input size
+    Sha256 sha;
+    unsigned long long size = 0;
+    while(!pin->IsEOF())
+    {
+        unsigned char buf[0x10000];
+        std::size_t cnt = pin->Read(buf, sizeof(buf));
+        sha.Update(buf, cnt);
+        size += cnt;
+    }
+    pin->Rewind();
+
+    unsigned char digest[32];
+    sha.Final(digest);
+
+    char key[100], *p = key;
+    for(int i = 0; i < 32; ++i, p += 2)
+        sprintf(p, "%02x", digest[i]);
+    sprintf(p, "-%llx", size);
+    return key;
+}
+
+//-----------------------------------------------------------------------
+static bool LoadUnits(const String &cacheDir, const String &key, UnitArray *units)
+{
+    try
+    {
+        Ptr<InStm> stm = CreateInFileStm(CacheFileName(cacheDir, key).c_str());
+        if(GetString(stm) != CACHE_SIGNATURE || GetString(stm) != key)
+            return false;
+
+        UnitArray loaded;
+        for(std::size_t cnt = GetNumber(stm); cnt > 0; --cnt)
+        {
+            Unit::BodyType bodyType = static_cast<Unit::BodyType>(GetNumber(stm));
+            Unit::Type type         = static_cast<Unit::Type>(GetNumber(stm));
+            int id                  = static_cast<int>(GetNumber(stm));
+            int parent              = static_cast<int>(GetNumber(stm)) - 1;
+            if(parent >= static_cast<int>(loaded.size()))
+                return false;   // AdjustUnitSizes expects parent before child
+
+            loaded.push_back(Unit(bodyType, type, id, parent));
+            Unit &unit = loaded.back();
+            unit.title_     = GetString(stm);
+            unit.size_      = GetNumber(stm);
+            for(std::size_t cnt1 = GetNumber(stm); cnt1 > 0; --cnt1)
+                unit.refIds_.push_back(GetString(stm));
+            for(std::size_t cnt1 = GetNumber(stm); cnt1 > 0; --cnt1)
+                unit.refs_.insert(GetString(stm));
+            unit.noteRefId_ = GetString(stm);
+        }
+        if(!stm->IsEOF())
+            return false;
+
+        units->swap(loaded);
+        return true;
+    }
+    catch(const Exception&)
+    {
+        return false;   // not cached yet or broken cache file, pass 1 will rebuild it
+    }
+}
+
+//-----------------------------------------------------------------------
+bool FB2TOEPUB_DECL LoadPass1Cache(const String &cacheDir, const String &key, UnitArray *units)
+{
+    // missing cache file is not an error, keep errno for error messages
+    int err = errno;
+    bool loaded = LoadUnits(cacheDir, key, units);
+    errno = err;
+    return loaded;
+}
+
+//-----------------------------------------------------------------------
+bool FB2TOEPUB_DECL SavePass1Cache(const String &cacheDir, const String &key, const UnitArray &units)
+{
+    try
+    {
+        Ptr<OutStm> stm = CreateOutFileStm(CacheFileName(cacheDir, key).c_str());
+        PutString(stm, CACHE_SIGNATURE);
+        PutString(stm, key);
+
+        PutNumber(stm, units.size());
+        for(UnitArray::const_iterator cit = units.begin(), cit_end = units.end(); cit < cit_end; ++cit)
+        {
+            PutNumber(stm, cit->bodyType_);
+            PutNumber(stm, cit->type_);
+            PutNumber(stm, cit->id_);
+            PutNumber(stm, cit->parent_ + 1);
+            PutString(stm, cit->title_);
+            PutNumber(stm, cit->size_);
+            PutNumber(stm, cit->refIds_.size());
+            for(strvector::const_iterator cit1 = cit->refIds_.begin(), cit1_end = cit->refIds_.end(); cit1 < cit1_end; ++cit1)
+                PutString(stm, *cit1);
+            PutNumber(stm, cit->refs_.size());
+            for(std::set<String>::const_iterator cit1 = cit->refs_.begin(), cit1_end = cit->refs_.end(); cit1 != cit1_end; ++cit1)
+                PutString(stm, *cit1);
+            PutString(stm, cit->noteRefId_);
+        }
+        return true;
+    }
+    catch(const Exception&)
+    {
+        return false;   // cache is not necessary for convertion
+    }
+}
+
+
+};  //namespace Fb2ToEpub
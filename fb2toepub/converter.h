@@ -26,6 +26,7 @@
 #include "streamzip.h"
 #include "scanner.h"
 #include "translit.h"
+#include "fb2toepubconv.h"
 
 namespace Fb2ToEpub
 {
@@ -38,81 +39,6 @@ namespace Fb2ToEpub
     const std::size_t UNIT_SIZE1        = MAX_UNIT_SIZE*3/4;
     const std::size_t UNIT_SIZE2        = MAX_UNIT_SIZE*5/6;
 
-    /*
-    //-----------------------------------------------------------------------
-    // All elements
-    //-----------------------------------------------------------------------
-    enum ElementType
-    {
-        E_NONE,
-        E_FICTIONBOOK,
-        E_A,
-        E_ANNOTATION,
-        E_AUTHOR,
-        E_BINARY,
-        E_BODY,
-        E_BOOK_NAME,
-        E_BOOK_TITLE,
-        E_CITE,
-        E_CITY,
-        E_CODE,
-        E_COVERPAGE,
-        E_CUSTOM_INFO,
-        E_DATE,
-        E_DESCRIPTION,
-        E_DOCUMENT_INFO,
-        E_EMAIL,
-        E_EMPHASIS,
-        E_EMPTY_LINE,
-        E_EPIGRAPH,
-        E_FIRST_NAME,
-        E_GENRE,
-        E_HISTORY,
-        E_HOME_PAGE,
-        E_ID,
-        E_ISBN,
-        E_IMAGE,
-        E_KEYWORDS,
-        E_LANG,
-        E_LAST_NAME,
-        E_MIDDLE_NAME,
-        E_NICKNAME,
-        E_OUTPUT_DOCUMENT_CLASS,
-        E_OUTPUT,
-        E_P,
-        E_PART,
-        E_POEM,
-        E_PROGRAM_USED,
-        E_PUBLISH_INFO,
-        E_PUBLISHER,
-        E_SECTION,
-        E_SEQUENCE,
-        E_SRC_LANG,
-        E_SRC_OCR,
-        E_SRC_TITLE_INFO,
-        E_SRC_URL,
-        E_STANZA,
-        E_STRIKETHROUGH,
-        E_STRONG,
-        E_STYLE,
-        E_STYLESHEET,
-        E_SUB,
-        E_SUBTITLE,
-        E_SUP,
-        E_TABLE,
-        E_TD,
-        E_TEXT_AUTHOR,
-        E_TH,
-        E_TITLE,
-        E_TITLE_INFO,
-        E_TR,
-        E_TRANSLATOR,
-        E_V,
-        E_VERSION,
-        E_YEAR
-    };
-    */
-
     //-----------------------------------------------------------------------
     struct Unit
     {
@@ -160,30 +86,79 @@ namespace Fb2ToEpub
 
 
     //-----------------------------------------------------------------------
-    typedef std::map<String, String>  ReferenceMap;   // (refid -> file) or (refid -> refid)
+    // Position of <body>, top-level <section> or <binary> in the decoded input stream.
+    // Scanning of element content can be resumed there by LexScanner::Restore(cp_).
+    struct ElementOffset
+    {
+        ElementType                 element_;       // E_BODY, E_SECTION or E_BINARY
+        int                         unit_;          // index of first unit of body or section, -1 for binary
+        String                      id_;            // binary id
+        LexScanner::Checkpoint      cp_;            // scanner state right after start tag
+
+        ElementOffset(ElementType element, int unit, const String &id = "") : element_(element), unit_(unit), id_(id) {}
+    };
+    typedef std::vector<ElementOffset>  OffsetMap;  // in document order
 
 
     //-----------------------------------------------------------------------
-    // PRINT INFO
+    // PRINT INFO AND SAVE COVER IMAGE
     //-----------------------------------------------------------------------
     void FB2TOEPUB_DECL DoPrintInfo(const String &in);
+    void FB2TOEPUB_DECL DoSaveCover(const String &in, const String &out);
 
     //-----------------------------------------------------------------------
     // CONVERTION PASS 1 (DETERMINE DOCUMENT STRUCTURE AND COLLECT ALL CROSS-REFERENCES INSIDE THE FB2 FILE)
+    // If offsets is not NULL, it receives positions of bodies, top-level sections
+    // and binaries; binaries are scanned only in this case.
+    //-----------------------------------------------------------------------
+    void FB2TOEPUB_DECL DoConvertionPass1(LexScanner *scanner, UnitArray *units, OffsetMap *offsets = NULL);
+
     //-----------------------------------------------------------------------
-    void FB2TOEPUB_DECL DoConvertionPass1(LexScanner *scanner, UnitArray *units);
+    // INCREMENTAL CONVERTION PASS 1 (ON INPUT PUSHED IN CHUNKS)
+    // Resume scans the input pushed so far and returns true when pass 1 is done.
+    // Document is scanned by top-level parts (head up to the first body, body
+    // start, top-level section, binary); a part interrupted by the end of pushed
+    // input is rolled back and scanned again when twice as much input is pushed.
+    //-----------------------------------------------------------------------
+    class ConvertionPass1 : public Object
+    {
+    public:
+        virtual bool Resume() = 0;
+    };
+
+    Ptr<ConvertionPass1> FB2TOEPUB_DECL StartConvertionPass1(PushScanner *scanner, UnitArray *units, OffsetMap *offsets = NULL);
 
     //-----------------------------------------------------------------------
     // CONVERTER PASS 2 (CREATE EPUB DOCUMENT)
     //-----------------------------------------------------------------------
     void FB2TOEPUB_DECL DoConvertionPass2  (LexScanner *scanner,
-                                            const strvector &css,
-                                            const strvector &fonts,
+                                            ExtResources *res,
                                             const strvector &mfonts,
                                             XlitConv *xlitConv,
                                             UnitArray *units,
                                             OutPackStm *pout);
 
+    //-----------------------------------------------------------------------
+    // SINGLE-PASS CONVERTION (PASS 2 COLLECTING PASS 1 DATA, UNITS ARE KEPT IN MEMORY
+    // AND CROSS-REFERENCES ARE FIXED UP WHEN FILE LAYOUT IS KNOWN)
+    // If pass1Units is not NULL, it receives units as pass 1 would build them.
+    //-----------------------------------------------------------------------
+    void FB2TOEPUB_DECL DoConvertionSinglePass (LexScanner *scanner,
+                                                ExtResources *res,
+                                                const strvector &mfonts,
+                                                XlitConv *xlitConv,
+                                                OutPackStm *pout,
+                                                UnitArray *pass1Units);
+
+    //-----------------------------------------------------------------------
+    // PASS 1 CACHE (UNITS STORED IN CACHE DIRECTORY, KEYED BY HASH OF INPUT CONTENTS)
+    // Cache errors are not fatal: Load fails if there is no valid cache file,
+    // Save fails if the file can't be written.
+    //-----------------------------------------------------------------------
+    String FB2TOEPUB_DECL   Pass1CacheKey   (InStm *pin);   // reads whole input and rewinds it
+    bool FB2TOEPUB_DECL     LoadPass1Cache  (const String &cacheDir, const String &key, UnitArray *units);
+    bool FB2TOEPUB_DECL     SavePass1Cache  (const String &cacheDir, const String &key, const UnitArray &units);
+
 
 };  //namespace Fb2ToEpub
 
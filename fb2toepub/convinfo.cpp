@@ -24,8 +24,10 @@
 #include "converter.h"
 #include "streamconv.h"
 #include "streamzip.h"
+#include "base64.h"
 #include <sstream>
 #include <vector>
+#include <set>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -38,7 +40,8 @@ static void PrintInfo(const String &name, const String &value)
     if(!value.empty())
     {
         std::vector<char> buf;
-        LexScanner::Decode(value.c_str(), &buf, true, true);
+        LexScanner::Decode(value.data(), value.size(), &buf, true, true);
+        buf.push_back('\0');
         printf("%s=%s\n", name.c_str(), &buf[0]);
     }
 }
@@ -58,10 +61,7 @@ public:
             size = st.st_size;
         }
 
-        Ptr<InStm> pin = CreateInUnicodeStm(CreateUnpackStm(in_.c_str()));
-        s_ = CreateScanner(pin);
-        s_->SkipXMLDeclaration();
-        FictionBook();
+        ScanDescription(CreateInUnicodeStm(CreateUnpackStm(in_.c_str())));
 
         // author(s)
         String authors;
@@ -102,15 +102,29 @@ public:
         }
     }
 
+    // scans the document up to the end of <description>
+    void ScanDescription(InStm *pin)
+    {
+        s_ = CreateScanner(pin);
+        s_->SkipXMLDeclaration();
+        FictionBook();
+    }
+
+    const String& CoverId() const   {return coverId_;}
+
 private:
     String                  in_;
     Ptr<LexScanner>         s_;
     String                  title_, lang_, title_info_date_, isbn_;
+    String                  coverId_;   // id of the first <coverpage> image
     strvector               authors_;
+    std::set<String>        xlns_;      // xlink namespaces
 
     typedef std::vector<std::pair<String, String> > seqvector;
     seqvector               sequences_;
 
+    String Findhref             (const AttrMap &attrmap) const;
+
     // FictionBook elements
     void FictionBook            ();
     //void a                      ();
@@ -123,7 +137,7 @@ private:
     //void cite                   ();
     //void city                   ();
     //void code                   ();
-    //void coverpage              ();
+    void coverpage              ();
     //void custom_info            ();
     //void date                   ();
     String date__textonly       ();
@@ -138,7 +152,7 @@ private:
     //void history                ();
     //void home_page              ();
     //void id                     ();
-    //void image                  ();
+    void image                  ();
     String isbn                 ();
     //void keywords               ();
     void lang                   ();
@@ -180,13 +194,36 @@ private:
     //void year                   ();
 };
 
+//-----------------------------------------------------------------------
+String ConverterInfo::Findhref(const AttrMap &attrmap) const
+{
+    std::set<String>::const_iterator cit = xlns_.begin(), cit_end = xlns_.end();
+    for(; cit != cit_end; ++cit)
+    {
+        const TextView *href = attrmap.Find(A_HREF, cit->c_str());
+        if(href)
+            return href->str();
+    }
+    return "";
+}
+
 //-----------------------------------------------------------------------
 void ConverterInfo::FictionBook()
 {
-    s_->BeginNotEmptyElement("FictionBook");
+    AttrMap attrmap;
+    s_->BeginNotEmptyElement(E_FICTIONBOOK, &attrmap);
+
+    // xlink namespaces (namespace errors are reported by convertion only)
+    for(std::size_t i = 0; i < attrmap.size(); ++i)
+    {
+        static const String xmlns = "xmlns:", xlID = "http://www.w3.org/1999/xlink";
+        const String name = attrmap[i].name_.str();
+        if(!attrmap[i].value_.compare(xlID) && !name.compare(0, xmlns.length(), xmlns))
+            xlns_.insert(name.substr(xmlns.length()));
+    }
 
     //<stylesheet>
-    s_->SkipAll("stylesheet");
+    s_->SkipAll(E_STYLESHEET);
     //</stylesheet>
 
     //<description>
@@ -197,20 +234,20 @@ void ConverterInfo::FictionBook()
 //-----------------------------------------------------------------------
 void ConverterInfo::author()
 {
-    s_->BeginNotEmptyElement("author");
+    s_->BeginNotEmptyElement(E_AUTHOR);
 
     String author;
-    if(s_->IsNextElement("first-name"))
+    if(s_->IsNextElement(E_FIRST_NAME))
     {
-        author = s_->SimpleTextElement("first-name");
+        author = s_->SimpleTextElement(E_FIRST_NAME);
 
-        if(s_->IsNextElement("middle-name"))
-            author = Concat(author, " ", s_->SimpleTextElement("middle-name"));
+        if(s_->IsNextElement(E_MIDDLE_NAME))
+            author = Concat(author, " ", s_->SimpleTextElement(E_MIDDLE_NAME));
 
-        author = Concat(author, " ", s_->SimpleTextElement("last-name"));
+        author = Concat(author, " ", s_->SimpleTextElement(E_LAST_NAME));
     }
-    else if(s_->IsNextElement("nickname"))
-        author = s_->SimpleTextElement("nickname");
+    else if(s_->IsNextElement(E_NICKNAME))
+        author = s_->SimpleTextElement(E_NICKNAME);
     else
         s_->Error("<first-name> or <nickname> expected");
 
@@ -221,19 +258,33 @@ void ConverterInfo::author()
 //-----------------------------------------------------------------------
 void ConverterInfo::book_title()
 {
-    title_ = s_->SimpleTextElement("book-title");
+    title_ = s_->SimpleTextElement(E_BOOK_TITLE);
+}
+
+//-----------------------------------------------------------------------
+void ConverterInfo::coverpage()
+{
+    if(!s_->BeginElement(E_COVERPAGE))
+        return;
+
+    //<image>
+    while(s_->IsNextElement(E_IMAGE))
+        image();
+    //</image>
+
+    s_->SkipRestOfElementContent(); // skip rest of <coverpage>
 }
 
 //-----------------------------------------------------------------------
 String ConverterInfo::date__textonly()
 {
-    if(!s_->BeginElement("date"))
+    if(!s_->BeginElement(E_DATE))
         return "";
 
     String text;
     SetScannerDataMode setDataMode(s_);
     if(s_->LookAhead().type_ == LexScanner::DATA)
-        text = s_->GetToken().s_;
+        text = s_->GetToken().s_.str();
     s_->EndElement();
     return text;
 }
@@ -241,38 +292,52 @@ String ConverterInfo::date__textonly()
 //-----------------------------------------------------------------------
 void ConverterInfo::description()
 {
-    s_->BeginNotEmptyElement("description");
+    s_->BeginNotEmptyElement(E_DESCRIPTION);
 
     //<title-info>
     title_info();
     //</title-info>
 
     //<src-title-info>
-    s_->SkipIfElement("src-title-info");
+    s_->SkipIfElement(E_SRC_TITLE_INFO);
     //</src-title-info>
 
     //<document-info>
-    s_->CheckAndSkipElement("document-info");
+    s_->CheckAndSkipElement(E_DOCUMENT_INFO);
     //</document-info>
 
     //<publish-info>
-    if(s_->IsNextElement("publish-info"))
+    if(s_->IsNextElement(E_PUBLISH_INFO))
         publish_info();
     //</publish-info>
 
     s_->SkipRestOfElementContent(); // skip rest of <description>
 }
 
+//-----------------------------------------------------------------------
+void ConverterInfo::image()
+{
+    AttrMap attrmap;
+    bool notempty = s_->BeginElement(E_IMAGE, &attrmap);
+
+    String href = Findhref(attrmap);
+    if(coverId_.empty() && href.length() > 1 && href[0] == '#')
+        coverId_ = href.substr(1);
+
+    if(notempty)
+        s_->SkipRestOfElementContent();
+}
+
 //-----------------------------------------------------------------------
 String ConverterInfo::isbn()
 {
-    if(!s_->BeginElement("isbn"))
+    if(!s_->BeginElement(E_ISBN))
         return "";
 
     String text;
     SetScannerDataMode setDataMode(s_);
     if(s_->LookAhead().type_ == LexScanner::DATA)
-        text = s_->GetToken().s_;
+        text = s_->GetToken().s_.str();
     s_->EndElement();
     return text;
 }
@@ -280,33 +345,33 @@ String ConverterInfo::isbn()
 //-----------------------------------------------------------------------
 void ConverterInfo::lang()
 {
-    lang_ = s_->SimpleTextElement("lang");
+    lang_ = s_->SimpleTextElement(E_LANG);
 }
 
 //-----------------------------------------------------------------------
 void ConverterInfo::publish_info()
 {
-    if(!s_->BeginElement("publish-info"))
+    if(!s_->BeginElement(E_PUBLISH_INFO))
         return;
 
     //<book-name>
-    s_->SkipIfElement("book-name");
+    s_->SkipIfElement(E_BOOK_NAME);
     //</book-name>
 
     //<publisher>
-    s_->SkipIfElement("publisher");
+    s_->SkipIfElement(E_PUBLISHER);
     //</publisher>
 
     //<city>
-    s_->SkipIfElement("city");
+    s_->SkipIfElement(E_CITY);
     //</city>
 
     //<year>
-    s_->SkipIfElement("year");
+    s_->SkipIfElement(E_YEAR);
     //</year>
 
     //<isbn>
-    if(s_->IsNextElement("isbn"))
+    if(s_->IsNextElement(E_ISBN))
         isbn_ = isbn();
     //</isbn>
 
@@ -317,11 +382,11 @@ void ConverterInfo::publish_info()
 void ConverterInfo::sequence()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("sequence", &attrmap);
+    bool notempty = s_->BeginElement(E_SEQUENCE, &attrmap);
 
-    String name = attrmap["name"];
+    String name = attrmap.Get(A_NAME);
     if(!name.empty())
-        sequences_.push_back(seqvector::value_type(name, attrmap["number"]));
+        sequences_.push_back(seqvector::value_type(name, attrmap.Get(A_NUMBER)));
 
     if(notempty)
         s_->EndElement();
@@ -330,17 +395,17 @@ void ConverterInfo::sequence()
 //-----------------------------------------------------------------------
 void ConverterInfo::title_info()
 {
-    s_->BeginNotEmptyElement("title-info");
+    s_->BeginNotEmptyElement(E_TITLE_INFO);
 
     //<genre>
-    s_->CheckAndSkipElement("genre");
-    s_->SkipAll("genre");
+    s_->CheckAndSkipElement(E_GENRE);
+    s_->SkipAll(E_GENRE);
     //</genre>
 
     //<author>
     do
         author();
-    while(s_->IsNextElement("author"));
+    while(s_->IsNextElement(E_AUTHOR));
     //<author>
 
     //<book-title>
@@ -348,20 +413,21 @@ void ConverterInfo::title_info()
     //</book-title>
 
     //<annotation>
-    s_->SkipIfElement("annotation");
+    s_->SkipIfElement(E_ANNOTATION);
     //</annotation>
 
     //<keywords>
-    s_->SkipIfElement("keywords");
+    s_->SkipIfElement(E_KEYWORDS);
     //</keywords>
 
     //<date>
-    if(s_->IsNextElement("date"))
+    if(s_->IsNextElement(E_DATE))
         title_info_date_ = date__textonly();
     //<date>
 
     //<coverpage>
-    s_->SkipIfElement("coverpage");
+    if(s_->IsNextElement(E_COVERPAGE))
+        coverpage();
     //</coverpage>
 
     //<lang>
@@ -369,15 +435,15 @@ void ConverterInfo::title_info()
     //</lang>
 
     //<src-lang>
-    s_->SkipIfElement("src-lang");
+    s_->SkipIfElement(E_SRC_LANG);
     //</src-lang>
 
     //<translator>
-    s_->SkipIfElement("translator");
+    s_->SkipIfElement(E_TRANSLATOR);
     //</translator>
 
     //<sequence>
-    while(s_->IsNextElement("sequence"))
+    while(s_->IsNextElement(E_SEQUENCE))
         sequence();
     //</sequence>
 
@@ -390,5 +456,74 @@ void FB2TOEPUB_DECL DoPrintInfo (const String &in)
     conv->Scan();
 }
 
+//-----------------------------------------------------------------------
+// Decoded image is kept in memory, output file is written only if it's valid
+class OutMemStm : public OutStmI
+{
+public:
+    std::vector<char> data_;
+
+    //virtuals
+    void PutChar(char c)                    {data_.push_back(c);}
+    void Write(const void *p, size_t cnt)
+    {
+        const char *cp = reinterpret_cast<const char*>(p);
+        data_.insert(data_.end(), cp, cp + cnt);
+    }
+};
+
+//-----------------------------------------------------------------------
+// Pass 1 records offsets of binaries, so the scanner is restored right
+// at the cover <binary> and only this element is scanned once again.
+//-----------------------------------------------------------------------
+void FB2TOEPUB_DECL DoSaveCover (const String &in, const String &out)
+{
+    Ptr<InStm> pin = CreateInUnicodeStm(CreateUnpackStm(in.c_str()));
+
+    Ptr<ConverterInfo> info = new ConverterInfo(in);
+    info->ScanDescription(pin);
+    if(info->CoverId().empty())
+        ExternalError(in + ": no cover image");
+
+    pin->Rewind();
+    Ptr<LexScanner> s = CreateScanner(pin);
+    UnitArray units;
+    OffsetMap offsets;
+    DoConvertionPass1(s, &units, &offsets);
+
+    OffsetMap::const_iterator cit = offsets.begin(), cit_end = offsets.end();
+    for(; cit != cit_end; ++cit)
+        if(cit->element_ == E_BINARY && cit->id_ == info->CoverId())
+            break;
+    if(cit == cit_end)
+        ExternalError(in + ": cover image binary " + info->CoverId() + " not found");
+
+    //<binary>
+    s->Restore(cit->cp_);
+    OutMemStm image;
+    {
+        SetScannerDataMode setDataMode(s);
+        SetScannerChunkMode setChunkMode(s);
+        if(s->LookAhead().type_ != LexScanner::DATA)
+            s->Error("<binary> data expected");
+
+        Base64Decoder decoder(&image);
+        while(s->LookAhead().type_ == LexScanner::DATA)
+        {
+            const LexScanner::Token &t = s->GetToken();
+            if(!decoder.Decode(t.s_.data(), t.s_.size()))
+                s->Error("base64 error");
+        }
+        if(!decoder.Finish())
+            s->Error("base64 error");
+    }
+    s->EndElement();
+    //</binary>
+
+    if(image.data_.empty())
+        ExternalError(in + ": cover image is empty");
+    CreateOutFileStm(out.c_str())->Write(&image.data_[0], image.data_.size());
+}
+
 
 };  //namespace Fb2ToEpub
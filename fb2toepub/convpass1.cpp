@@ -30,34 +30,66 @@ namespace Fb2ToEpub
 
 //-----------------------------------------------------------------------
 // CONVERTER PASS 1 IMPLEMENTATION
+// Document is scanned by top-level parts (see Step), so scanning of
+// pushed input can be suspended between them.
 //-----------------------------------------------------------------------
-class FB2TOEPUB_DECL ConverterPass1 : public Object, Noncopyable
+static const Unit::BodyType bodyTypes[] = {Unit::MAIN, Unit::NOTES, Unit::COMMENTS};
+static const int            maxBodyCnt  = sizeof(bodyTypes) / sizeof(bodyTypes[0]);
+
+class FB2TOEPUB_DECL ConverterPass1 : public ConvertionPass1, Noncopyable
 {
 public:
-    ConverterPass1(LexScanner *scanner, UnitArray *units) : s_(scanner), units_(units), sectionCnt_(0), textMode_(false), bodyType_(Unit::BODY_NONE) {}
+    ConverterPass1(LexScanner *scanner, UnitArray *units, OffsetMap *offsets)
+        : s_(scanner), units_(units), offsets_(offsets), sectionCnt_(0), textMode_(false), bodyType_(Unit::BODY_NONE),
+          step_(STEP_HEAD), bodyCnt_(0), retrySize_(0) {}
+    ConverterPass1(PushScanner *scanner, UnitArray *units, OffsetMap *offsets)
+        : s_(scanner), push_(scanner), units_(units), offsets_(offsets), sectionCnt_(0), textMode_(false), bodyType_(Unit::BODY_NONE),
+          step_(STEP_HEAD), bodyCnt_(0), retrySize_(0) {}
 
     void Scan();
 
+    //virtuals
+    bool Resume();
+
 private:
+    // top-level parts of the document
+    enum StepType
+    {
+        STEP_HEAD,          // up to the first <body>
+        STEP_BODY,          // <body> up to the first <section>
+        STEP_SECTION,       // top-level <section>
+        STEP_NEXT_SECTION,  // next top-level <section> or </body>
+        STEP_NEXT_BODY,     // next <body> or binaries
+        STEP_BINARY,        // next <binary>
+        STEP_DONE
+    };
+
     Ptr<LexScanner>         s_;
+    Ptr<PushScanner>        push_;      // the same scanner in push mode
     UnitArray               *units_;
+    OffsetMap               *offsets_;
     int                     sectionCnt_;
     bool                    textMode_;
     Unit::BodyType          bodyType_;
     std::set<String>        xlns_;      // xlink namespaces
     std::set<String>        allRefIds_; // all ref ids
+    StepType                step_;
+    int                     bodyCnt_;
+    std::size_t             retrySize_; // input size to scan interrupted step again
 
+    void Step                   ();
     void SwitchUnitIfSizeAbove  (std::size_t size, int parent);
-    const String* AddId         (const AttrMap &attrmap);
+    void AddOffset              (ElementType element, int unit, const String &id = "");
+    const TextView* AddId       (const AttrMap &attrmap);
     String Findhref             (const AttrMap &attrmap) const;
-    void ParseTextAndEndElement (const String &element, String *plainText);
+    void ParseTextAndEndElement (ElementType element, String *plainText);
 
     // FictionBook elements
     void FictionBook            ();
     void a                      (String *plainText);
     void annotation             (bool startUnit = false);
     //void author                 ();
-    //void binary                 ();
+    void binary                 ();
     void body                   (Unit::BodyType bodyType);
     //void book_name              ();
     //void book_title             ();
@@ -123,8 +155,109 @@ private:
 //-----------------------------------------------------------------------
 void ConverterPass1::Scan()
 {
-    s_->SkipXMLDeclaration();
-    FictionBook();
+    while(step_ != STEP_DONE)
+        Step();
+}
+
+//-----------------------------------------------------------------------
+bool ConverterPass1::Resume()
+{
+    if(!push_)
+        InternalError(__FILE__, __LINE__, "pass 1 scanner is not in push mode");
+
+    while(step_ != STEP_DONE)
+    {
+        // interrupted step is scanned again when input is doubled,
+        // so every part of the input is scanned no more than three times
+        std::size_t avail = push_->Available();
+        if(avail < retrySize_ && !push_->IsFinished())
+            return false;
+
+        // a step modifies only the last unit and appends new ones
+        std::size_t unitCnt = units_->size(), offsetCnt = offsets_ ? offsets_->size() : 0;
+        Unit last = unitCnt ? units_->back() : Unit();
+        int sectionCnt = sectionCnt_;
+        Unit::BodyType bodyType = bodyType_;
+        std::set<String> xlns = xlns_;
+
+        push_->Mark();
+        try
+        {
+            Step();
+        }
+        catch(const NeedInput&)
+        {
+            push_->Reset();
+            units_->erase(units_->begin() + unitCnt, units_->end());
+            if(unitCnt)
+                units_->back() = last;
+            if(offsets_)
+                offsets_->erase(offsets_->begin() + offsetCnt, offsets_->end());
+            sectionCnt_ = sectionCnt;
+            bodyType_ = bodyType;
+            xlns_ = xlns;
+            retrySize_ = 2 * avail;
+            return false;
+        }
+        retrySize_ = 0;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass1::Step()
+{
+    switch(step_)
+    {
+    case STEP_HEAD:
+        s_->SkipXMLDeclaration();
+        FictionBook();
+        step_ = STEP_BODY;
+        break;
+
+    case STEP_BODY:
+        body(bodyTypes[bodyCnt_]);
+        ++bodyCnt_;
+        step_ = STEP_SECTION;
+        break;
+
+    case STEP_SECTION:
+        //<section>
+        section(-1);
+        //</section>
+        step_ = STEP_NEXT_SECTION;
+        break;
+
+    case STEP_NEXT_SECTION:
+        if(s_->IsNextElement(E_SECTION))
+            step_ = STEP_SECTION;
+        else
+        {
+            s_->EndElement();   // </body>
+            step_ = STEP_NEXT_BODY;
+        }
+        break;
+
+    case STEP_NEXT_BODY:
+        if(bodyCnt_ < maxBodyCnt && s_->IsNextElement(E_BODY))
+            step_ = STEP_BODY;
+        else
+            // binaries don't affect document structure, scan them only to find their offsets
+            step_ = offsets_ ? STEP_BINARY : STEP_DONE;
+        break;
+
+    case STEP_BINARY:
+        //<binary>
+        if(s_->IsNextElement(E_BINARY))
+            binary();
+        else
+            step_ = STEP_DONE;
+        //</binary>
+        break;
+
+    default:
+        InternalError(__FILE__, __LINE__, "pass 1 is already done");
+    }
 }
 
 //-----------------------------------------------------------------------
@@ -135,17 +268,30 @@ void ConverterPass1::SwitchUnitIfSizeAbove(std::size_t size, int parent)
 }
 
 //-----------------------------------------------------------------------
-const String* ConverterPass1::AddId(const AttrMap &attrmap)
+void ConverterPass1::AddOffset(ElementType element, int unit, const String &id)
 {
-    AttrMap::const_iterator cit = attrmap.find("id");
-    if(cit == attrmap.end())
+    if(!offsets_)
+        return;
+
+    // called right after start tag, there is nothing scanned ahead
+    offsets_->push_back(ElementOffset(element, unit, id));
+    if(!s_->GetCheckpoint(&offsets_->back().cp_))
+        InternalError(__FILE__, __LINE__, "can't get scanner checkpoint");
+}
+
+//-----------------------------------------------------------------------
+const TextView* ConverterPass1::AddId(const AttrMap &attrmap)
+{
+    const TextView *id = attrmap.Find(A_ID);
+    if(!id)
         return NULL;
 
-    if(allRefIds_.find(cit->second) != allRefIds_.end())
+    String sid = id->str();
+    if(allRefIds_.find(sid) != allRefIds_.end())
         return NULL;    // ignore second instance
 
-    units_->back().refIds_.push_back(cit->second);
-    return &cit->second;
+    units_->back().refIds_.push_back(sid);
+    return id;
 }
 
 //-----------------------------------------------------------------------
@@ -154,22 +300,18 @@ String ConverterPass1::Findhref(const AttrMap &attrmap) const
     std::set<String>::const_iterator cit = xlns_.begin(), cit_end = xlns_.end();
     for(; cit != cit_end; ++cit)
     {
-        String href;
-        if(cit->empty())
-            href = "href";
-        else
-            href = (*cit)+":href";
-        AttrMap::const_iterator ait = attrmap.find(href);
-        if(ait != attrmap.end())
-            return ait->second;
+        const TextView *href = attrmap.Find(A_HREF, cit->c_str());
+        if(href)
+            return href->str();
     }
     return "";
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass1::ParseTextAndEndElement(const String &element, String *plainText)
+void ConverterPass1::ParseTextAndEndElement(ElementType element, String *plainText)
 {
     SetScannerDataMode setDataMode(s_);
+    SetScannerChunkMode setChunkMode(s_);
     for(;;)
     {
         LexScanner::Token t = s_->LookAhead();
@@ -183,34 +325,46 @@ void ConverterPass1::ParseTextAndEndElement(const String &element, String *plain
             s_->GetToken();
             units_->back().size_ += t.size_;
             if(plainText)
-                *plainText += t.s_;
+                plainText->append(t.s_.data(), t.s_.size());
             continue;
 
         case LexScanner::START:
             //<strong>, <emphasis>, <stile>, <a>, <strikethrough>, <sub>, <sup>, <code>, <image>
-            if(!t.s_.compare("strong"))
+            switch(t.elem_)
+            {
+            case E_STRONG:
                 strong(plainText);
-            else if(!t.s_.compare("emphasis"))
+                break;
+            case E_EMPHASIS:
                 emphasis(plainText);
-            else if(!t.s_.compare("style"))
+                break;
+            case E_STYLE:
                 style(plainText);
-            else if(!t.s_.compare("a"))
+                break;
+            case E_A:
                 a(plainText);
-            else if(!t.s_.compare("strikethrough"))
+                break;
+            case E_STRIKETHROUGH:
                 strikethrough(plainText);
-            else if(!t.s_.compare("sub"))
+                break;
+            case E_SUB:
                 sub(plainText);
-            else if(!t.s_.compare("sup"))
+                break;
+            case E_SUP:
                 sup(plainText);
-            else if(!t.s_.compare("code"))
+                break;
+            case E_CODE:
                 code(plainText);
-            else if(!t.s_.compare("image"))
+                break;
+            case E_IMAGE:
                 image(true);
-            else
-            {
-                std::ostringstream ss;
-                ss << "<" << t.s_ << "> unexpected in <" << element + ">";
-                s_->Error(ss.str());
+                break;
+            default:
+                {
+                    std::ostringstream ss;
+                    ss << "<" << t.s_ << "> unexpected in <" << ElementName(element) << ">";
+                    s_->Error(ss.str());
+                }
             }
             continue;
             //</strong>, </emphasis>, </stile>, </a>, </strikethrough>, </sub>, </sup>, </code>, </image>
@@ -220,33 +374,34 @@ void ConverterPass1::ParseTextAndEndElement(const String &element, String *plain
 
 
 //-----------------------------------------------------------------------
+// Scans up to the first <body>, bodies are scanned by Step
 void ConverterPass1::FictionBook()
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("FictionBook", &attrmap);
+    s_->BeginNotEmptyElement(E_FICTIONBOOK, &attrmap);
 
     // namespaces
-    AttrMap::const_iterator cit = attrmap.begin(), cit_end = attrmap.end();
     bool has_fb = false, has_emptyfb = false;
-    for(; cit != cit_end; ++cit)
+    for(std::size_t i = 0; i < attrmap.size(); ++i)
     {
         static const String xmlns = "xmlns";
         static const std::size_t xmlns_len = xmlns.length();
         static const String fbID = "http://www.gribuser.ru/xml/fictionbook/2.0", xlID = "http://www.w3.org/1999/xlink";
 
-        if(!cit->second.compare(fbID))
+        const String name = attrmap[i].name_.str();
+        if(!attrmap[i].value_.compare(fbID))
         {
-            if(!cit->first.compare(xmlns))
+            if(!name.compare(xmlns))
                 has_emptyfb = true;
-            else if(cit->first.compare(0, xmlns_len+1, xmlns+":"))
+            else if(name.compare(0, xmlns_len+1, xmlns+":"))
                 s_->Error("bad FictionBook namespace definition");
             has_fb = true;
         }
-        else if(!cit->second.compare(xlID))
+        else if(!attrmap[i].value_.compare(xlID))
         {
-            if(cit->first.compare(0, xmlns_len+1, xmlns+":"))
+            if(name.compare(0, xmlns_len+1, xmlns+":"))
                 s_->Error("bad xlink namespace definition");
-            xlns_.insert(cit->first.substr(xmlns_len+1));
+            xlns_.insert(name.substr(xmlns_len+1));
         }
     }
     if(!has_fb)
@@ -255,27 +410,19 @@ void ConverterPass1::FictionBook()
         s_->Error("non-empty FictionBook namespace not implemented");
 
     //<stylesheet>
-    s_->SkipAll("stylesheet");
+    s_->SkipAll(E_STYLESHEET);
     //</stylesheet>
 
     //<description>
     description();
     //</description>
-
-    //<body>
-    body(Unit::MAIN);
-    if(s_->IsNextElement("body"))
-        body(Unit::NOTES);
-    if(s_->IsNextElement("body"))
-        body(Unit::COMMENTS);
-    //</body>
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::a(String *plainText)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("a", &attrmap);
+    bool notempty = s_->BeginElement(E_A, &attrmap);
 
     String id = Findhref(attrmap);
     if(!id.empty() && id[0] == '#')
@@ -285,6 +432,7 @@ void ConverterPass1::a(String *plainText)
         return;
 
     SetScannerDataMode setDataMode(s_);
+    SetScannerChunkMode setChunkMode(s_);
     for(;;)
     {
         LexScanner::Token t = s_->LookAhead();
@@ -298,32 +446,43 @@ void ConverterPass1::a(String *plainText)
             s_->GetToken();
             units_->back().size_ += t.size_;
             if(plainText)
-                *plainText += t.s_;
+                plainText->append(t.s_.data(), t.s_.size());
             continue;
 
         case LexScanner::START:
             //<strong>, <emphasis>, <stile>, <strikethrough>, <sub>, <sup>, <code>, <image>
-            if(!t.s_.compare("strong"))
+            switch(t.elem_)
+            {
+            case E_STRONG:
                 strong(plainText);
-            else if(!t.s_.compare("emphasis"))
+                break;
+            case E_EMPHASIS:
                 emphasis(plainText);
-            else if(!t.s_.compare("style"))
+                break;
+            case E_STYLE:
                 style(plainText);
-            else if(!t.s_.compare("strikethrough"))
+                break;
+            case E_STRIKETHROUGH:
                 strikethrough(plainText);
-            else if(!t.s_.compare("sub"))
+                break;
+            case E_SUB:
                 sub(plainText);
-            else if(!t.s_.compare("sup"))
+                break;
+            case E_SUP:
                 sup(plainText);
-            else if(!t.s_.compare("code"))
+                break;
+            case E_CODE:
                 code(plainText);
-            else if(!t.s_.compare("image"))
+                break;
+            case E_IMAGE:
                 image(true);
-            else
-            {
-                std::ostringstream ss;
-                ss << "<" << t.s_ << "> unexpected in <a>";
-                s_->Error(ss.str());
+                break;
+            default:
+                {
+                    std::ostringstream ss;
+                    ss << "<" << t.s_ << "> unexpected in <a>";
+                    s_->Error(ss.str());
+                }
             }
             continue;
             //</strong>, </emphasis>, </stile>, </strikethrough>, </sub>, </sup>, </code>, </image>
@@ -335,7 +494,7 @@ void ConverterPass1::a(String *plainText)
 void ConverterPass1::annotation(bool startUnit)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("annotation", &attrmap);
+    bool notempty = s_->BeginElement(E_ANNOTATION, &attrmap);
     if(startUnit)
         units_->push_back(Unit(bodyType_, Unit::ANNOTATION, 0, -1));
     AddId(attrmap);
@@ -345,23 +504,32 @@ void ConverterPass1::annotation(bool startUnit)
     for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
     {
         //<p>, <poem>, <cite>, <subtitle>, <empty-line>, <table>
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
+        {
+        case E_P:
             p();
-        else if(!t.s_.compare("poem"))
+            break;
+        case E_POEM:
             poem();
-        else if(!t.s_.compare("cite"))
+            break;
+        case E_CITE:
             cite();
-        else if(!t.s_.compare("subtitle"))
+            break;
+        case E_SUBTITLE:
             subtitle();
-        else if(!t.s_.compare("empty-line"))
+            break;
+        case E_EMPTY_LINE:
             empty_line();
-        else if(!t.s_.compare("table"))
+            break;
+        case E_TABLE:
             table();
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <annotation>";
-            s_->Error(ss.str());
+            break;
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <annotation>";
+                s_->Error(ss.str());
+            }
         }
         //</p>, </poem>, </cite>, </subtitle>, </empty-line>, </table>
     }
@@ -370,75 +538,82 @@ void ConverterPass1::annotation(bool startUnit)
 }
 
 //-----------------------------------------------------------------------
+void ConverterPass1::binary()
+{
+    AttrMap attrmap;
+    s_->BeginNotEmptyElement(E_BINARY, &attrmap);
+    AddOffset(E_BINARY, -1, attrmap.Get(A_ID));
+    s_->SkipRestOfElementContent();
+}
+
+//-----------------------------------------------------------------------
+// Scans up to the first <section>, sections and </body> are scanned by Step
 void ConverterPass1::body(Unit::BodyType bodyType)
 {
-    s_->BeginNotEmptyElement("body");
+    s_->BeginNotEmptyElement(E_BODY);
+    AddOffset(E_BODY, units_->size());
 
     bodyType_ = bodyType;
 
     //<image>
-    if(s_->IsNextElement("image"))
+    if(s_->IsNextElement(E_IMAGE))
         image(false, Unit::IMAGE);
     //</image>
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
     {
         title(NULL, true);
     }
     //</title>
 
     //<title>
-    while(s_->IsNextElement("epigraph"))
+    while(s_->IsNextElement(E_EPIGRAPH))
         epigraph();
     //</title>
-
-    do
-    {
-        //<section>
-        section(-1);
-        //</section>
-    }
-    while(s_->IsNextElement("section"));
-
-    s_->EndElement();
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::cite()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("cite", &attrmap);
+    bool notempty = s_->BeginElement(E_CITE, &attrmap);
     AddId(attrmap);
     if(!notempty)
         return;
 
-    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
+    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START && t.elem_ != E_TEXT_AUTHOR; t = s_->LookAhead())
     {
         //<p>, <subtitle>, <empty-line>, <poem>, <table>
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
+        {
+        case E_P:
             p();
-        else if(!t.s_.compare("subtitle"))
+            break;
+        case E_SUBTITLE:
             subtitle();
-        else if(!t.s_.compare("empty-line"))
+            break;
+        case E_EMPTY_LINE:
             empty_line();
-        else if(!t.s_.compare("poem"))
+            break;
+        case E_POEM:
             poem();
-        else if(!t.s_.compare("table"))
+            break;
+        case E_TABLE:
             table();
-        else if(!t.s_.compare("text-author"))
             break;
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <cite>";
-            s_->Error(ss.str());
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <cite>";
+                s_->Error(ss.str());
+            }
         }
         //</p>, </subtitle>, </empty-line>, </poem>, </table>
     }
 
     //<text-author>
-    while(s_->IsNextElement("text-author"))
+    while(s_->IsNextElement(E_TEXT_AUTHOR))
         text_author();
     //</text-author>
 
@@ -448,25 +623,25 @@ void ConverterPass1::cite()
 //-----------------------------------------------------------------------
 void ConverterPass1::code(String *plainText)
 {
-    if(s_->BeginElement("code"))
-        ParseTextAndEndElement("code", plainText);
+    if(s_->BeginElement(E_CODE))
+        ParseTextAndEndElement(E_CODE, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::coverpage()
 {
-    s_->BeginNotEmptyElement("coverpage");
+    s_->BeginNotEmptyElement(E_COVERPAGE);
     units_->push_back(Unit(bodyType_, Unit::COVERPAGE, 0, -1));
     do
         image(true);
-    while(s_->IsNextElement("image"));
+    while(s_->IsNextElement(E_IMAGE));
     s_->EndElement();
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::description()
 {
-    s_->BeginNotEmptyElement("description");
+    s_->BeginNotEmptyElement(E_DESCRIPTION);
     
     //<title-info>
     title_info();
@@ -478,14 +653,14 @@ void ConverterPass1::description()
 //-----------------------------------------------------------------------
 void ConverterPass1::emphasis(String *plainText)
 {
-    if(s_->BeginElement("emphasis"))
-        ParseTextAndEndElement("emphasis", plainText);
+    if(s_->BeginElement(E_EMPHASIS))
+        ParseTextAndEndElement(E_EMPHASIS, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::empty_line()
 {
-    if(s_->BeginElement("empty-line"))
+    if(s_->BeginElement(E_EMPTY_LINE))
         s_->EndElement();
 }
 
@@ -493,35 +668,40 @@ void ConverterPass1::empty_line()
 void ConverterPass1::epigraph()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("epigraph", &attrmap);
+    bool notempty = s_->BeginElement(E_EPIGRAPH, &attrmap);
     AddId(attrmap);
     if(!notempty)
         return;
 
-    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
+    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START && t.elem_ != E_TEXT_AUTHOR; t = s_->LookAhead())
     {
         //<p>, <poem>, <cite>, <empty-line>
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
+        {
+        case E_P:
             p();
-        else if(!t.s_.compare("poem"))
+            break;
+        case E_POEM:
             poem();
-        else if(!t.s_.compare("cite"))
+            break;
+        case E_CITE:
             cite();
-        else if(!t.s_.compare("empty-line"))
+            break;
+        case E_EMPTY_LINE:
             empty_line();
-        else if(!t.s_.compare("text-author"))
             break;
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <epigraph>";
-            s_->Error(ss.str());
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <epigraph>";
+                s_->Error(ss.str());
+            }
         }
         //</p>, </poem>, </cite>, </empty-line>
     }
 
     //<text-author>
-    while(s_->IsNextElement("text-author"))
+    while(s_->IsNextElement(E_TEXT_AUTHOR))
         text_author();
     //</text-author>
 
@@ -532,7 +712,7 @@ void ConverterPass1::epigraph()
 void ConverterPass1::image(bool in_line, Unit::Type unitType)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("image", in_line ? NULL : &attrmap);
+    bool notempty = s_->BeginElement(E_IMAGE, in_line ? NULL : &attrmap);
 
     if(unitType != Unit::UNIT_NONE)
         units_->push_back(Unit(bodyType_, unitType, 0, -1));
@@ -549,42 +729,42 @@ void ConverterPass1::image(bool in_line, Unit::Type unitType)
 void ConverterPass1::p(String *plainText)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("p", &attrmap);
+    bool notempty = s_->BeginElement(E_P, &attrmap);
     AddId(attrmap);
     if(notempty)
-        ParseTextAndEndElement("p", plainText);
+        ParseTextAndEndElement(E_P, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::poem()
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("poem", &attrmap);
+    s_->BeginNotEmptyElement(E_POEM, &attrmap);
     AddId(attrmap);
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
         title();
     //</title>
 
     //<epigraph>
-    while(s_->IsNextElement("epigraph"))
+    while(s_->IsNextElement(E_EPIGRAPH))
         epigraph();
     //</epigraph>
 
     //<stanza>
     do
         stanza();
-    while(s_->IsNextElement("stanza"));
+    while(s_->IsNextElement(E_STANZA));
     //</stanza>
 
     //<text-author>
-    while(s_->IsNextElement("text-author"))
+    while(s_->IsNextElement(E_TEXT_AUTHOR))
         text_author();
     //</text-author>
 
     //<date>
-    s_->SkipIfElement("date");
+    s_->SkipIfElement(E_DATE);
     //</date>
 
     s_->EndElement();
@@ -594,20 +774,22 @@ void ConverterPass1::poem()
 void ConverterPass1::section(int parent)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("section", &attrmap);
+    bool notempty = s_->BeginElement(E_SECTION, &attrmap);
 
     int idx = units_->size();
+    if(parent < 0)
+        AddOffset(E_SECTION, idx);
     units_->push_back(Unit(bodyType_, Unit::SECTION, sectionCnt_++, parent));
-    const String *id = AddId(attrmap);
+    const TextView *id = AddId(attrmap);
     if(!notempty)
         return;
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
     {
         // check if it has anchor
         if((bodyType_ == Unit::NOTES || bodyType_ == Unit::COMMENTS) && id && !id->empty())
-            units_->back().noteRefId_ = *id;
+            units_->back().noteRefId_ = id->str();
 
         String plainText;
         title(&plainText);
@@ -616,69 +798,67 @@ void ConverterPass1::section(int parent)
     //</title>
 
     //<epigraph>
-    while(s_->IsNextElement("epigraph"))
+    while(s_->IsNextElement(E_EPIGRAPH))
         epigraph();
     //</epigraph>
 
     //<image>
-    if(s_->IsNextElement("image"))
+    if(s_->IsNextElement(E_IMAGE))
         image(false);
     //</image>
 
     //<annotation>
-    if(s_->IsNextElement("annotation"))
+    if(s_->IsNextElement(E_ANNOTATION))
         annotation();
     //</annotation>
 
-    if(s_->IsNextElement("section"))
+    if(s_->IsNextElement(E_SECTION))
         do
         {
             //<section>
             section(idx);
             //</section>
         }
-        while(s_->IsNextElement("section"));
+        while(s_->IsNextElement(E_SECTION));
     else
         for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
         {
             //<p>, <image>, <poem>, <subtitle>, <cite>, <empty-line>, <table>
-            if(!t.s_.compare("p"))
-                p();
-            else if(!t.s_.compare("image"))
+            switch(t.elem_)
             {
+            case E_P:
+                p();
+                break;
+            case E_IMAGE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE1, parent);
                 image(false);
-            }
-            else if(!t.s_.compare("poem"))
-            {
+                break;
+            case E_POEM:
                 SwitchUnitIfSizeAbove(UNIT_SIZE1, parent);
                 poem();
-            }
-            else if(!t.s_.compare("subtitle"))
-            {
+                break;
+            case E_SUBTITLE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE0, parent);
                 subtitle();
-            }
-            else if(!t.s_.compare("cite"))
-            {
+                break;
+            case E_CITE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE2, parent);
                 cite();
-            }
-            else if(!t.s_.compare("empty-line"))
-            {
+                break;
+            case E_EMPTY_LINE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE2, parent);
                 empty_line();
-            }
-            else if(!t.s_.compare("table"))
-            {
+                break;
+            case E_TABLE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE1, parent);
                 table();
-            }
-            else
-            {
-                std::ostringstream ss;
-                ss << "<" << t.s_ << "> unexpected in <section>";
-                s_->Error(ss.str());
+                break;
+            default:
+                {
+                    std::ostringstream ss;
+                    ss << "<" << t.s_ << "> unexpected in <section>";
+                    s_->Error(ss.str());
+                }
             }
             //</p>, </image>, </poem>, </subtitle>, </cite>, </empty-line>, </table>
 
@@ -691,21 +871,21 @@ void ConverterPass1::section(int parent)
 //-----------------------------------------------------------------------
 void ConverterPass1::stanza()
 {
-    s_->BeginNotEmptyElement("stanza");
+    s_->BeginNotEmptyElement(E_STANZA);
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
         title();
     //</title>
 
     //<title>
-    if(s_->IsNextElement("subtitle"))
+    if(s_->IsNextElement(E_SUBTITLE))
         subtitle();
     //</title>
 
     do
         v();
-    while(s_->IsNextElement("v"));
+    while(s_->IsNextElement(E_V));
 
     s_->EndElement();
 }
@@ -713,53 +893,53 @@ void ConverterPass1::stanza()
 //-----------------------------------------------------------------------
 void ConverterPass1::strikethrough(String *plainText)
 {
-    if(s_->BeginElement("strikethrough"))
-        ParseTextAndEndElement("strikethrough", plainText);
+    if(s_->BeginElement(E_STRIKETHROUGH))
+        ParseTextAndEndElement(E_STRIKETHROUGH, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::strong(String *plainText)
 {
-    if(s_->BeginElement("strong"))
-        ParseTextAndEndElement("strong", plainText);
+    if(s_->BeginElement(E_STRONG))
+        ParseTextAndEndElement(E_STRONG, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::style(String *plainText)
 {
-    if(s_->BeginElement("style"))
-        ParseTextAndEndElement("style", plainText);
+    if(s_->BeginElement(E_STYLE))
+        ParseTextAndEndElement(E_STYLE, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::sub(String *plainText)
 {
-    if(s_->BeginElement("sub"))
-        ParseTextAndEndElement("sub", plainText);
+    if(s_->BeginElement(E_SUB))
+        ParseTextAndEndElement(E_SUB, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::subtitle(String *plainText)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("subtitle", &attrmap);
+    bool notempty = s_->BeginElement(E_SUBTITLE, &attrmap);
     AddId(attrmap);
     if(notempty)
-        ParseTextAndEndElement("subtitle", plainText);
+        ParseTextAndEndElement(E_SUBTITLE, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::sup(String *plainText)
 {
-    if(s_->BeginElement("sup"))
-        ParseTextAndEndElement("sup", plainText);
+    if(s_->BeginElement(E_SUP))
+        ParseTextAndEndElement(E_SUP, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::table()
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("table", &attrmap);
+    s_->BeginNotEmptyElement(E_TABLE, &attrmap);
     AddId(attrmap);
     do
     {
@@ -767,7 +947,7 @@ void ConverterPass1::table()
         tr();
         //</tr>
     }
-    while(s_->IsNextElement("tr"));
+    while(s_->IsNextElement(E_TR));
     s_->EndElement();
 }
 
@@ -775,36 +955,36 @@ void ConverterPass1::table()
 void ConverterPass1::td()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("td", &attrmap);
+    bool notempty = s_->BeginElement(E_TD, &attrmap);
     AddId(attrmap);
     if(notempty)
-        ParseTextAndEndElement("td", NULL);
+        ParseTextAndEndElement(E_TD, NULL);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::text_author(String *plainText)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("text-author", &attrmap);
+    bool notempty = s_->BeginElement(E_TEXT_AUTHOR, &attrmap);
     AddId(attrmap);
     if(notempty)
-        ParseTextAndEndElement("text-author", plainText);
+        ParseTextAndEndElement(E_TEXT_AUTHOR, plainText);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::th()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("th", &attrmap);
+    bool notempty = s_->BeginElement(E_TH, &attrmap);
     AddId(attrmap);
     if(notempty)
-        ParseTextAndEndElement("th", NULL);
+        ParseTextAndEndElement(E_TH, NULL);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass1::title(String *plainText, bool startUnit)
 {
-    if(!s_->BeginElement("title"))
+    if(!s_->BeginElement(E_TITLE))
         return;
 
     String buf;
@@ -817,8 +997,9 @@ void ConverterPass1::title(String *plainText, bool startUnit)
 
     for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
     {
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
         {
+        case E_P:
             //<p>
             if(!plainText)
                 p();
@@ -829,20 +1010,20 @@ void ConverterPass1::title(String *plainText, bool startUnit)
                 *plainText = Concat(*plainText, " ", text);
             }
             //</p>
-        }
-        else if(!t.s_.compare("empty-line"))
-        {
+            break;
+        case E_EMPTY_LINE:
             //<empty-line>
             empty_line();
             if(plainText)
                 *plainText += " ";
             //</empty-line>
-        }
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <title>";
-            s_->Error(ss.str());
+            break;
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <title>";
+                s_->Error(ss.str());
+            }
         }
     }
 
@@ -855,37 +1036,37 @@ void ConverterPass1::title(String *plainText, bool startUnit)
 //-----------------------------------------------------------------------
 void ConverterPass1::title_info()
 {
-    s_->BeginNotEmptyElement("title-info");
+    s_->BeginNotEmptyElement(E_TITLE_INFO);
 
     //<genre>
-    s_->CheckAndSkipElement("genre");
-    s_->SkipAll("genre");
+    s_->CheckAndSkipElement(E_GENRE);
+    s_->SkipAll(E_GENRE);
     //</genre>
 
     //<author>
-    s_->CheckAndSkipElement("author");
-    s_->SkipAll("author");
+    s_->CheckAndSkipElement(E_AUTHOR);
+    s_->SkipAll(E_AUTHOR);
     //<author>
     
     //<book-title>
-    s_->CheckAndSkipElement("book-title");
+    s_->CheckAndSkipElement(E_BOOK_TITLE);
     //</book-title>
 
     //<annotation>
-    if(s_->IsNextElement("annotation"))
+    if(s_->IsNextElement(E_ANNOTATION))
         annotation(true);
     //</annotation>
 
     //<keywords>
-    s_->SkipIfElement("keywords");
+    s_->SkipIfElement(E_KEYWORDS);
     //</keywords>
 
     //<date>
-    s_->SkipIfElement("date");
+    s_->SkipIfElement(E_DATE);
     //<date>
 
     //<coverpage>
-    if(s_->IsNextElement("coverpage"))
+    if(s_->IsNextElement(E_COVERPAGE))
         coverpage();
     //</coverpage>
 
@@ -896,16 +1077,16 @@ void ConverterPass1::title_info()
 void ConverterPass1::tr()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("tr", &attrmap);
+    bool notempty = s_->BeginElement(E_TR, &attrmap);
     if(!notempty)
         return;
 
     for(;;)
     {
         //<th>, <td>
-        if(s_->IsNextElement("th"))
+        if(s_->IsNextElement(E_TH))
             th();
-        else if(s_->IsNextElement("td"))
+        else if(s_->IsNextElement(E_TD))
             td();
         else
             break;
@@ -919,19 +1100,25 @@ void ConverterPass1::tr()
 void ConverterPass1::v(String *plainText)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("v", &attrmap);
+    bool notempty = s_->BeginElement(E_V, &attrmap);
     AddId(attrmap);
     if(notempty)
-        ParseTextAndEndElement("v", plainText);
+        ParseTextAndEndElement(E_V, plainText);
 }
 
 
 //-----------------------------------------------------------------------
-void FB2TOEPUB_DECL DoConvertionPass1(LexScanner *scanner, UnitArray *units)
+void FB2TOEPUB_DECL DoConvertionPass1(LexScanner *scanner, UnitArray *units, OffsetMap *offsets)
 {
-    Ptr<ConverterPass1> conv = new ConverterPass1(scanner, units);
+    Ptr<ConverterPass1> conv = new ConverterPass1(scanner, units, offsets);
     conv->Scan();
 }
 
+//-----------------------------------------------------------------------
+Ptr<ConvertionPass1> FB2TOEPUB_DECL StartConvertionPass1(PushScanner *scanner, UnitArray *units, OffsetMap *offsets)
+{
+    return new ConverterPass1(scanner, units, offsets);
+}
+
 
 };  //namespace Fb2ToEpub
@@ -67,9 +67,9 @@ class SetLanguage
 public:
     SetLanguage(String *pstr, const AttrMap &attrmap) : pstr_(pstr), old_(*pstr)
     {
-        AttrMap::const_iterator cit = attrmap.find("xml:lang");
-        if(cit != attrmap.end())
-            *pstr_ = cit->second;
+        const TextView *lang = attrmap.Find(A_LANG, "xml");
+        if(lang)
+            *pstr_ = lang->str();
     }
     ~SetLanguage()
     {
@@ -79,34 +79,162 @@ public:
 
 
 //-----------------------------------------------------------------------
-static String EncodeStr(const String &str)
+// Encodes text into reusable buffer, the result is valid until next use of buffer
+static const char* EncodeStr(const char *s, std::size_t len, std::vector<char> *buf)
 {
-    std::vector<char> buf;
-    LexScanner::Encode(str.c_str(), &buf);
-    return &buf[0];
+    buf->clear();
+    LexScanner::Encode(s, len, buf);
+    buf->push_back('\0');
+    return &(*buf)[0];
+}
+static const char* EncodeStr(const String &str, std::vector<char> *buf)
+{
+    return EncodeStr(str.data(), str.size(), buf);
 }
 
 //-----------------------------------------------------------------------
 static void AddContentManifestFile(OutPackStm *pout, const String &id, const String &ref, const String &media_type)
 {
-    pout->WriteFmt("    <item id=\"%s\" href=\"%s\" media-type=\"%s\"/>\n", EncodeStr(id).c_str(), EncodeStr(ref).c_str(), EncodeStr(media_type).c_str());
+    std::vector<char> buf;
+    pout->WriteFmt("    <item id=\"%s\"", EncodeStr(id, &buf));
+    pout->WriteFmt(" href=\"%s\"", EncodeStr(ref, &buf));
+    pout->WriteFmt(" media-type=\"%s\"/>\n", EncodeStr(media_type, &buf));
 }
 
 
+//-----------------------------------------------------------------------
+// Hash table of reference ids (id attributes and internal href targets).
+// Every id gets dense index, so all data about references are kept in arrays.
+class RefIdTable
+{
+public:
+    RefIdTable() : slots_(0x100, -1) {}
+
+    int Find(const String &id) const    // -1 if not found
+    {
+        return slots_[Slot(id)];
+    }
+    int Add(const String &id)           // returns index of id
+    {
+        std::size_t slot = Slot(id);
+        if(slots_[slot] >= 0)
+            return slots_[slot];
+
+        ids_.push_back(id);
+        slots_[slot] = ids_.size() - 1;
+        if(ids_.size() * 2 > slots_.size())
+            Rehash();
+        return ids_.size() - 1;
+    }
+    std::size_t size() const                {return ids_.size();}
+    const String& operator[](int idx) const {return ids_[idx];}
+
+private:
+    strvector           ids_;
+    std::vector<int>    slots_;     // index of id or -1, size is power of 2
+
+    static std::size_t Hash(const String &id)
+    {
+        // FNV-1a
+        unsigned long hash = 2166136261UL;
+        for(String::const_iterator cit = id.begin(), cit_end = id.end(); cit != cit_end; ++cit)
+            hash = ((hash ^ static_cast<unsigned char>(*cit)) * 16777619UL) & 0xffffffffUL;
+        return hash;
+    }
+
+    std::size_t Slot(const String &id) const    // slot of id or empty slot for it
+    {
+        std::size_t mask = slots_.size() - 1;
+        for(std::size_t slot = Hash(id) & mask;; slot = (slot + 1) & mask)
+            if(slots_[slot] < 0 || ids_[slots_[slot]] == id)
+                return slot;
+    }
+
+    void Rehash()
+    {
+        slots_.assign(slots_.size() * 2, -1);
+        for(std::size_t i = 0; i < ids_.size(); ++i)
+            slots_[Slot(ids_[i])] = i;
+    }
+};
+
+
+//-----------------------------------------------------------------------
+// Part of unit text depending on output file layout
+struct Fixup
+{
+    enum Type
+    {
+        UNIT_START,     // beginning of unit (and maybe of new file), ref_ - original unit id
+        UNIT_END,       // end of last unit of body
+        REF_ID,         // remapped ref_
+        LINK_START,     // anchor of the first reference to note ref_
+        LINK_HREF,      // href of internal reference to ref_
+        LINK_END,       // end of anchor
+        NOTE_BACKLINK   // reference from note ref_ back to its anchor
+    };
+
+    Type                type_;
+    int                 ref_;                       // index of reference id, -1 if none
+    String              bodyXmlLang_, sectXmlLang_; // languages at UNIT_START
+    std::size_t         pos_;                       // position in deferred text
+
+    explicit Fixup(Type type, int ref = -1) : type_(type), ref_(ref), pos_(0) {}
+};
+
+//-----------------------------------------------------------------------
+// Single-pass mode output: text of all units is kept in memory
+// until output file layout is known
+class DeferredOutStm : public OutPackStm, Noncopyable
+{
+public:
+    Ptr<OutPackStm>     pout_;      // real output
+    std::vector<char>   text_;
+    std::vector<Fixup>  fixups_;
+
+    explicit DeferredOutStm(OutPackStm *pout) : pout_(pout) {}
+
+    void AddFixup(const Fixup &fixup)
+    {
+        fixups_.push_back(fixup);
+        fixups_.back().pos_ = text_.size();
+    }
+
+    //virtuals
+    void PutChar(char c)
+    {
+        text_.push_back(c);
+    }
+    void Write(const void *p, size_t cnt)
+    {
+        const char *pc = reinterpret_cast<const char*>(p);
+        text_.insert(text_.end(), pc, pc + cnt);
+    }
+    void BeginFile(const char*, bool)
+    {
+        InternalError(__FILE__, __LINE__, "file in deferred output");
+    }
+    void Close()
+    {
+        InternalError(__FILE__, __LINE__, "close of deferred output");
+    }
+};
+
+
 //-----------------------------------------------------------------------
 class ConverterPass2 : public Object, Noncopyable
 {
 public:
     ConverterPass2 (LexScanner *scanner,
-                    const strvector &css,
-                    const strvector &fonts,
+                    ExtResources *res,
                     const strvector &mfonts,
                     XlitConv *xlitConv,
                     UnitArray *units,
-                    OutPackStm *pout)
+                    OutPackStm *pout,
+                    bool singlePass = false,
+                    UnitArray *pass1Units = NULL)
                         :   s_                  (scanner),
-                            css_                (css),
-                            fonts_              (fonts),
+                            res_                (res),
                             mfonts_             (mfonts),
                             xlitConv_           (xlitConv),
                             units_              (*units),
@@ -117,19 +245,23 @@ public:
                             unitIdx_            (0),
                             unitActive_         (false),
                             unitHasId_          (false),
-                            sectionSize_        (0)
+                            sectionSize_        (0),
+                            anchorSet_          (false),
+                            singlePass_         (singlePass),
+                            pass1Units_         (pass1Units),
+                            bodyType_           (Unit::BODY_NONE),
+                            sectionCnt_         (0),
+                            parentUnit_         (-1),
+                            plainText_          (NULL)
     {
         coverPgIt_ = units_.end();
     }
 
     void Scan()
     {
-        BuildOutputLayout();
-        {
-            std::set<String> noteRefIds;
-            BuildReferenceMaps(&noteRefIds);
-            BuildAnchors(noteRefIds);
-        }
+        // in single-pass mode pass 1 data are collected while parsing
+        if(!singlePass_)
+            BuildLayout();
 
 #if 0
 #if defined(_DEBUG)
@@ -138,12 +270,11 @@ public:
                 printf ("%d %d-%d-%d %s size=%d, parent=%d, level = %d, %s.xhtml, noteRefId = \"%s\"\n", i, units_[i].bodyType_, units_[i].type_,
                         units_[i].id_, units_[i].title_.c_str(), units_[i].size_, units_[i].parent_, units_[i].level_, units_[i].file_.c_str(), units_[i].noteRefId_.c_str());
 
-            for(ReferenceMap::const_iterator cit = refidToNew_.begin(), cit_end = refidToNew_.end(); cit != cit_end; ++cit)
-                printf("%s -> %s\n", cit->first.c_str(), cit->second.c_str());
-            for(RefidInfoMap::const_iterator cit = refidToUnit_.begin(), cit_end = refidToUnit_.end(); cit != cit_end; ++cit)
-                printf("%s in %s\n", cit->first.c_str(), cit->second->file_.c_str());
-            for(ReferenceMap::const_iterator cit = noteidToAnchorId_.begin(), cit_end = noteidToAnchorId_.end(); cit != cit_end; ++cit)
-                printf("%s -> anchor %s\n", cit->first.c_str(), cit->second.c_str());
+            for(std::size_t i = 0; i < refInfo_.size(); ++i)
+                if(refInfo_[i].unit_)
+                    printf("%s -> %s in %s, anchor %d\n", refIds_[i].c_str(), refInfo_[i].newId_.c_str(), refInfo_[i].unit_->file_.c_str(), refInfo_[i].anchor_);
+            for(std::size_t i = 0; i < anchors_.size(); ++i)
+                printf("anchor %s in %s\n", anchors_[i].id_.c_str(), anchors_[i].unit_->file_.c_str());
         }
 #endif
 #endif
@@ -152,14 +283,10 @@ public:
         AddMimetype();
         AddContainer();
 
-        // scan all embedded fonts
-        ScanFonts("ttf", &ttffiles_);
-        ScanFonts("otf", &otffiles_);
-
         // add encryption.xml
         AddEncryption();
 
-        // scan and add stylesheet files
+        // add stylesheet files
         AddStyles();
 
         // perform fb2 file parsing
@@ -167,8 +294,8 @@ public:
         FictionBook();
 
         // add font files
-        AddFontFiles(ttffiles_);
-        AddFontFiles(otffiles_);
+        AddFontFiles(res_->ttffiles_);
+        AddFontFiles(res_->otffiles_);
 
         // rest of epub
         MakeCoverPageFirst();
@@ -178,7 +305,8 @@ public:
 
 private:
     Ptr<LexScanner>         s_;
-    const strvector         &css_, &fonts_, &mfonts_;
+    Ptr<ExtResources>       res_;
+    const strvector         &mfonts_;
     Ptr<XlitConv>           xlitConv_;
     UnitArray               &units_;
     Ptr<OutPackStm>         pout_;
@@ -191,28 +319,36 @@ private:
     };
     typedef std::vector<Binary> binvector;
 
-    // external file - result of directory scanning
-    struct ExtFile
+    // reference id data, indexed by refIds_ index
+    struct RefInfo
     {
-        String fname_, ospath_; // file name and OS path
-        ExtFile() {}
-        ExtFile(const String &fname, const String &ospath) : fname_(fname), ospath_(ospath) {}
+        String      newId_;     // unique reference id
+        const Unit  *unit_;     // unit containing this id
+        bool        note_;      // id of note or comment section
+        int         anchor_;    // index of anchor of the first reference to note, or -1
+        RefInfo() : unit_(NULL), note_(false), anchor_(-1) {}
     };
-    typedef std::vector<ExtFile> ExtFileVector;
+    typedef std::vector<RefInfo> RefInfoVector;
 
-    typedef std::map<String, const Unit*> RefidInfoMap;    // reference id -> Unit containing this id
+    // anchor of the first reference to note (note has back link to it)
+    struct Anchor
+    {
+        String      id_;        // unique anchor id
+        const Unit  *unit_;     // unit containing the anchor
+        bool        used_;      // already set
+        Anchor(const String &id, const Unit *unit) : id_(id), unit_(unit), used_(false) {}
+    };
+    typedef std::vector<Anchor> AnchorVector;
 
     int                     tocLevels_;         // number of levels of table of content
     UnitArray::iterator     coverPgIt_;         // pointer to unit describing cover image
     String                  coverFile_;         // cover image file name
     int                     coverBinIdx_;       // cover image index in binary section
     int                     uniqueIdIdx_;       // unique id counter
-    ReferenceMap            refidToNew_;        // (re)mapping of original reference id to unique reference id
-    RefidInfoMap            refidToUnit_;       // mapping unique reference id to unit containing this id
-    ReferenceMap            noteidToAnchorId_;  // mapping of note ref id to anchor ref id
-    std::set<String>        usedAnchorsids_;    // anchor ids already set
+    RefIdTable              refIds_;            // original reference ids
+    RefInfoVector           refInfo_;           // (re)mapping of original reference id to unique reference id and unit
+    AnchorVector            anchors_;           // anchors of references to notes
     strvector               cssfiles_;          // all stylesheet files
-    ExtFileVector           ttffiles_, otffiles_; // all font file description
     binvector               binaries_;          // all binary files
     std::set<String>        xlns_;              // xlink namespaces
     std::set<String>        allRefIds_;         // all ref ids
@@ -226,6 +362,17 @@ private:
     bool                    unitHasId_;
     std::size_t             sectionSize_;
     String                  bodyXmlLang_, sectXmlLang_;
+    bool                    anchorSet_;         // anchor of current reference is set
+    std::vector<char>       encbuf_;            // buffer for EncodeStr
+
+    // single-pass mode
+    bool                    singlePass_;
+    UnitArray               *pass1Units_;       // receives pass 1 data, if not NULL
+    Ptr<DeferredOutStm>     deferred_;          // output of units while file layout is unknown
+    Unit::BodyType          bodyType_;          // current body type
+    int                     sectionCnt_;        // section counter
+    int                     parentUnit_;        // parent of current section unit
+    String                  *plainText_;        // plain text of current title
 
 
     void AdjustUnitSizes        ();
@@ -234,8 +381,10 @@ private:
     String MakeUniqueId         (bool anchor = false);
     void BuiltFileLayout        (int levelToSplit);
     void BuildOutputLayout      ();
-    void BuildReferenceMaps     (std::set<String> *noteRefIds);
-    void BuildAnchors           (const std::set<String> &noteRefIds);
+    int RefIndex                (const String &id);
+    void BuildReferenceMaps     ();
+    void BuildAnchors           ();
+    void BuildLayout            ();
 
     String Findhref             (const AttrMap &attrmap) const;
 
@@ -243,20 +392,32 @@ private:
     void EndUnit                ();
     void SwitchUnitIfSizeAbove  (std::size_t size);
 
+    void WriteFixup             (const Fixup &fixup);
+    void ResolveFixup           (const Fixup &fixup);
+    const String& NewRefId      (int ref);
+    void WriteUnitStart         (const Fixup &fixup);
+    void WriteUnitEnd           ();
+    void WriteLinkStart         (int ref);
+    void WriteLinkHref          (int ref);
+    void WriteNoteBacklink      (int ref);
+
+    void BeginDeferred          ();
+    void EndDeferred            ();
+    void CollectId              (const AttrMap &attrmap);
+    void CollectText            (const LexScanner::Token &t);
+
     void AddMimetype            ();
     void AddContainer           ();
     void AddStyles              ();
-    void ScanFonts              (const char *ext, ExtFileVector *fontfiles);
     void AddFontFiles           (const ExtFileVector &fontfiles);    
     void MakeCoverPageFirst     ();
     void AddContentOpf          ();
     void AddTocNcx              ();
     void AddEncryption          ();
-    const String* AddId         (const AttrMap &attrmap);
-    void ParseTextAndEndElement (const String &element);
-    void CopyAttribute          (const String &attr, const AttrMap &attrmap);
+    const TextView* AddId       (const AttrMap &attrmap);
+    void ParseTextAndEndElement (ElementType element);
+    void CopyAttribute          (AttrType attr, const AttrMap &attrmap, const char *prefix = "");
     void CopyXmlLang            (const AttrMap &attrmap);
-    bool AddAnchorid            (const String &anchorid);
 
     // FictionBook elements
     void FictionBook            ();
@@ -264,7 +425,7 @@ private:
     void annotation             (bool startUnit = false);
     void author                 ();
     void binary                 ();
-    void body                   ();
+    void body                   (Unit::BodyType bodyType);
     //void book_name              ();
     void book_title             ();
     void cite                   ();
@@ -318,7 +479,7 @@ private:
     void td                     ();
     void text_author            ();
     void th                     ();
-    void title                  (bool startUnit, const String &anchorid = "");
+    void title                  (bool startUnit, String *plainText = NULL, const String &noteRefId = "");
     void title_info             ();
     void tr                     ();
     //void translator             ();
@@ -482,98 +643,113 @@ void ConverterPass2::BuildOutputLayout()
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass2::BuildReferenceMaps(std::set<String> *noteRefIds)
+int ConverterPass2::RefIndex(const String &id)
 {
-    ReferenceMap::iterator refidToNew_end = refidToNew_.end();
-    RefidInfoMap::iterator refidToUnit_end = refidToUnit_.end();
+    int ref = refIds_.Add(id);
+    if(refInfo_.size() < refIds_.size())
+        refInfo_.resize(refIds_.size());
+    return ref;
+}
 
+//-----------------------------------------------------------------------
+void ConverterPass2::BuildReferenceMaps()
+{
     UnitArray::const_iterator cit = units_.begin(), cit_end = units_.end();
     for(; cit < cit_end; ++cit)
     {
         strvector::const_iterator cit1 = cit->refIds_.begin(), cit1_end = cit->refIds_.end();
         for(; cit1 < cit1_end; ++cit1)
         {
-            const String &id = *cit1;
-
-            // map original id to new id
-            String newId;
+            // map original id to new id and to unit,
+            // the first unit is used if the input contains duplicate ids
+            RefInfo &info = refInfo_[RefIndex(*cit1)];
+            if(!info.unit_)
             {
-                ReferenceMap::iterator it = refidToNew_.lower_bound(id);
-                if(it != refidToNew_end && it->first == id)
-                    newId = it->second;
-                else
-                {
-                    newId = MakeUniqueId();
-                    refidToNew_.insert(it, ReferenceMap::value_type(id, newId));
-                }
-            }
-
-            // map new unique id to unit
-            {
-                // The input unit array should not contatin duplicate ids.
-                // Actually we are supposed to skip all dup refs in AddId method, pass 1.
-                // So if we found one then it is internal error.
-                RefidInfoMap::iterator it = refidToUnit_.lower_bound(newId);
-#if defined(_DEBUG)
-                if(it != refidToUnit_end && it->first == id)
-                    InternalError(__FILE__, __LINE__, "duplicate reference id");
-#endif
-                refidToUnit_.insert(it, RefidInfoMap::value_type(newId, &*cit));
+                info.newId_ = MakeUniqueId();
+                info.unit_ = &*cit;
             }
         }
 
-        // store note id
+        // mark note id
         if(!cit->noteRefId_.empty())
-            noteRefIds->insert(cit->noteRefId_);
+            refInfo_[RefIndex(cit->noteRefId_)].note_ = true;
     }
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass2::BuildAnchors(const std::set<String> &noteRefIds)
+void ConverterPass2::BuildAnchors()
 {
     UnitArray::const_iterator cit = units_.begin(), cit_end = units_.end();
     for(; cit < cit_end; ++cit)
     {
         std::set<String>::const_iterator cit1 = cit->refs_.begin(), cit1_end = cit->refs_.end();
         for(; cit1 != cit1_end; ++cit1)
-            if(noteRefIds.find(*cit1) != noteRefIds.end())
-            {
-                // this is id to note/comment section
-                String id = refidToNew_[*cit1];
-
-                // make sure that this id appears first time
-                ReferenceMap::iterator it = noteidToAnchorId_.lower_bound(id);
-                if(it != noteidToAnchorId_.end() && it->first == id)
-                    continue;   // already has anchor
-
-                // create new unique anchor id
-                String anchorid = MakeUniqueId(true);
-                refidToUnit_[anchorid] = &*cit;
-                noteidToAnchorId_.insert(it, ReferenceMap::value_type(id, anchorid));
-            }
+        {
+            int ref = refIds_.Find(*cit1);
+            if(ref < 0 || !refInfo_[ref].note_ || refInfo_[ref].anchor_ >= 0)
+                continue;   // not a note id, or it already has anchor
+
+            // this is id to note/comment section, create new unique anchor id
+            refInfo_[ref].anchor_ = anchors_.size();
+            anchors_.push_back(Anchor(MakeUniqueId(true), &*cit));
+        }
     }
 }
 
+//-----------------------------------------------------------------------
+void ConverterPass2::BuildLayout()
+{
+    BuildOutputLayout();
+    BuildReferenceMaps();
+    BuildAnchors();
+}
+
 //-----------------------------------------------------------------------
 String ConverterPass2::Findhref(const AttrMap &attrmap) const
 {
     std::set<String>::const_iterator cit = xlns_.begin(), cit_end = xlns_.end();
     for(; cit != cit_end; ++cit)
     {
-        String href;
-        if(cit->empty())
-            href = "href";
-        else
-            href = (*cit)+":href";
-        AttrMap::const_iterator ait = attrmap.find(href);
-        if(ait != attrmap.end())
-            return ait->second;
+        const TextView *href = attrmap.Find(A_HREF, cit->c_str());
+        if(href)
+            return href->str();
     }
     return "";
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::StartUnit(Unit::Type unitType, AttrMap *attrmap)
+{
+    String id;
+    if(attrmap)
+        id = attrmap->Get(A_ID);
+
+    if(deferred_)
+    {
+        // collect unit data as pass 1 does
+        if(unitType == Unit::SECTION)
+            units_.push_back(Unit(bodyType_, unitType, sectionCnt_++, parentUnit_));
+        else
+            units_.push_back(Unit(bodyType_, unitType, 0, -1));
+        unitIdx_ = units_.size() - 1;
+        if(attrmap)
+            CollectId(*attrmap);
+    }
+
+    Fixup fixup(Fixup::UNIT_START, id.empty() ? -1 : RefIndex(id));
+    fixup.bodyXmlLang_ = bodyXmlLang_;
+    fixup.sectXmlLang_ = sectXmlLang_;
+    WriteFixup(fixup);
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::EndUnit()
+{
+    WriteFixup(Fixup(Fixup::UNIT_END));
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::WriteUnitStart(const Fixup &fixup)
 {
     // close previous section
     if(unitActive_)
@@ -611,11 +787,11 @@ void ConverterPass2::StartUnit(Unit::Type unitType, AttrMap *attrmap)
 
         strvector::const_iterator cit = cssfiles_.begin(), cit_end = cssfiles_.end();
         for(; cit < cit_end; ++cit)
-            pout_->WriteFmt("<link rel=\"stylesheet\" type=\"text/css\" href=\"%s\"/>\n", EncodeStr(*cit).c_str());
+            pout_->WriteFmt("<link rel=\"stylesheet\" type=\"text/css\" href=\"%s\"/>\n", EncodeStr(*cit, &encbuf_));
 
         pout_->WriteFmt("</head>\n");
-        if(!bodyXmlLang_.empty())
-            pout_->WriteFmt("<body xml:lang=\"%s\">\n", EncodeStr(bodyXmlLang_).c_str());
+        if(!fixup.bodyXmlLang_.empty())
+            pout_->WriteFmt("<body xml:lang=\"%s\">\n", EncodeStr(fixup.bodyXmlLang_, &encbuf_));
         else
             pout_->WriteFmt("<body>\n");
 
@@ -630,8 +806,8 @@ void ConverterPass2::StartUnit(Unit::Type unitType, AttrMap *attrmap)
     }
     if(unit.type_ == Unit::SECTION)
     {
-        if(!sectXmlLang_.empty())
-            pout_->WriteFmt("<div class=\"section%d\" xml:lang=\"%s\">\n", unit.level_+1, EncodeStr(sectXmlLang_).c_str());
+        if(!fixup.sectXmlLang_.empty())
+            pout_->WriteFmt("<div class=\"section%d\" xml:lang=\"%s\">\n", unit.level_+1, EncodeStr(fixup.sectXmlLang_, &encbuf_));
         else
             pout_->WriteFmt("<div class=\"section%d\">\n", unit.level_+1);
     }
@@ -639,21 +815,14 @@ void ConverterPass2::StartUnit(Unit::Type unitType, AttrMap *attrmap)
     pout_->WriteFmt("<div id=\"%s\">\n", unit.fileId_.c_str()); // file id
 #endif
 
-    unitHasId_ = false;
-    if(attrmap)
-    {
-        String id = (*attrmap)["id"];
-        if(!id.empty())
-        {
-            unitHasId_ = true;
-            pout_->WriteFmt("<div id=\"%s\">\n", refidToNew_[id].c_str()); // original id (remapped)
-        }
-    }
+    unitHasId_ = fixup.ref_ >= 0;
+    if(unitHasId_)
+        pout_->WriteFmt("<div id=\"%s\">\n", refInfo_[fixup.ref_].newId_.c_str()); // original id (remapped)
     unitActive_ = true;
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass2::EndUnit()
+void ConverterPass2::WriteUnitEnd()
 {
     if(unitActive_)
     {
@@ -685,6 +854,155 @@ void ConverterPass2::SwitchUnitIfSizeAbove(std::size_t size)
     }
 }
 
+//-----------------------------------------------------------------------
+// Writes text depending on output file layout or, in single-pass mode,
+// leaves a place for it to be resolved when layout is known
+void ConverterPass2::WriteFixup(const Fixup &fixup)
+{
+    if(deferred_)
+        deferred_->AddFixup(fixup);
+    else
+        ResolveFixup(fixup);
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::ResolveFixup(const Fixup &fixup)
+{
+    switch(fixup.type_)
+    {
+    case Fixup::UNIT_START:
+        WriteUnitStart(fixup);
+        break;
+    case Fixup::UNIT_END:
+        WriteUnitEnd();
+        break;
+    case Fixup::REF_ID:
+        {
+            // remap it to our new id
+            const String &id = refInfo_[fixup.ref_].newId_;
+            if(id.empty())
+                InternalError(__FILE__, __LINE__, "AddId error");
+            pout_->WriteStr(EncodeStr(id, &encbuf_));
+        }
+        break;
+    case Fixup::LINK_START:
+        WriteLinkStart(fixup.ref_);
+        break;
+    case Fixup::LINK_HREF:
+        WriteLinkHref(fixup.ref_);
+        break;
+    case Fixup::LINK_END:
+        if(anchorSet_)
+            pout_->WriteStr("</span>");
+        anchorSet_ = false;
+        break;
+    case Fixup::NOTE_BACKLINK:
+        WriteNoteBacklink(fixup.ref_);
+        break;
+    default:
+        InternalError(__FILE__, __LINE__, "ResolveFixup error");
+    }
+}
+
+//-----------------------------------------------------------------------
+const String& ConverterPass2::NewRefId(int ref)
+{
+    const RefInfo &info = refInfo_[ref];
+    if(!info.unit_)
+        ExternalError(String("reference to unknown id \"") + refIds_[ref] + "\"");
+    return info.newId_;
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::WriteLinkStart(int ref)
+{
+    // the first reference to note gets anchor for back link
+    NewRefId(ref);
+    int anchor = refInfo_[ref].anchor_;
+    anchorSet_ = anchor >= 0 && !anchors_[anchor].used_;
+    if(anchorSet_)
+    {
+        anchors_[anchor].used_ = true;
+        pout_->WriteFmt("<span id=\"%s\">", anchors_[anchor].id_.c_str());
+    }
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::WriteLinkHref(int ref)
+{
+    const String &newId = NewRefId(ref);
+    pout_->WriteFmt("%s.xhtml#%s", refInfo_[ref].unit_->file_.c_str(), newId.c_str());
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::WriteNoteBacklink(int ref)
+{
+    int anchor = refInfo_[ref].anchor_;
+    if(anchor >= 0)
+        pout_->WriteFmt("<h1><span class=\"anchor\"><a href=\"%s.xhtml#%s\">[&lt;-]</a></span></h1>",
+                        anchors_[anchor].unit_->file_.c_str(), anchors_[anchor].id_.c_str());
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::BeginDeferred()
+{
+    deferred_ = new DeferredOutStm(pout_);
+    pout_ = deferred_;
+}
+
+//-----------------------------------------------------------------------
+void ConverterPass2::EndDeferred()
+{
+    Ptr<DeferredOutStm> deferred = deferred_;
+    deferred_ = NULL;
+    pout_ = deferred->pout_;
+
+    // sanity check
+    if(units_.size() == 0)
+        InternalError(__FILE__, __LINE__, "I don't know why but it happened that there is no content in input file!");
+
+    if(pass1Units_)
+        *pass1Units_ = units_;  // before layout changes them
+    coverPgIt_ = units_.end();  // units are added after construction
+    BuildLayout();
+
+    // write units resolving all fixups
+    unitIdx_ = 0;
+    unitActive_ = false;
+    prevUnitFile_ = "";
+    const std::vector<char> &text = deferred->text_;
+    std::size_t pos = 0;
+    std::vector<Fixup>::const_iterator cit = deferred->fixups_.begin(), cit_end = deferred->fixups_.end();
+    for(; cit < cit_end; ++cit)
+    {
+        if(cit->pos_ > pos)
+            pout_->Write(&text[pos], cit->pos_ - pos);
+        pos = cit->pos_;
+        ResolveFixup(*cit);
+    }
+    if(text.size() > pos)
+        pout_->Write(&text[pos], text.size() - pos);
+}
+
+//-----------------------------------------------------------------------
+// Collects id of element in single-pass mode, the same way as pass 1 does
+void ConverterPass2::CollectId(const AttrMap &attrmap)
+{
+    const TextView *id = attrmap.Find(A_ID);
+    if(id && !units_.empty())
+        units_.back().refIds_.push_back(id->str());
+}
+
+//-----------------------------------------------------------------------
+// Collects size of unit and plain text of title in single-pass mode
+void ConverterPass2::CollectText(const LexScanner::Token &t)
+{
+    if(!units_.empty())
+        units_.back().size_ += t.size_;
+    if(plainText_)
+        plainText_->append(t.s_.data(), t.s_.size());
+}
+
 //-----------------------------------------------------------------------
 void ConverterPass2::AddMimetype()
 {
@@ -710,30 +1028,12 @@ void ConverterPass2::AddContainer()
 //-----------------------------------------------------------------------
 void ConverterPass2::AddStyles()
 {
-    strvector::const_iterator cit = css_.begin(), cit_end = css_.end();
+    ExtFileVector::const_iterator cit = res_->cssfiles_.begin(), cit_end = res_->cssfiles_.end();
     for(; cit < cit_end; ++cit)
     {
-        Ptr<ScanDir> sd = CreateScanDir(cit->c_str(), "css");
-        String fname;
-        for(String ospath = sd->GetNextFile(&fname); !ospath.empty(); ospath = sd->GetNextFile(&fname))
-        {
-            fname = String("css/") + fname;
-            pout_->AddFile(CreateInFileStm(ospath.c_str()), (String("OPS/") + fname).c_str(), true);
-            cssfiles_.push_back(fname);
-        }
-    }
-}
-
-//-----------------------------------------------------------------------
-void ConverterPass2::ScanFonts(const char *ext, ExtFileVector *fontfiles)
-{
-    strvector::const_iterator cit = fonts_.begin(), cit_end = fonts_.end();
-    for(; cit < cit_end; ++cit)
-    {
-        Ptr<ScanDir> sd = CreateScanDir(cit->c_str(), ext);
-        String fname;
-        for(String ospath = sd->GetNextFile(&fname); !ospath.empty(); ospath = sd->GetNextFile(&fname))
-            fontfiles->push_back(ExtFile(String("fonts/") + fname, ospath));
+        pout_->AddFile(CreateInMemStm(cit->data_.empty() ? NULL : &cit->data_[0], cit->data_.size()),
+                       (String("OPS/") + cit->fname_).c_str(), true);
+        cssfiles_.push_back(cit->fname_);
     }
 }
 
@@ -742,13 +1042,10 @@ void ConverterPass2::AddFontFiles(const ExtFileVector &fontfiles)
 {
     ExtFileVector::const_iterator cit = fontfiles.begin(), cit_end = fontfiles.end();
     for(; cit < cit_end; ++cit)
-        if(!IsFontEmbedAllowed(cit->ospath_))
-            FontError(cit->ospath_, "embedding not allowed");
-
-    for(cit = fontfiles.begin(); cit < cit_end; ++cit)
     {
         // mangle (mangling == deflating + XORing), then store without compression
-        Ptr<InStm> stm = CreateManglingStm(CreateInFileStm(cit->ospath_.c_str()), adobeKey_, sizeof(adobeKey_), 1024);
+        Ptr<InStm> stm = CreateManglingStm(CreateInMemStm(cit->data_.empty() ? NULL : &cit->data_[0], cit->data_.size()),
+                                           adobeKey_, sizeof(adobeKey_), 1024);
         pout_->AddFile(stm, (String("OPS/") + cit->fname_).c_str(), false);
 
         // just compress
@@ -832,10 +1129,10 @@ void ConverterPass2::AddContentOpf()
         int i;
         ExtFileVector::const_iterator cit, cit_end;
 
-        for(cit = ttffiles_.begin(), cit_end = ttffiles_.end(), i = 0; cit < cit_end; ++cit)
+        for(cit = res_->ttffiles_.begin(), cit_end = res_->ttffiles_.end(), i = 0; cit < cit_end; ++cit)
             AddContentManifestFile(pout_, MakeFileName("ttf", i++).c_str(), cit->fname_.c_str(), "application/vnd.ms-opentype");
 
-        for(cit = otffiles_.begin(), cit_end = otffiles_.end(), i = 0; cit < cit_end; ++cit)
+        for(cit = res_->otffiles_.begin(), cit_end = res_->otffiles_.end(), i = 0; cit < cit_end; ++cit)
             AddContentManifestFile(pout_, MakeFileName("otf", i++).c_str(), cit->fname_.c_str(), "application/vnd.ms-opentype");
     }
 
@@ -934,7 +1231,7 @@ void ConverterPass2::AddTocNcx()
 //-----------------------------------------------------------------------
 void ConverterPass2::AddEncryption()
 {
-    if(ttffiles_.empty() && otffiles_.empty())
+    if(res_->ttffiles_.empty() && res_->otffiles_.empty())
         return;
 
     pout_->BeginFile("META-INF/encryption.xml", true);
@@ -945,7 +1242,7 @@ void ConverterPass2::AddEncryption()
         int i;
         ExtFileVector::const_iterator cit, cit_end;
 
-        for(cit = ttffiles_.begin(), cit_end = ttffiles_.end(), i = 0; cit < cit_end; ++cit)
+        for(cit = res_->ttffiles_.begin(), cit_end = res_->ttffiles_.end(), i = 0; cit < cit_end; ++cit)
         {
             pout_->WriteStr("<EncryptedData xmlns=\"http://www.w3.org/2001/04/xmlenc#\">\n");
             pout_->WriteStr("<EncryptionMethod Algorithm=\"http://ns.adobe.com/pdf/enc#RC\"/>\n");
@@ -956,7 +1253,7 @@ void ConverterPass2::AddEncryption()
         }
         //AddContentManifestFile(pout_, MakeFileName("ttf", i++).c_str(), cit->c_str(), "application/x-font-ttf");
 
-        for(cit = otffiles_.begin(), cit_end = otffiles_.end(), i = 0; cit < cit_end; ++cit)
+        for(cit = res_->otffiles_.begin(), cit_end = res_->otffiles_.end(), i = 0; cit < cit_end; ++cit)
         {
             pout_->WriteStr("<EncryptedData xmlns=\"http://www.w3.org/2001/04/xmlenc#\">\n");
             pout_->WriteStr("<EncryptionMethod Algorithm=\"http://ns.adobe.com/pdf/enc#RC\"/>\n");
@@ -971,30 +1268,30 @@ void ConverterPass2::AddEncryption()
 }
 
 //-----------------------------------------------------------------------
-const String* ConverterPass2::AddId(const AttrMap &attrmap)
+const TextView* ConverterPass2::AddId(const AttrMap &attrmap)
 {
-    AttrMap::const_iterator cit = attrmap.find("id");
-    if(cit == attrmap.end())
+    const TextView *cid = attrmap.Find(A_ID);
+    if(!cid)
         return NULL;
 
-    if(allRefIds_.find(cit->second) != allRefIds_.end())
+    String id = cid->str();
+    if(allRefIds_.find(id) != allRefIds_.end())
         return NULL;    // ignore second instance
 
-    String id = cit->second;
-
-    // remap it to our new id
-    id = refidToNew_[id];
-    if(id.empty())
-        InternalError(__FILE__, __LINE__, "AddId error");
+    if(deferred_)
+        CollectId(attrmap);
 
-    pout_->WriteFmt(" id=\"%s\"", EncodeStr(id).c_str());
-    return &cit->second;
+    pout_->WriteStr(" id=\"");
+    WriteFixup(Fixup(Fixup::REF_ID, RefIndex(id)));
+    pout_->WriteStr("\"");
+    return cid;
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass2::ParseTextAndEndElement (const String &element)
+void ConverterPass2::ParseTextAndEndElement (ElementType element)
 {
     SetScannerDataMode setDataMode(s_);
+    SetScannerChunkMode setChunkMode(s_);
     for(;;)
     {
         LexScanner::Token t = s_->LookAhead();
@@ -1006,34 +1303,48 @@ void ConverterPass2::ParseTextAndEndElement (const String &element)
 
         case LexScanner::DATA:
             sectionSize_ += t.size_;
+            if(deferred_)
+                CollectText(t);
             pout_->WriteStr(s_->GetToken().s_.c_str());
             continue;
 
         case LexScanner::START:
             //<strong>, <emphasis>, <stile>, <a>, <strikethrough>, <sub>, <sup>, <code>, <image>
-            if(!t.s_.compare("strong"))
+            switch(t.elem_)
+            {
+            case E_STRONG:
                 strong();
-            else if(!t.s_.compare("emphasis"))
+                break;
+            case E_EMPHASIS:
                 emphasis();
-            else if(!t.s_.compare("style"))
+                break;
+            case E_STYLE:
                 style();
-            else if(!t.s_.compare("a"))
+                break;
+            case E_A:
                 a();
-            else if(!t.s_.compare("strikethrough"))
+                break;
+            case E_STRIKETHROUGH:
                 strikethrough();
-            else if(!t.s_.compare("sub"))
+                break;
+            case E_SUB:
                 sub();
-            else if(!t.s_.compare("sup"))
+                break;
+            case E_SUP:
                 sup();
-            else if(!t.s_.compare("code"))
+                break;
+            case E_CODE:
                 code();
-            else if(!t.s_.compare("image"))
+                break;
+            case E_IMAGE:
                 image(true, true, false);
-            else
-            {
-                std::ostringstream ss;
-                ss << "<" << t.s_ << "> unexpected in <" << element + ">";
-                s_->Error(ss.str());
+                break;
+            default:
+                {
+                    std::ostringstream ss;
+                    ss << "<" << t.s_ << "> unexpected in <" << ElementName(element) << ">";
+                    s_->Error(ss.str());
+                }
             }
             continue;
             //</strong>, </emphasis>, </stile>, </a>, </strikethrough>, </sub>, </sup>, </code>, </image>
@@ -1042,47 +1353,47 @@ void ConverterPass2::ParseTextAndEndElement (const String &element)
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass2::CopyAttribute(const String &attr, const AttrMap &attrmap)
+void ConverterPass2::CopyAttribute(AttrType attr, const AttrMap &attrmap, const char *prefix)
 {
-    AttrMap::const_iterator cit = attrmap.find(attr);
-    if(cit != attrmap.end())
-        pout_->WriteFmt(" %s=\"%s\"", attr.c_str(), EncodeStr(cit->second).c_str());
+    const AttrMap::Attr *a = attrmap.FindAttr(attr, prefix);
+    if(a)
+        pout_->WriteFmt(" %s=\"%s\"", a->name_.c_str(), EncodeStr(a->value_.data(), a->value_.size(), &encbuf_));
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::CopyXmlLang(const AttrMap &attrmap)
 {
-    CopyAttribute("xml:lang", attrmap);
+    CopyAttribute(A_LANG, attrmap, "xml");
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::FictionBook()
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("FictionBook", &attrmap);
+    s_->BeginNotEmptyElement(E_FICTIONBOOK, &attrmap);
 
     // namespaces
-    AttrMap::const_iterator cit = attrmap.begin(), cit_end = attrmap.end();
     bool has_fb = false, has_emptyfb = false;
-    for(; cit != cit_end; ++cit)
+    for(std::size_t i = 0; i < attrmap.size(); ++i)
     {
         static const String xmlns = "xmlns";
         static const std::size_t xmlns_len = xmlns.length();
         static const String fbID = "http://www.gribuser.ru/xml/fictionbook/2.0", xlID = "http://www.w3.org/1999/xlink";
 
-        if(!cit->second.compare(fbID))
+        const String name = attrmap[i].name_.str();
+        if(!attrmap[i].value_.compare(fbID))
         {
-            if(!cit->first.compare(xmlns))
+            if(!name.compare(xmlns))
                 has_emptyfb = true;
-            else if(cit->first.compare(0, xmlns_len+1, xmlns+":"))
+            else if(name.compare(0, xmlns_len+1, xmlns+":"))
                 s_->Error("bad FictionBook namespace definition");
             has_fb = true;
         }
-        else if(!cit->second.compare(xlID))
+        else if(!attrmap[i].value_.compare(xlID))
         {
-            if(cit->first.compare(0, xmlns_len+1, xmlns+":"))
+            if(name.compare(0, xmlns_len+1, xmlns+":"))
                 s_->Error("bad xlink namespace definition");
-            xlns_.insert(cit->first.substr(xmlns_len+1));
+            xlns_.insert(name.substr(xmlns_len+1));
         }
     }
     if(!has_fb)
@@ -1091,55 +1402,51 @@ void ConverterPass2::FictionBook()
         s_->Error("non-empty FictionBook namespace not implemented");
 
     //<stylesheet>
-    s_->SkipAll("stylesheet");
+    s_->SkipAll(E_STYLESHEET);
     //</stylesheet>
 
+    // in single-pass mode units are kept in memory until file layout is known
+    if(singlePass_)
+        BeginDeferred();
+
     //<description>
     description();
     //</description>
 
     //<body>
-    body();
-    if(s_->IsNextElement("body"))
-        body();
-    if(s_->IsNextElement("body"))
-        body();
+    body(Unit::MAIN);
+    if(s_->IsNextElement(E_BODY))
+        body(Unit::NOTES);
+    if(s_->IsNextElement(E_BODY))
+        body(Unit::COMMENTS);
     //</body>
 
+    if(singlePass_)
+        EndDeferred();
+
     //<binary>
-    while(s_->IsNextElement("binary"))
+    while(s_->IsNextElement(E_BINARY))
         binary();
     //</binary>
 
     s_->SkipRestOfElementContent(); // skip rest of <FictionBook>
 }
 
-//-----------------------------------------------------------------------
-bool ConverterPass2::AddAnchorid(const String &anchorid)
-{
-    std::set<String>::iterator it = usedAnchorsids_.lower_bound(anchorid);
-    if(it != usedAnchorsids_.end() && *it == anchorid)
-        return false;   // already processed
-
-    usedAnchorsids_.insert(it, anchorid);
-    return true;
-}
-
 //-----------------------------------------------------------------------
 void ConverterPass2::a()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("a", &attrmap);
+    bool notempty = s_->BeginElement(E_A, &attrmap);
 
     String id = Findhref(attrmap);
     if(id.empty())
         s_->Error("<a> should have href attribute");
 
-    bool anchorSet = false;
+    bool internal = false;
     if(id[0] != '#')
     {
         // external reference
-        pout_->WriteFmt("<a class=\"e_a\" href=\"%s\"", EncodeStr(id).c_str());
+        pout_->WriteFmt("<a class=\"e_a\" href=\"%s\"", EncodeStr(id, &encbuf_));
         if(!notempty)
         {
             pout_->WriteStr("/>");
@@ -1150,32 +1457,26 @@ void ConverterPass2::a()
     {
         // internal reference
         id = id.substr(1);
-        String file = refidToUnit_[refidToNew_[id]]->file_;
-
-        // remap it to our new id
-        id = refidToNew_[id];
-        if(id.empty())
-            InternalError(__FILE__, __LINE__, "a() error");
-
-        String anchorid = noteidToAnchorId_[id];
-        if(!anchorid.empty() && AddAnchorid(anchorid))
-        {
-            anchorSet = true;
-            pout_->WriteFmt("<span id=\"%s\">", anchorid.c_str());
-        }
-
-        pout_->WriteFmt("<a href=\"%s.xhtml#%s\"", file.c_str(), id.c_str());
+        if(deferred_ && !units_.empty())
+            units_.back().refs_.insert(id);
+
+        internal = true;
+        int ref = RefIndex(id);
+        WriteFixup(Fixup(Fixup::LINK_START, ref));
+        pout_->WriteStr("<a href=\"");
+        WriteFixup(Fixup(Fixup::LINK_HREF, ref));
+        pout_->WriteStr("\"");
         if(!notempty)
         {
             pout_->WriteStr("/>");
-            if(anchorSet)
-                pout_->WriteFmt("</span>");
+            WriteFixup(Fixup(Fixup::LINK_END));
             return;
         }
     }
     pout_->WriteStr(">");
 
     SetScannerDataMode setDataMode(s_);
+    SetScannerChunkMode setChunkMode(s_);
     for(;;)
     {
         LexScanner::Token t = s_->LookAhead();
@@ -1184,38 +1485,51 @@ void ConverterPass2::a()
         default:
             s_->EndElement();
             pout_->WriteStr("</a>");
-            if(anchorSet)
-                pout_->WriteFmt("</span>");
+            if(internal)
+                WriteFixup(Fixup(Fixup::LINK_END));
             return;
 
         case LexScanner::DATA:
             sectionSize_ += t.size_;
+            if(deferred_)
+                CollectText(t);
             pout_->WriteStr(s_->GetToken().s_.c_str());
             continue;
 
         case LexScanner::START:
             //<strong>, <emphasis>, <stile>, <strikethrough>, <sub>, <sup>, <code>, <image>
-            if(!t.s_.compare("strong"))
+            switch(t.elem_)
+            {
+            case E_STRONG:
                 strong();
-            else if(!t.s_.compare("emphasis"))
+                break;
+            case E_EMPHASIS:
                 emphasis();
-            else if(!t.s_.compare("style"))
+                break;
+            case E_STYLE:
                 style();
-            else if(!t.s_.compare("strikethrough"))
+                break;
+            case E_STRIKETHROUGH:
                 strikethrough();
-            else if(!t.s_.compare("sub"))
+                break;
+            case E_SUB:
                 sub();
-            else if(!t.s_.compare("sup"))
+                break;
+            case E_SUP:
                 sup();
-            else if(!t.s_.compare("code"))
+                break;
+            case E_CODE:
                 code();
-            else if(!t.s_.compare("image"))
+                break;
+            case E_IMAGE:
                 image(true, true, false);
-            else
-            {
-                std::ostringstream ss;
-                ss << "<" << t.s_ << "> unexpected in <a>";
-                s_->Error(ss.str());
+                break;
+            default:
+                {
+                    std::ostringstream ss;
+                    ss << "<" << t.s_ << "> unexpected in <a>";
+                    s_->Error(ss.str());
+                }
             }
             continue;
             //</strong>, </emphasis>, </stile>, </strikethrough>, </sub>, </sup>, </code>, </image>
@@ -1227,7 +1541,7 @@ void ConverterPass2::a()
 void ConverterPass2::annotation(bool startUnit)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("annotation", &attrmap);
+    bool notempty = s_->BeginElement(E_ANNOTATION, &attrmap);
     if(startUnit)
         StartUnit(Unit::ANNOTATION);
 
@@ -1244,23 +1558,32 @@ void ConverterPass2::annotation(bool startUnit)
     for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
     {
         //<p>, <poem>, <cite>, <subtitle>, <empty-line>, <table>
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
+        {
+        case E_P:
             p();
-        else if(!t.s_.compare("poem"))
+            break;
+        case E_POEM:
             poem();
-        else if(!t.s_.compare("cite"))
+            break;
+        case E_CITE:
             cite();
-        else if(!t.s_.compare("subtitle"))
+            break;
+        case E_SUBTITLE:
             subtitle();
-        else if(!t.s_.compare("empty-line"))
+            break;
+        case E_EMPTY_LINE:
             empty_line();
-        else if(!t.s_.compare("table"))
+            break;
+        case E_TABLE:
             table();
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <annotation>";
-            s_->Error(ss.str());
+            break;
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <annotation>";
+                s_->Error(ss.str());
+            }
         }
         //</p>, </poem>, </cite>, </subtitle>, </empty-line>, </table>
     }
@@ -1272,20 +1595,20 @@ void ConverterPass2::annotation(bool startUnit)
 //-----------------------------------------------------------------------
 void ConverterPass2::author()
 {
-    s_->BeginNotEmptyElement("author");
+    s_->BeginNotEmptyElement(E_AUTHOR);
 
     String author;
-    if(s_->IsNextElement("first-name"))
+    if(s_->IsNextElement(E_FIRST_NAME))
     {
-        author = s_->SimpleTextElement("first-name");
+        author = s_->SimpleTextElement(E_FIRST_NAME);
 
-        if(s_->IsNextElement("middle-name"))
-            author = Concat(author, " ", s_->SimpleTextElement("middle-name"));
+        if(s_->IsNextElement(E_MIDDLE_NAME))
+            author = Concat(author, " ", s_->SimpleTextElement(E_MIDDLE_NAME));
 
-        author = Concat(author, " ", s_->SimpleTextElement("last-name"));
+        author = Concat(author, " ", s_->SimpleTextElement(E_LAST_NAME));
     }
-    else if(s_->IsNextElement("nickname"))
-        author = s_->SimpleTextElement("nickname");
+    else if(s_->IsNextElement(E_NICKNAME))
+        author = s_->SimpleTextElement(E_NICKNAME);
     else
         s_->Error("<first-name> or <nickname> expected");
 
@@ -1297,10 +1620,10 @@ void ConverterPass2::author()
 void ConverterPass2::binary()
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("binary", &attrmap);
+    s_->BeginNotEmptyElement(E_BINARY, &attrmap);
 
     // store binary attributes
-    Binary b(attrmap["id"], attrmap["content-type"]);
+    Binary b(attrmap.Get(A_ID), attrmap.Get(A_CONTENT_TYPE));
     //if(b.file_.empty() || (b.type_ != "image/jpeg" && b.type_ != "image/png"))
     if(b.file_.empty() || b.type_.empty())
         s_->Error("invalid <binary> attributes");
@@ -1316,12 +1639,19 @@ void ConverterPass2::binary()
     // store binary file
     {
         SetScannerDataMode setDataMode(s_);
-        LexScanner::Token t = s_->GetToken();
-        if(t.type_ != LexScanner::DATA)
+        SetScannerChunkMode setChunkMode(s_);
+        if(s_->LookAhead().type_ != LexScanner::DATA)
             s_->Error("<binary> data expected");
 
         pout_->BeginFile((String("OPS/") + b.file_).c_str(), false);
-        if(!DecodeBase64(t.s_.c_str(), pout_))
+        Base64Decoder decoder(pout_);
+        while(s_->LookAhead().type_ == LexScanner::DATA)
+        {
+            const LexScanner::Token &t = s_->GetToken();
+            if(!decoder.Decode(t.s_.data(), t.s_.size()))
+                s_->Error("base64 error");
+        }
+        if(!decoder.Finish())
             s_->Error("base64 error");
     }
 
@@ -1329,16 +1659,19 @@ void ConverterPass2::binary()
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass2::body()
+void ConverterPass2::body(Unit::BodyType bodyType)
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("body", &attrmap);
+    s_->BeginNotEmptyElement(E_BODY, &attrmap);
+
+    bodyType_ = bodyType;
+    parentUnit_ = -1;
 
     // set body language
     SetLanguage l(&bodyXmlLang_, attrmap);
 
     //<image>
-    if(s_->IsNextElement("image"))
+    if(s_->IsNextElement(E_IMAGE))
     {
         StartUnit(Unit::IMAGE);
         image(false, false, true);
@@ -1346,13 +1679,18 @@ void ConverterPass2::body()
     //</image>
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
         title(true);
     //</title>
 
     //<epigraph>
-    while(s_->IsNextElement("epigraph"))
+    while(s_->IsNextElement(E_EPIGRAPH))
+    {
+        // there is no output file yet to put it in
+        if(deferred_ && units_.empty())
+            s_->Error("<epigraph> of the first <body> without <title> not supported");
         epigraph();
+    }
     //</epigraph>
 
     do
@@ -1361,7 +1699,7 @@ void ConverterPass2::body()
         section();
         //</section>
     }
-    while(s_->IsNextElement("section"));
+    while(s_->IsNextElement(E_SECTION));
 
     EndUnit();
 
@@ -1371,14 +1709,14 @@ void ConverterPass2::body()
 //-----------------------------------------------------------------------
 void ConverterPass2::book_title()
 {
-    title_ = s_->SimpleTextElement("book-title");
+    title_ = s_->SimpleTextElement(E_BOOK_TITLE);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::cite()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("cite", &attrmap);
+    bool notempty = s_->BeginElement(E_CITE, &attrmap);
     pout_->WriteStr("<div class=\"citation\"");
     AddId(attrmap);
     CopyXmlLang(attrmap);
@@ -1389,32 +1727,38 @@ void ConverterPass2::cite()
     }
     pout_->WriteStr(">");
 
-    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
+    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START && t.elem_ != E_TEXT_AUTHOR; t = s_->LookAhead())
     {
         //<p>, <subtitle>, <empty-line>, <poem>, <table>
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
+        {
+        case E_P:
             p();
-        else if(!t.s_.compare("subtitle"))
+            break;
+        case E_SUBTITLE:
             subtitle();
-        else if(!t.s_.compare("empty-line"))
+            break;
+        case E_EMPTY_LINE:
             empty_line();
-        else if(!t.s_.compare("poem"))
+            break;
+        case E_POEM:
             poem();
-        else if(!t.s_.compare("table"))
+            break;
+        case E_TABLE:
             table();
-        else if(!t.s_.compare("text-author"))
             break;
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <cite>";
-            s_->Error(ss.str());
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <cite>";
+                s_->Error(ss.str());
+            }
         }
         //</p>, </subtitle>, </empty-line>, </poem>, </table>
     }
 
     //<text-author>
-    while(s_->IsNextElement("text-author"))
+    while(s_->IsNextElement(E_TEXT_AUTHOR))
         text_author();
     //</text-author>
 
@@ -1425,10 +1769,10 @@ void ConverterPass2::cite()
 //-----------------------------------------------------------------------
 void ConverterPass2::code()
 {
-    if(s_->BeginElement("code"))
+    if(s_->BeginElement(E_CODE))
     {
         pout_->WriteStr("<code class=\"e_code\">");
-        ParseTextAndEndElement("code");
+        ParseTextAndEndElement(E_CODE);
         pout_->WriteStr("</code>");
     }
 }
@@ -1436,7 +1780,7 @@ void ConverterPass2::code()
 //-----------------------------------------------------------------------
 void ConverterPass2::coverpage()
 {
-    s_->BeginNotEmptyElement("coverpage");
+    s_->BeginNotEmptyElement(E_COVERPAGE);
     StartUnit(Unit::COVERPAGE);
     do
     {
@@ -1444,7 +1788,7 @@ void ConverterPass2::coverpage()
         image(true, false, true);
         pout_->WriteStr("</div>");
     }
-    while(s_->IsNextElement("image"));
+    while(s_->IsNextElement(E_IMAGE));
     s_->EndElement();
 }
 
@@ -1452,7 +1796,7 @@ void ConverterPass2::coverpage()
 void ConverterPass2::date()
 {
     AttrMap attrmap;
-    if(s_->BeginElement("date"), &attrmap)
+    if(s_->BeginElement(E_DATE), &attrmap)
     {
         SetScannerDataMode setDataMode(s_);
         if(s_->LookAhead().type_ == LexScanner::DATA)
@@ -1483,9 +1827,9 @@ static bool IsDateCorrect(const String &s)
 String ConverterPass2::date__epub()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("date", &attrmap);
+    bool notempty = s_->BeginElement(E_DATE, &attrmap);
 
-    String text = attrmap["value"];
+    String text = attrmap.Get(A_VALUE);
     if(IsDateCorrect(text))
     {
         if(notempty)
@@ -1498,7 +1842,7 @@ String ConverterPass2::date__epub()
 
     SetScannerDataMode setDataMode(s_);
     if(s_->LookAhead().type_ == LexScanner::DATA)
-        text = s_->GetToken().s_;
+        text = s_->GetToken().s_.str();
     s_->EndElement();
     return IsDateCorrect(text) ? text : String("");
 }
@@ -1506,14 +1850,14 @@ String ConverterPass2::date__epub()
 //-----------------------------------------------------------------------
 void ConverterPass2::description()
 {
-    s_->BeginNotEmptyElement("description");
+    s_->BeginNotEmptyElement(E_DESCRIPTION);
 
     //<title-info>
     title_info();
     //</title-info>
 
     //<src-title-info>
-    s_->SkipIfElement("src-title-info");
+    s_->SkipIfElement(E_SRC_TITLE_INFO);
     //</src-title-info>
 
     //<document-info>
@@ -1521,7 +1865,7 @@ void ConverterPass2::description()
     //</document-info>
 
     //<publish-info>
-    if(s_->IsNextElement("publish-info"))
+    if(s_->IsNextElement(E_PUBLISH_INFO))
         publish_info();
     //</publish-info>
 
@@ -1531,27 +1875,27 @@ void ConverterPass2::description()
 //-----------------------------------------------------------------------
 void ConverterPass2::document_info()
 {
-    s_->BeginNotEmptyElement("document-info");
+    s_->BeginNotEmptyElement(E_DOCUMENT_INFO);
 
     //<author>
-    s_->CheckAndSkipElement("author");
-    s_->SkipAll("author");
+    s_->CheckAndSkipElement(E_AUTHOR);
+    s_->SkipAll(E_AUTHOR);
     //</author>
 
     //<program-used>
-    s_->SkipIfElement("program-used");
+    s_->SkipIfElement(E_PROGRAM_USED);
     //</program-used>
 
     //<date>
-    s_->CheckAndSkipElement("date");
+    s_->CheckAndSkipElement(E_DATE);
     //</date>
 
     //<src-url>
-    s_->SkipAll("src-url");
+    s_->SkipAll(E_SRC_URL);
     //</src-url>
 
     //<src-ocr>
-    s_->SkipIfElement("src-ocr");
+    s_->SkipIfElement(E_SRC_OCR);
     //</src-ocr>
 
     //<id>
@@ -1564,10 +1908,10 @@ void ConverterPass2::document_info()
 //-----------------------------------------------------------------------
 void ConverterPass2::emphasis()
 {
-    if(s_->BeginElement("emphasis"))
+    if(s_->BeginElement(E_EMPHASIS))
     {
         pout_->WriteStr("<em class=\"emphasis\">");
-        ParseTextAndEndElement("emphasis");
+        ParseTextAndEndElement(E_EMPHASIS);
         pout_->WriteStr("</em>");
     }
 }
@@ -1575,7 +1919,7 @@ void ConverterPass2::emphasis()
 //-----------------------------------------------------------------------
 void ConverterPass2::empty_line()
 {
-    bool notempty = s_->BeginElement("empty-line");
+    bool notempty = s_->BeginElement(E_EMPTY_LINE);
     pout_->WriteStr("<p class=\"empty-line\"> </p>\n");
     if(notempty)
         s_->EndElement();
@@ -1585,7 +1929,7 @@ void ConverterPass2::empty_line()
 void ConverterPass2::epigraph()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("epigraph", &attrmap);
+    bool notempty = s_->BeginElement(E_EPIGRAPH, &attrmap);
     pout_->WriteStr("<div class=\"epigraph\"");
     AddId(attrmap);
     if(!notempty)
@@ -1595,30 +1939,35 @@ void ConverterPass2::epigraph()
     }
     pout_->WriteStr(">");
 
-    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
+    for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START && t.elem_ != E_TEXT_AUTHOR; t = s_->LookAhead())
     {
         //<p>, <poem>, <cite>, <empty-line>
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
+        {
+        case E_P:
             p();
-        else if(!t.s_.compare("poem"))
+            break;
+        case E_POEM:
             poem();
-        else if(!t.s_.compare("cite"))
+            break;
+        case E_CITE:
             cite();
-        else if(!t.s_.compare("empty-line"))
+            break;
+        case E_EMPTY_LINE:
             empty_line();
-        else if(!t.s_.compare("text-author"))
             break;
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <epigraph>";
-            s_->Error(ss.str());
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <epigraph>";
+                s_->Error(ss.str());
+            }
         }
         //</p>, </poem>, </cite>, </empty-line>
     }
 
     //<text-author>
-    while(s_->IsNextElement("text-author"))
+    while(s_->IsNextElement(E_TEXT_AUTHOR))
         text_author();
     //</text-author>
 
@@ -1631,7 +1980,7 @@ void ConverterPass2::id()
 {
     static const String uuidpfx = "urn:uuid:";
 
-    String id = s_->SimpleTextElement("id"), uuid = id;
+    String id = s_->SimpleTextElement(E_ID), uuid = id;
     if(!uuid.compare(0, uuidpfx.length(), uuidpfx))
         uuid = uuid.substr(uuidpfx.length());
     if(!IsValidUUID(uuid))
@@ -1648,10 +1997,10 @@ void ConverterPass2::id()
 void ConverterPass2::image(bool fb2_inline, bool html_inline, bool scale)
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("image", &attrmap);
+    bool notempty = s_->BeginElement(E_IMAGE, &attrmap);
 
     // get file href
-    String href = Findhref(attrmap), alt = attrmap["alt"];
+    String href = Findhref(attrmap), alt = attrmap.Get(A_ALT);
     if(!href.empty())
     {
         if(href[0] == '#')
@@ -1660,11 +2009,11 @@ void ConverterPass2::image(bool fb2_inline, bool html_inline, bool scale)
             href = String("bin/") + href.substr(1);
 
             // remember name of the cover page image file
-            if(units_[unitIdx_].type_ == Unit::COVERPAGE && coverFile_.empty())
+            if(unitIdx_ < static_cast<int>(units_.size()) && units_[unitIdx_].type_ == Unit::COVERPAGE && coverFile_.empty())
                 coverFile_ = href;
         }
 
-        bool has_id = !fb2_inline && attrmap.find("id") != attrmap.end();
+        bool has_id = !fb2_inline && attrmap.Find(A_ID);
         if(has_id)
         {
             pout_->WriteStr("<div");
@@ -1676,23 +2025,26 @@ void ConverterPass2::image(bool fb2_inline, bool html_inline, bool scale)
 
         pout_->WriteFmt("<%s class=\"image\">", group.c_str());
         if(scale)
-            pout_->WriteFmt("<img style=\"height: 100%%;\" alt=\"%s\" src=\"%s\"/>", EncodeStr(alt).c_str(), EncodeStr(href).c_str());
+            pout_->WriteFmt("<img style=\"height: 100%%;\" alt=\"%s\"", EncodeStr(alt, &encbuf_));
         else
-            pout_->WriteFmt("<img alt=\"%s\" src=\"%s\"/>", EncodeStr(alt).c_str(), EncodeStr(href).c_str());
+            pout_->WriteFmt("<img alt=\"%s\"", EncodeStr(alt, &encbuf_));
+        pout_->WriteFmt(" src=\"%s\"/>", EncodeStr(href, &encbuf_));
 
         if(!fb2_inline)
         {
             if(html_inline)
                 InternalError(__FILE__, __LINE__, "<image> error");
-            AttrMap::const_iterator cit = attrmap.find("title");
-            if(cit != attrmap.end())
-                pout_->WriteFmt("<p>%s</p>\n", EncodeStr(cit->second).c_str());
+            const TextView *title = attrmap.Find(A_TITLE);
+            if(title)
+                pout_->WriteFmt("<p>%s</p>\n", EncodeStr(title->data(), title->size(), &encbuf_));
         }
         pout_->WriteFmt("</%s>", group.c_str());
 
         if(has_id)
             pout_->WriteStr("</div>\n");
     }
+    else if(deferred_ && !fb2_inline)
+        CollectId(attrmap);     // pass 1 collects id of image without href too
     if(!notempty)
         return;
     ClrScannerDataMode clrDataMode(s_);
@@ -1702,13 +2054,13 @@ void ConverterPass2::image(bool fb2_inline, bool html_inline, bool scale)
 //-----------------------------------------------------------------------
 String ConverterPass2::isbn()
 {
-    if(!s_->BeginElement("isbn"))
+    if(!s_->BeginElement(E_ISBN))
         return "";
 
     String text;
     SetScannerDataMode setDataMode(s_);
     if(s_->LookAhead().type_ == LexScanner::DATA)
-        text = s_->GetToken().s_;
+        text = s_->GetToken().s_.str();
     s_->EndElement();
     return text;
 }
@@ -1716,14 +2068,14 @@ String ConverterPass2::isbn()
 //-----------------------------------------------------------------------
 void ConverterPass2::lang()
 {
-    lang_ = s_->SimpleTextElement("lang");
+    lang_ = s_->SimpleTextElement(E_LANG);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::p(const char *pelement, const char *cls)
 {
     AttrMap attrmap;
-    if(s_->BeginElement("p", &attrmap))
+    if(s_->BeginElement(E_P, &attrmap))
     {
         pout_->WriteFmt("<%s", pelement);
         if(cls)
@@ -1732,44 +2084,46 @@ void ConverterPass2::p(const char *pelement, const char *cls)
         CopyXmlLang(attrmap);
         pout_->WriteStr(">");
 
-        ParseTextAndEndElement("p");
+        ParseTextAndEndElement(E_P);
         pout_->WriteFmt("</%s>\n", pelement);
     }
+    else if(deferred_)
+        CollectId(attrmap);     // pass 1 collects id of empty element too
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::poem()
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("poem", &attrmap);
+    s_->BeginNotEmptyElement(E_POEM, &attrmap);
     pout_->WriteStr("<div class=\"poem\"");
     AddId(attrmap);
     CopyXmlLang(attrmap);
     pout_->WriteStr(">");
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
         title(false);
     //</title>
 
     //<epigraph>
-    while(s_->IsNextElement("epigraph"))
+    while(s_->IsNextElement(E_EPIGRAPH))
         epigraph();
     //</epigraph>
 
     //<stanza>
     do
         stanza();
-    while(s_->IsNextElement("stanza"));
+    while(s_->IsNextElement(E_STANZA));
     //</stanza>
 
     //<text-author>
-    while(s_->IsNextElement("text-author"))
+    while(s_->IsNextElement(E_TEXT_AUTHOR))
         text_author();
     //</text-author>
 
     //<data>
-    if(s_->IsNextElement("date"))
+    if(s_->IsNextElement(E_DATE))
         date();
     //</data>
 
@@ -1780,27 +2134,27 @@ void ConverterPass2::poem()
 //-----------------------------------------------------------------------
 void ConverterPass2::publish_info()
 {
-    if(!s_->BeginElement("publish-info"))
+    if(!s_->BeginElement(E_PUBLISH_INFO))
         return;
 
     //<book-name>
-    s_->SkipIfElement("book-name");
+    s_->SkipIfElement(E_BOOK_NAME);
     //</book-name>
 
     //<publisher>
-    s_->SkipIfElement("publisher");
+    s_->SkipIfElement(E_PUBLISHER);
     //</publisher>
 
     //<city>
-    s_->SkipIfElement("city");
+    s_->SkipIfElement(E_CITY);
     //</city>
 
     //<year>
-    s_->SkipIfElement("year");
+    s_->SkipIfElement(E_YEAR);
     //</year>
 
     //<isbn>
-    if(s_->IsNextElement("isbn"))
+    if(s_->IsNextElement(E_ISBN))
         isbn_ = isbn();
     //</isbn>
 
@@ -1811,98 +2165,104 @@ void ConverterPass2::publish_info()
 void ConverterPass2::section()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("section", &attrmap);
+    bool notempty = s_->BeginElement(E_SECTION, &attrmap);
 
     // set section language
     SetLanguage l(&sectXmlLang_, attrmap);
 
     sectionSize_ = 0;
     StartUnit(Unit::SECTION, &attrmap);
+    int idx = unitIdx_;
 
     if(!notempty)
         return;
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
     {
-        // add anchor ref
-        String id = units_[unitIdx_].noteRefId_;
-        if(!id.empty())
+        if(deferred_)
         {
-            id = noteidToAnchorId_[refidToNew_[id]];
-            if(!id.empty())
-                id = refidToUnit_[id]->file_ + ".xhtml#" + id;
-        }
+            // check if it has anchor
+            if(bodyType_ == Unit::NOTES || bodyType_ == Unit::COMMENTS)
+                units_[idx].noteRefId_ = attrmap.Get(A_ID);
 
-        title(false, id);
+            String plainText;
+            title(false, &plainText, units_[idx].noteRefId_);
+            units_[idx].title_ = plainText;
+        }
+        else
+            title(false, NULL, units_[idx].noteRefId_);
     }
     //</title>
 
     //<epigraph>
-    while(s_->IsNextElement("epigraph"))
+    while(s_->IsNextElement(E_EPIGRAPH))
         epigraph();
     //</epigraph>
 
     //<image>
-    if(s_->IsNextElement("image"))
+    if(s_->IsNextElement(E_IMAGE))
         image(false, false, false);
     //</image>
 
     //<annotation>
-    if(s_->IsNextElement("annotation"))
+    if(s_->IsNextElement(E_ANNOTATION))
         annotation();
     //</annotation>
 
-    if(s_->IsNextElement("section"))
+    if(s_->IsNextElement(E_SECTION))
+    {
+        int parent = parentUnit_;
+        parentUnit_ = idx;
         do
         {
             //<section>
             section();
             //</section>
         }
-        while(s_->IsNextElement("section"));
+        while(s_->IsNextElement(E_SECTION));
+        parentUnit_ = parent;
+    }
     else
     {
         for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
         {
             //<p>, <image>, <poem>, <subtitle>, <cite>, <empty-line>, <table>
-            if(!t.s_.compare("p"))
-                p();
-            else if(!t.s_.compare("image"))
+            switch(t.elem_)
             {
+            case E_P:
+                p();
+                break;
+            case E_IMAGE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE1);
                 image(false, false, false);
-            }
-            else if(!t.s_.compare("poem"))
-            {
+                break;
+            case E_POEM:
                 SwitchUnitIfSizeAbove(UNIT_SIZE1);
                 poem();
-            }
-            else if(!t.s_.compare("subtitle"))
-            {
+                break;
+            case E_SUBTITLE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE0);
                 subtitle();
-            }
-            else if(!t.s_.compare("cite"))
-            {
+                break;
+            case E_CITE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE2);
                 cite();
-            }
-            else if(!t.s_.compare("empty-line"))
-            {
+                break;
+            case E_EMPTY_LINE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE2);
                 empty_line();
-            }
-            else if(!t.s_.compare("table"))
-            {
+                break;
+            case E_TABLE:
                 SwitchUnitIfSizeAbove(UNIT_SIZE1);
                 table();
-            }
-            else
-            {
-                std::ostringstream ss;
-                ss << "<" << t.s_ << "> unexpected in <section>";
-                s_->Error(ss.str());
+                break;
+            default:
+                {
+                    std::ostringstream ss;
+                    ss << "<" << t.s_ << "> unexpected in <section>";
+                    s_->Error(ss.str());
+                }
             }
             //</p>, </image>, </poem>, </subtitle>, </cite>, </empty-line>, </table>
 
@@ -1916,22 +2276,22 @@ void ConverterPass2::section()
 //-----------------------------------------------------------------------
 void ConverterPass2::stanza()
 {
-    s_->BeginNotEmptyElement("stanza");
+    s_->BeginNotEmptyElement(E_STANZA);
     pout_->WriteStr("<div class=\"stanza\">");
 
     //<title>
-    if(s_->IsNextElement("title"))
+    if(s_->IsNextElement(E_TITLE))
         title(false);
     //</title>
 
     //<subtitle>
-    if(s_->IsNextElement("subtitle"))
+    if(s_->IsNextElement(E_SUBTITLE))
         subtitle();
     //</subtitle>
 
     do
         v();
-    while(s_->IsNextElement("v"));
+    while(s_->IsNextElement(E_V));
 
     pout_->WriteStr("</div>\n");
     s_->EndElement();
@@ -1940,10 +2300,10 @@ void ConverterPass2::stanza()
 //-----------------------------------------------------------------------
 void ConverterPass2::strikethrough()
 {
-    if(s_->BeginElement("strikethrough"))
+    if(s_->BeginElement(E_STRIKETHROUGH))
     {
         pout_->WriteStr("<del class=\"strikethrough\">");
-        ParseTextAndEndElement("strikethrough");
+        ParseTextAndEndElement(E_STRIKETHROUGH);
         pout_->WriteStr("</del>");
     }
 }
@@ -1951,10 +2311,10 @@ void ConverterPass2::strikethrough()
 //-----------------------------------------------------------------------
 void ConverterPass2::strong()
 {
-    if(s_->BeginElement("strong"))
+    if(s_->BeginElement(E_STRONG))
     {
         pout_->WriteStr("<strong class=\"e_strong\">");
-        ParseTextAndEndElement("strong");
+        ParseTextAndEndElement(E_STRONG);
         pout_->WriteStr("</strong>");
     }
 }
@@ -1963,17 +2323,17 @@ void ConverterPass2::strong()
 void ConverterPass2::style()
 {
     // ignore style
-    if(s_->BeginElement("style"))
-        ParseTextAndEndElement("strong");
+    if(s_->BeginElement(E_STYLE))
+        ParseTextAndEndElement(E_STRONG);
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::sub()
 {
-    if(s_->BeginElement("sub"))
+    if(s_->BeginElement(E_SUB))
     {
         pout_->WriteStr("<sub class=\"e_sub\">");
-        ParseTextAndEndElement("sub");
+        ParseTextAndEndElement(E_SUB);
         pout_->WriteStr("</sub>");
     }
 }
@@ -1982,25 +2342,27 @@ void ConverterPass2::sub()
 void ConverterPass2::subtitle()
 {
     AttrMap attrmap;
-    if(s_->BeginElement("subtitle", &attrmap))
+    if(s_->BeginElement(E_SUBTITLE, &attrmap))
     {
         pout_->WriteStr("<h2 class=\"e_h2\"");
         AddId(attrmap);
         CopyXmlLang(attrmap);
         pout_->WriteStr(">");
 
-        ParseTextAndEndElement("subtitle");
+        ParseTextAndEndElement(E_SUBTITLE);
         pout_->WriteStr("</h2>\n");
     }
+    else if(deferred_)
+        CollectId(attrmap);     // pass 1 collects id of empty element too
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::sup()
 {
-    if(s_->BeginElement("sup"))
+    if(s_->BeginElement(E_SUP))
     {
         pout_->WriteStr("<sup class=\"e_sup\">");
-        ParseTextAndEndElement("sup");
+        ParseTextAndEndElement(E_SUP);
         pout_->WriteStr("</sup>");
     }
 }
@@ -2009,11 +2371,11 @@ void ConverterPass2::sup()
 void ConverterPass2::table()
 {
     AttrMap attrmap;
-    s_->BeginNotEmptyElement("table", &attrmap);
+    s_->BeginNotEmptyElement(E_TABLE, &attrmap);
     pout_->WriteFmt("<table");
     AddId(attrmap);
 
-    CopyAttribute("style", attrmap);
+    CopyAttribute(A_STYLE, attrmap);
 
     pout_->WriteStr(">");
     do
@@ -2022,7 +2384,7 @@ void ConverterPass2::table()
         tr();
         //</tr>
     }
-    while(s_->IsNextElement("tr"));
+    while(s_->IsNextElement(E_TR));
     pout_->WriteFmt("</table>\n");
     s_->EndElement();
 }
@@ -2031,16 +2393,16 @@ void ConverterPass2::table()
 void ConverterPass2::td()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("td", &attrmap);
+    bool notempty = s_->BeginElement(E_TD, &attrmap);
 
     pout_->WriteFmt("<td");
     AddId(attrmap);
 
-    CopyAttribute("style", attrmap);
-    CopyAttribute("colspan", attrmap);
-    CopyAttribute("rowspan", attrmap);
-    CopyAttribute("align", attrmap);
-    CopyAttribute("valign", attrmap);
+    CopyAttribute(A_STYLE, attrmap);
+    CopyAttribute(A_COLSPAN, attrmap);
+    CopyAttribute(A_ROWSPAN, attrmap);
+    CopyAttribute(A_ALIGN, attrmap);
+    CopyAttribute(A_VALIGN, attrmap);
     CopyXmlLang(attrmap);
 
     if(!notempty)
@@ -2050,7 +2412,7 @@ void ConverterPass2::td()
     }
     pout_->WriteStr(">");
 
-    ParseTextAndEndElement("td");
+    ParseTextAndEndElement(E_TD);
     pout_->WriteStr("</td>\n");
 }
 
@@ -2058,32 +2420,34 @@ void ConverterPass2::td()
 void ConverterPass2::text_author()
 {
     AttrMap attrmap;
-    if(s_->BeginElement("text-author", &attrmap))
+    if(s_->BeginElement(E_TEXT_AUTHOR, &attrmap))
     {
         pout_->WriteFmt("<div class=\"text_author\"");
         AddId(attrmap);
         CopyXmlLang(attrmap);
         pout_->WriteStr(">");
 
-        ParseTextAndEndElement("text-author");
+        ParseTextAndEndElement(E_TEXT_AUTHOR);
         pout_->WriteStr("</div>\n");
     }
+    else if(deferred_)
+        CollectId(attrmap);     // pass 1 collects id of empty element too
 }
 
 //-----------------------------------------------------------------------
 void ConverterPass2::th()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("th", &attrmap);
+    bool notempty = s_->BeginElement(E_TH, &attrmap);
 
     pout_->WriteFmt("<th");
     AddId(attrmap);
 
-    CopyAttribute("style", attrmap);
-    CopyAttribute("colspan", attrmap);
-    CopyAttribute("rowspan", attrmap);
-    CopyAttribute("align", attrmap);
-    CopyAttribute("valign", attrmap);
+    CopyAttribute(A_STYLE, attrmap);
+    CopyAttribute(A_COLSPAN, attrmap);
+    CopyAttribute(A_ROWSPAN, attrmap);
+    CopyAttribute(A_ALIGN, attrmap);
+    CopyAttribute(A_VALIGN, attrmap);
     CopyXmlLang(attrmap);
 
     if(!notempty)
@@ -2093,46 +2457,65 @@ void ConverterPass2::th()
     }
     pout_->WriteStr(">");
 
-    ParseTextAndEndElement("th");
+    ParseTextAndEndElement(E_TH);
     pout_->WriteStr("</th>\n");
 }
 
 //-----------------------------------------------------------------------
-void ConverterPass2::title(bool startUnit, const String &anchorid)
+void ConverterPass2::title(bool startUnit, String *plainText, const String &noteRefId)
 {
     AttrMap attrmap;
-    if(!s_->BeginElement("title", &attrmap))
+    if(!s_->BeginElement(E_TITLE, &attrmap))
         return;
 
+    String buf;
     if(startUnit)
+    {
         StartUnit(Unit::TITLE);
+        if(deferred_ && !plainText)
+            plainText = &buf;
+    }
 
     pout_->WriteFmt("<div class=\"title\"");
     CopyXmlLang(attrmap);
     pout_->WriteFmt(">\n");
     for(LexScanner::Token t = s_->LookAhead(); t.type_ == LexScanner::START; t = s_->LookAhead())
     {
-        if(!t.s_.compare("p"))
+        switch(t.elem_)
         {
+        case E_P:
             //<p>
-            p("h1", "e_h1");
+            if(!plainText)
+                p("h1", "e_h1");
+            else
+            {
+                String text;
+                plainText_ = &text;
+                p("h1", "e_h1");
+                plainText_ = NULL;
+                *plainText = Concat(*plainText, " ", text);
+            }
             //</p>
-        }
-        else if(!t.s_.compare("empty-line"))
-        {
+            break;
+        case E_EMPTY_LINE:
             //<empty-line>
             empty_line();
+            if(plainText)
+                *plainText += " ";
             //</empty-line>
-        }
-        else
-        {
-            std::ostringstream ss;
-            ss << "<" << t.s_ << "> unexpected in <title>";
-            s_->Error(ss.str());
+            break;
+        default:
+            {
+                std::ostringstream ss;
+                ss << "<" << t.s_ << "> unexpected in <title>";
+                s_->Error(ss.str());
+            }
         }
     }
-    if(!anchorid.empty())
-        pout_->WriteFmt("<h1><span class=\"anchor\"><a href=\"%s\">[&lt;-]</a></span></h1>", anchorid.c_str());
+    if(startUnit && deferred_)
+        units_[unitIdx_].title_ = *plainText;
+    if(!noteRefId.empty())
+        WriteFixup(Fixup(Fixup::NOTE_BACKLINK, RefIndex(noteRefId)));
     pout_->WriteStr("</div>\n");
 
     s_->EndElement();
@@ -2141,17 +2524,17 @@ void ConverterPass2::title(bool startUnit, const String &anchorid)
 //-----------------------------------------------------------------------
 void ConverterPass2::title_info()
 {
-    s_->BeginNotEmptyElement("title-info");
+    s_->BeginNotEmptyElement(E_TITLE_INFO);
 
     //<genre>
-    s_->CheckAndSkipElement("genre");
-    s_->SkipAll("genre");
+    s_->CheckAndSkipElement(E_GENRE);
+    s_->SkipAll(E_GENRE);
     //</genre>
 
     //<author>
     do
         author();
-    while(s_->IsNextElement("author"));
+    while(s_->IsNextElement(E_AUTHOR));
     //<author>
 
     //<book-title>
@@ -2159,21 +2542,21 @@ void ConverterPass2::title_info()
     //</book-title>
 
     //<annotation>
-    if(s_->IsNextElement("annotation"))
+    if(s_->IsNextElement(E_ANNOTATION))
         annotation(true);
     //</annotation>
 
     //<keywords>
-    s_->SkipIfElement("keywords");
+    s_->SkipIfElement(E_KEYWORDS);
     //</keywords>
 
     //<date>
-    if(s_->IsNextElement("date"))
+    if(s_->IsNextElement(E_DATE))
         title_info_date_ = date__epub();
     //<date>
 
     //<coverpage>
-    if(s_->IsNextElement("coverpage"))
+    if(s_->IsNextElement(E_COVERPAGE))
         coverpage();
     //</coverpage>
 
@@ -2188,10 +2571,10 @@ void ConverterPass2::title_info()
 void ConverterPass2::tr()
 {
     AttrMap attrmap;
-    bool notempty = s_->BeginElement("tr", &attrmap);
+    bool notempty = s_->BeginElement(E_TR, &attrmap);
     pout_->WriteStr("<tr");
 
-    CopyAttribute("align", attrmap);
+    CopyAttribute(A_ALIGN, attrmap);
 
     if(!notempty)
     {
@@ -2203,9 +2586,9 @@ void ConverterPass2::tr()
     for(;;)
     {
         //<th>, <td>
-        if(s_->IsNextElement("th"))
+        if(s_->IsNextElement(E_TH))
             th();
-        else if(s_->IsNextElement("td"))
+        else if(s_->IsNextElement(E_TD))
             td();
         else
             break;
@@ -2220,28 +2603,83 @@ void ConverterPass2::tr()
 void ConverterPass2::v()
 {
     AttrMap attrmap;
-    if(s_->BeginElement("v", &attrmap))
+    if(s_->BeginElement(E_V, &attrmap))
     {
         pout_->WriteStr("<p class=\"v\"");
         AddId(attrmap);
         CopyXmlLang(attrmap);
         pout_->WriteStr(">");
 
-        ParseTextAndEndElement("v");
+        ParseTextAndEndElement(E_V);
         pout_->WriteStr("</p>\n");
     }
+    else if(deferred_)
+        CollectId(attrmap);     // pass 1 collects id of empty element too
 }
 
 
+//-----------------------------------------------------------------------
+static void LoadExtFile(ExtFile *f)
+{
+    Ptr<InStm> stm = CreateInFileStm(f->ospath_.c_str());
+    while(!stm->IsEOF())
+    {
+        char buf[0x4000];
+        std::size_t cnt = stm->Read(buf, sizeof(buf));
+        f->data_.insert(f->data_.end(), buf, buf + cnt);
+    }
+}
+
+//-----------------------------------------------------------------------
+static void ScanExtFiles(const strvector &dirs, const char *ext, const char *prefix, bool font, ExtFileVector *files)
+{
+    strvector::const_iterator cit = dirs.begin(), cit_end = dirs.end();
+    for(; cit < cit_end; ++cit)
+    {
+        Ptr<ScanDir> sd = CreateScanDir(cit->c_str(), ext);
+        String fname;
+        for(String ospath = sd->GetNextFile(&fname); !ospath.empty(); ospath = sd->GetNextFile(&fname))
+        {
+            if(font && !IsFontEmbedAllowed(ospath))
+                FontError(ospath, "embedding not allowed");
+            files->push_back(ExtFile(String(prefix) + fname, ospath));
+            LoadExtFile(&files->back());
+        }
+    }
+}
+
+//-----------------------------------------------------------------------
+Ptr<ExtResources> FB2TOEPUB_DECL LoadExtResources(const strvector &css, const strvector &fonts)
+{
+    Ptr<ExtResources> res = new ExtResources();
+    ScanExtFiles(css, "css", "css/", false, &res->cssfiles_);
+    ScanExtFiles(fonts, "ttf", "fonts/", true, &res->ttffiles_);
+    ScanExtFiles(fonts, "otf", "fonts/", true, &res->otffiles_);
+    return res;
+}
+
+//-----------------------------------------------------------------------
 void FB2TOEPUB_DECL DoConvertionPass2  (LexScanner *scanner,
-                                        const strvector &css,
-                                        const strvector &fonts,
+                                        ExtResources *res,
                                         const strvector &mfonts,
                                         XlitConv *xlitConv,
                                         UnitArray *units,
                                         OutPackStm *pout)
 {
-    Ptr<ConverterPass2> conv = new ConverterPass2(scanner, css, fonts, mfonts, xlitConv, units, pout);
+    Ptr<ConverterPass2> conv = new ConverterPass2(scanner, res, mfonts, xlitConv, units, pout);
+    conv->Scan();
+}
+
+//-----------------------------------------------------------------------
+void FB2TOEPUB_DECL DoConvertionSinglePass (LexScanner *scanner,
+                                            ExtResources *res,
+                                            const strvector &mfonts,
+                                            XlitConv *xlitConv,
+                                            OutPackStm *pout,
+                                            UnitArray *pass1Units)
+{
+    UnitArray units;
+    Ptr<ConverterPass2> conv = new ConverterPass2(scanner, res, mfonts, xlitConv, &units, pout, true, pass1Units);
     conv->Scan();
 }
 
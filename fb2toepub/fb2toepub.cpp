@@ -27,7 +27,9 @@
 #include "base64.h"
 
 #include <string>
+#include <set>
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,6 +37,10 @@
 #if (defined unix)
 #include <unistd.h>
 #endif
+#if defined(WIN32)
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace Fb2ToEpub;
 
@@ -55,8 +61,15 @@ static void Usage()
     printf("Print input fb2 file info to console and exit:\n");
     printf("    fb2toepub -i <input file>\n\n");
     printf("or\n\n");
+    printf("Save cover image of input fb2 file and exit:\n");
+    printf("    fb2toepub --cover <input file> <output image file>\n\n");
+    printf("or\n\n");
     printf("Convert input fb2 file to output epub file:\n");
-    printf("    fb2toepub <options> <input file> <output file>\n\n");
+    printf("    fb2toepub <options> <input file> <output file>\n");
+    printf("    (input file - is standard input)\n\n");
+    printf("or\n\n");
+    printf("Convert all fb2 files of input zip archive to epub files in output directory:\n");
+    printf("    fb2toepub -a <options> <input zip file> <output directory>\n\n");
     printf("Options:\n");
     printf("    -s <path>               Path to .css style directory\n");
     printf("                              (optional, any number)\n");
@@ -67,14 +80,18 @@ static void Usage()
     printf("    -t <path>               Path to configuration XML file\n");
     printf("                              for transliteration of title and TOC\n");
     printf("                              (optional, no more than one)\n");
+    printf("    -c <path>               Path to cache directory for document structure,\n");
+    printf("                              speeds up repeated convertion of the same file\n");
+    printf("                              (optional, no more than one)\n");
 #if FB2TOEPUB_DONT_OVERWRITE
     printf("        --overwrite         Overwrite output file if exists\n");
     printf("                              If not set and file exists, exit with error\n");
 #endif
     printf("    -mf <path>              Add ttf font path to manifest only\n");
     printf("                              (optional, any number)\n");
+    printf("    -a, --archive           Convert all fb2 files of input zip archive\n");
     printf("    -h, --help              Help and exit\n\n");
-    printf("Options are case-sensitive.\nSpace between -i/-s/-f/-sf/-t/-mf and path is mandatory.\n");
+    printf("Options are case-sensitive.\nSpace between -i/-s/-f/-sf/-t/-c/-mf and path is mandatory.\n");
 }
 
 //-----------------------------------------------------------------------
@@ -126,6 +143,190 @@ static void DeleteFile(const String &name)
 #endif
 }
 
+//-----------------------------------------------------------------------
+static int Cover(const String &in, const String &out)
+{
+    // check
+    if(in.empty() || out.empty())
+        return ErrorExit("input or output file is not defined");
+
+    try
+    {
+        return SaveCover(in, out);
+    }
+    catch(const Exception &ex)
+    {
+        fprintf(stderr, "%s\n[%d]%s\n", ex.What().c_str(), errno, strerror(errno));
+        return 1;
+    }
+    catch(...)
+    {
+        fprintf(stderr, "Unknown error\n[%d]%s\n", errno, strerror(errno));
+        return 1;
+    }
+}
+
+//-----------------------------------------------------------------------
+// Standard input can't be read twice, so it's converted in push mode
+// performing pass 1 while the input is being read
+static int ConvertStdin(const strvector &css, const strvector &fonts, const strvector &mfonts,
+                        XlitConv *xlitConv, OutPackStm *pout)
+{
+#if defined(WIN32)
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    Ptr<ExtResources> res = LoadExtResources(css, fonts);
+    Ptr<PushConverter> conv = StartPushConvert("stdin");
+    char buf[0x10000];
+    for(;;)
+    {
+        std::size_t cnt = fread(buf, 1, sizeof(buf), stdin);
+        if(cnt)
+            conv->Push(buf, cnt);
+        if(cnt < sizeof(buf))
+            break;
+    }
+    if(ferror(stdin))
+        IOError("stdin", "read error");
+    return conv->Finish(res, mfonts, xlitConv, pout);
+}
+
+//-----------------------------------------------------------------------
+static bool IsFb2Entry(const String &name)
+{
+    static const char ext[] = ".fb2";
+    std::size_t len = sizeof(ext) - 1;
+    if(name.length() <= len)
+        return false;
+    const char *p = name.c_str() + name.length() - len;
+    for(std::size_t i = 0; i < len; ++i)
+        if(tolower(static_cast<unsigned char>(p[i])) != ext[i])
+            return false;
+    return true;
+}
+
+//-----------------------------------------------------------------------
+static String EntryOutName(const String &outdir, const String &name, std::set<String> *used)
+{
+    // strip directory and extension
+    std::size_t pos = name.find_last_of("/\\");
+    String base = name.substr(pos == String::npos ? 0 : pos + 1);
+    base = base.substr(0, base.length() - 4);
+
+    // entries from different archive directories may share the base name:
+    // add numeric suffix (compare ignoring case for case-insensitive file systems)
+    String file = base;
+    for(int n = 2;; ++n)
+    {
+        String key = file;
+        for(std::size_t i = 0; i < key.length(); ++i)
+            key[i] = static_cast<char>(tolower(static_cast<unsigned char>(key[i])));
+        if(used->insert(key).second)
+            break;
+        char buf[32];
+        sprintf(buf, "_%d", n);
+        file = base + buf;
+    }
+
+    if(outdir.empty())
+        return file + ".epub";
+    char last = outdir[outdir.length() - 1];
+    return outdir + ((last == '/' || last == '\\') ? "" : "/") + file + ".epub";
+}
+
+//-----------------------------------------------------------------------
+// Convert all fb2 files of zip archive sharing the archive handle
+// and external resources (stylesheets, fonts, transliteration)
+static int ConvertArchive(const String &in, const String &outdir, const strvector &css, const strvector &fonts,
+                          const strvector &mfonts, const String &xlit, const String &cacheDir
+#if FB2TOEPUB_DONT_OVERWRITE
+                          , bool overwrite
+#endif
+                          )
+{
+    Ptr<InPackArchive> arch;
+    Ptr<ExtResources> res;
+    Ptr<XlitConv> xlitConv;
+    try
+    {
+        arch = CreateInPackArchive(in.c_str());
+        res = LoadExtResources(css, fonts);
+        if(!xlit.empty())
+            xlitConv = CreateXlitConverter(CreateInUnicodeStm(CreateUnpackStm(xlit.c_str())));
+    }
+    catch(const Exception &ex)
+    {
+        fprintf(stderr, "%s\n[%d]%s\n", ex.What().c_str(), errno, strerror(errno));
+        return 1;
+    }
+    catch(...)
+    {
+        fprintf(stderr, "Unknown error\n[%d]%s\n", errno, strerror(errno));
+        return 1;
+    }
+
+    int ret = 0;
+    std::set<String> usedNames;
+    for(;;)
+    {
+        String out;
+        bool fOutputFileCreated = false;
+        try
+        {
+            if(!arch->NextFile())
+                break;
+            String name = arch->FileName();
+            if(!IsFb2Entry(name))
+                continue;
+            out = EntryOutName(outdir, name, &usedNames);
+
+#if FB2TOEPUB_DONT_OVERWRITE
+            if(!overwrite && FileExists(out))
+                ExternalError((String("output file ") + out + " exists"));
+#endif
+
+            // create input stream
+            Ptr<InStm> pin = arch->GetFileStm();
+#if FB2TOEPUB_READ_AHEAD
+            // overlap unpacking with parsing
+            pin = CreateReadAheadStm(pin, FB2TOEPUB_READ_AHEAD_SIZE);
+#endif
+            pin = CreateInUnicodeStm(pin);
+#if FB2TOEPUB_SPOOL_INPUT
+            // unpack and convert input only once if it's read twice
+            // (by both passes, or by cache key and conversion)
+            if(!FB2TOEPUB_SINGLE_PASS || !cacheDir.empty())
+                pin = CreateSpoolStm(pin, FB2TOEPUB_SPOOL_MEM_SIZE);
+#endif
+
+            // create output stream and convert
+            {
+                Ptr<OutPackStm> pout = CreatePackStm(out.c_str());
+                fOutputFileCreated = true;
+                Convert(pin, res, mfonts, xlitConv, pout, cacheDir);
+            }
+            printf("%s -> %s\n", name.c_str(), out.c_str());
+            continue;
+        }
+        catch(const Exception &ex)
+        {
+            fprintf(stderr, "%s\n[%d]%s\n", ex.What().c_str(), errno, strerror(errno));
+        }
+        catch(...)
+        {
+            fprintf(stderr, "Unknown error\n[%d]%s\n", errno, strerror(errno));
+        }
+
+        // error: delete partial output and continue with next file
+        ret = 1;
+        if(fOutputFileCreated)
+            DeleteFile(out);
+        if(out.empty())
+            break;  // archive error
+    }
+    return ret;
+}
+
 //-----------------------------------------------------------------------
 int main(int argc, char **argv)
 {
@@ -138,11 +339,11 @@ int main(int argc, char **argv)
     }
 
     strvector css, fonts, mfonts;
-    String xlit, in, out;
+    String xlit, cacheDir, in, out;
 #if FB2TOEPUB_DONT_OVERWRITE
     bool overwrite = false;
 #endif
-    bool infoOnly = false;
+    bool infoOnly = false, coverOnly = false, archive = false;
 
     int i = 1;
     while(i < argc)
@@ -176,6 +377,14 @@ int main(int argc, char **argv)
                 return ErrorExit("transliteration file redefinition");
             xlit = argv[i++];
         }
+        else if(!strcmp(argv[i], "-c"))
+        {
+            if(++i >= argc)
+                return ErrorExit("incomplete -c option");
+            if(!cacheDir.empty())
+                return ErrorExit("cache directory redefinition");
+            cacheDir = argv[i++];
+        }
         else if(!strcmp(argv[i], "--autotest"))
         {
             // undocumented: mode for automatic testing
@@ -196,12 +405,24 @@ int main(int argc, char **argv)
             infoOnly = true;
             ++i;
         }
+        else if(!strcmp(argv[i], "--cover"))
+        {
+            coverOnly = true;
+            ++i;
+        }
+        else if(!strcmp(argv[i], "-a") || !strcmp(argv[i], "--archive"))
+        {
+            archive = true;
+            ++i;
+        }
         else if(!strcmp(argv[i], "-mf"))
         {
             if(++i >= argc)
                 return ErrorExit("incomplete -mf option");
             mfonts.push_back(argv[i++]);
         }
+        else if(!strcmp(argv[i], "-") && in.empty())
+            in = argv[i++];     // standard input
         else if(argv[i][0] == '-')
             return ErrorExit(String("unrecognized command line switch ") + argv[i]);
         else if(in.empty())
@@ -211,13 +432,26 @@ int main(int argc, char **argv)
         else
             return ErrorExit(String("unrecognized file ") + argv[i]);
 
+    bool stdinput = (in == "-");
+    if(stdinput && (infoOnly || coverOnly || archive || !cacheDir.empty()))
+        return ErrorExit("standard input can't be used with -i, --cover, -a or -c");
+
     if(infoOnly)
         return Info(in);
+    if(coverOnly)
+        return Cover(in, out);
 
     // check
     if(in.empty() || out.empty())
         return ErrorExit("input or output file is not defined");
 
+    if(archive)
+#if FB2TOEPUB_DONT_OVERWRITE
+        return ConvertArchive(in, out, css, fonts, mfonts, xlit, cacheDir, overwrite);
+#else
+        return ConvertArchive(in, out, css, fonts, mfonts, xlit, cacheDir);
+#endif
+
     bool fOutputFileCreated = false;
     try
     {
@@ -226,8 +460,26 @@ int main(int argc, char **argv)
             ExternalError((String("output file ") + out + " exists"));
 #endif
 
-        // create input stream
-        Ptr<InStm> pin = CreateInUnicodeStm(CreateUnpackStm(in.c_str()));
+        // create input stream (standard input is read by ConvertStdin)
+        Ptr<InStm> pin;
+        if(!stdinput)
+        {
+            bool packed = false, converted = false, mapped = false;
+            pin = CreateUnpackStm(in.c_str(), &packed, &mapped);
+#if FB2TOEPUB_READ_AHEAD
+            // overlap input reading or unpacking with parsing
+            // (mapped file is already read ahead by the kernel)
+            if(!mapped)
+                pin = CreateReadAheadStm(pin, FB2TOEPUB_READ_AHEAD_SIZE);
+#endif
+            pin = CreateInUnicodeStm(pin, &converted);
+#if FB2TOEPUB_SPOOL_INPUT
+            // unpack and convert input only once if it's read twice
+            // (by both passes, or by cache key and conversion)
+            if((packed || converted) && (!FB2TOEPUB_SINGLE_PASS || !cacheDir.empty()))
+                pin = CreateSpoolStm(pin, FB2TOEPUB_SPOOL_MEM_SIZE);
+#endif
+        }
 
         // create output stream
         Ptr<OutPackStm> pout = CreatePackStm(out.c_str());
@@ -238,7 +490,9 @@ int main(int argc, char **argv)
         if(!xlit.empty())
             xlitConv = CreateXlitConverter(CreateInUnicodeStm(CreateUnpackStm(xlit.c_str())));
 
-        return Convert(pin, css, fonts, mfonts, xlitConv, pout);
+        if(stdinput)
+            return ConvertStdin(css, fonts, mfonts, xlitConv, pout);
+        return Convert(pin, css, fonts, mfonts, xlitConv, pout, cacheDir);
     }
     catch(const Exception &ex)
     {
@@ -22,6 +22,7 @@
 
 #include <sstream>
 #include "converter.h"
+#include "streamconv.h"
 
 namespace Fb2ToEpub
 {
@@ -33,22 +34,158 @@ int PrintInfo(const String &in)
     return 0;
 }
 
+//-----------------------------------------------------------------------
+int SaveCover(const String &in, const String &out)
+{
+    DoSaveCover(in, out);
+    return 0;
+}
+
 //-----------------------------------------------------------------------
 int Convert(InStm *pin, const strvector &css, const strvector &fonts, const strvector &mfonts,
-            XlitConv *xlitConv, OutPackStm *pout)
+            XlitConv *xlitConv, OutPackStm *pout, const String &cacheDir)
+{
+    return Convert(pin, LoadExtResources(css, fonts), mfonts, xlitConv, pout, cacheDir);
+}
+
+//-----------------------------------------------------------------------
+static int ConvertPass2(InStm *pin, UnitArray *units, ExtResources *res, const strvector &mfonts,
+                        XlitConv *xlitConv, OutPackStm *pout)
 {
-    // perform pass 1 to determine fb2 document structure and to collect all cross-references inside the fb2 file
-    UnitArray units;
-    DoConvertionPass1(CreateScanner(pin), &units);
     pin->Rewind();
 
     // sanity check
-    if(units.size() == 0)
+    if(units->size() == 0)
         InternalError(__FILE__, __LINE__, "I don't know why but it happened that there is no content in input file!");
 
     // perform pass 2 to create epub document
-    DoConvertionPass2(CreateScanner(pin), css, fonts, mfonts, xlitConv, &units, pout);
+    DoConvertionPass2(CreateScanner(pin), res, mfonts, xlitConv, units, pout);
+    pout->Close();
+    return 0;
+}
+
+//-----------------------------------------------------------------------
+int Convert(InStm *pin, ExtResources *res, const strvector &mfonts,
+            XlitConv *xlitConv, OutPackStm *pout, const String &cacheDir)
+{
+    UnitArray units;
+    String key;
+    if(!cacheDir.empty())
+    {
+        // the same input may have been converted before, then pass 1 is not necessary
+        key = Pass1CacheKey(pin);
+        if(LoadPass1Cache(cacheDir, key, &units))
+            return ConvertPass2(pin, &units, res, mfonts, xlitConv, pout);
+    }
+
+#if FB2TOEPUB_SINGLE_PASS
+    // parse input once, cross-references are fixed up when output file layout is known
+    DoConvertionSinglePass(CreateScanner(pin), res, mfonts, xlitConv, pout, key.empty() ? NULL : &units);
+    pout->Close();
+    if(!key.empty())
+        SavePass1Cache(cacheDir, key, units);
     return 0;
+#else
+    // perform pass 1 to determine fb2 document structure and to collect all cross-references inside the fb2 file
+    DoConvertionPass1(CreateScanner(pin), &units);
+    if(!key.empty())
+        SavePass1Cache(cacheDir, key, units);
+    return ConvertPass2(pin, &units, res, mfonts, xlitConv, pout);
+#endif
+}
+
+
+//-----------------------------------------------------------------------
+// PUSH MODE CONVERTER IMPLEMENTATION
+// Decoding streams read their source until their buffers are full, so pushed
+// input is decoded only while at least PUSH_LOOKAHEAD bytes of it are not read
+// yet, that's more than decoding of PUSH_BLOCK_SIZE bytes may read. Decoded
+// input is spooled for pass 2 and pushed to the scanner of incremental pass 1.
+//-----------------------------------------------------------------------
+const std::size_t PUSH_BLOCK_SIZE   = 0x1000;
+const std::size_t PUSH_LOOKAHEAD    = 4 * (FB2TOEPUB_CONV_BUFFER_SIZE > 0x10000 ? FB2TOEPUB_CONV_BUFFER_SIZE : 0x10000);  // 0x10000 is UTF-8 check block
+
+class PushConverterImpl : public PushConverter, Noncopyable
+{
+    Ptr<InPushStm>          push_;      // raw input fed by Push
+    Ptr<InStm>              pin_;       // decoded and spooled input
+    Ptr<PushScanner>        scanner_;
+    Ptr<ConvertionPass1>    pass1_;
+    UnitArray               units_;     // pass 1 result
+    bool                    done_;      // pass 1 is done
+    bool                    finished_;  // all input is pushed
+
+    void Decode();
+
+public:
+    explicit PushConverterImpl(const String &uiFileName)
+        : push_(CreateInPushStm(uiFileName)), done_(false), finished_(false) {}
+
+    //virtuals
+    void    Push(const void *p, std::size_t cnt);
+    int     Finish(ExtResources *res, const strvector &mfonts, XlitConv *xlitConv, OutPackStm *pout);
+};
+
+//-----------------------------------------------------------------------
+void PushConverterImpl::Decode()
+{
+    if(!finished_ && push_->Available() < PUSH_LOOKAHEAD)
+        return;
+
+    if(!pin_)
+    {
+        // encoding is sniffed from the beginning of the input
+        pin_        = CreateSpoolStm(CreateInUnicodeStm(push_), FB2TOEPUB_SPOOL_MEM_SIZE);
+        scanner_    = CreatePushScanner(pin_);
+        pass1_      = StartConvertionPass1(scanner_, &units_);
+    }
+
+    char buf[PUSH_BLOCK_SIZE];
+    while(finished_ || push_->Available() >= PUSH_LOOKAHEAD)
+    {
+        std::size_t cnt = pin_->Read(buf, sizeof(buf));
+        if(!cnt)
+            break;
+        if(!done_)
+            scanner_->Push(buf, cnt);   // the rest is only spooled for pass 2
+    }
+
+    if(done_)
+        return;
+    if(finished_)
+        scanner_->Finish();
+    done_ = pass1_->Resume();
+}
+
+//-----------------------------------------------------------------------
+void PushConverterImpl::Push(const void *p, std::size_t cnt)
+{
+    if(finished_)
+        InternalError(__FILE__, __LINE__, "push convertion is already finished");
+
+    push_->Push(p, cnt);
+    Decode();
+}
+
+//-----------------------------------------------------------------------
+int PushConverterImpl::Finish(ExtResources *res, const strvector &mfonts, XlitConv *xlitConv, OutPackStm *pout)
+{
+    if(finished_)
+        InternalError(__FILE__, __LINE__, "push convertion is already finished");
+
+    finished_ = true;
+    push_->Finish();
+    Decode();
+    if(!done_)
+        InternalError(__FILE__, __LINE__, "pass 1 isn't done at the end of input");
+
+    return ConvertPass2(pin_, &units_, res, mfonts, xlitConv, pout);
+}
+
+//-----------------------------------------------------------------------
+Ptr<PushConverter> StartPushConvert(const String &uiFileName)
+{
+    return new PushConverterImpl(uiFileName);
 }
 
 
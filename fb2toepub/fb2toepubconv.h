@@ -23,13 +23,57 @@
 
 #include "streamzip.h"
 #include "translit.h"
+#include <vector>
 
 namespace Fb2ToEpub
 {
 
+    //-----------------------------------------------------------------------
+    // EXTERNAL RESOURCES (STYLESHEETS AND FONTS)
+    // Loaded once and may be shared by several convertions
+    //-----------------------------------------------------------------------
+    struct ExtFile
+    {
+        String              fname_, ospath_;    // file name (inside epub) and OS path
+        std::vector<char>   data_;              // file contents
+        ExtFile() {}
+        ExtFile(const String &fname, const String &ospath) : fname_(fname), ospath_(ospath) {}
+    };
+    typedef std::vector<ExtFile> ExtFileVector;
+
+    struct ExtResources : public Object
+    {
+        ExtFileVector       cssfiles_;              // all stylesheet files
+        ExtFileVector       ttffiles_, otffiles_;   // all font files
+    };
+
+    Ptr<ExtResources> FB2TOEPUB_DECL LoadExtResources(const strvector &css, const strvector &fonts);
+
+    //-----------------------------------------------------------------------
+    // If cacheDir is not empty, document structure found by pass 1 is stored
+    // there, and pass 1 is skipped when the same input is converted again.
+    //-----------------------------------------------------------------------
     int FB2TOEPUB_DECL PrintInfo(const String &in);
+    int FB2TOEPUB_DECL SaveCover(const String &in, const String &out);
     int FB2TOEPUB_DECL Convert (InStm *pin, const strvector &css, const strvector &fonts, const strvector &mfonts,
-                                XlitConv *xlitConv, OutPackStm *pout);
+                                XlitConv *xlitConv, OutPackStm *pout, const String &cacheDir = "");
+    int FB2TOEPUB_DECL Convert (InStm *pin, ExtResources *res, const strvector &mfonts,
+                                XlitConv *xlitConv, OutPackStm *pout, const String &cacheDir = "");
+
+    //-----------------------------------------------------------------------
+    // PUSH MODE CONVERTION
+    // Input is pushed in chunks as it arrives. Push performs as much of pass 1
+    // as the data pushed so far allows, Finish completes it and performs pass 2.
+    //-----------------------------------------------------------------------
+    class PushConverter : public Object
+    {
+    public:
+        virtual void    Push(const void *p, std::size_t cnt) = 0;   // throws on errors found by pass 1
+        virtual int     Finish(ExtResources *res, const strvector &mfonts,
+                               XlitConv *xlitConv, OutPackStm *pout) = 0;
+    };
+
+    Ptr<PushConverter> FB2TOEPUB_DECL StartPushConvert(const String &uiFileName);
 
 };  //namespace Fb2ToEpub
 
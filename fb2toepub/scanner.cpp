@@ -728,12 +728,12 @@ static yyconst flex_int16_t yy_chk[896] =
 
 namespace Fb2ToEpub
 {
-    static const LexScanner::Token  lt      (LexScanner::DATA, "&lt;", 4),
-                                    gt      (LexScanner::DATA, "&gt;", 4),
-                                    amp     (LexScanner::DATA, "&amp;", 5),
-                                    apos    (LexScanner::DATA, "&apos;", 6),
-                                    quot    (LexScanner::DATA, "&quot;", 6),
-                                    unknown (LexScanner::DATA, "?", 1);
+    static const LexScanner::Token  lt      (LexScanner::DATA, TextView("&lt;"), 4),
+                                    gt      (LexScanner::DATA, TextView("&gt;"), 4),
+                                    amp     (LexScanner::DATA, TextView("&amp;"), 5),
+                                    apos    (LexScanner::DATA, TextView("&apos;"), 6),
+                                    quot    (LexScanner::DATA, TextView("&quot;"), 6),
+                                    unknown (LexScanner::DATA, TextView("?"), 1);
 
     //-----------------------------------------------------------------------
     class ScannerImpl : public Fb2ToEpub::LexScanner, public yyFlexLexer, Noncopyable
@@ -743,11 +743,14 @@ namespace Fb2ToEpub
         std::vector<Token>          tokenStack_;
         bool                        skipMode_;
         bool                        dataMode_;
+        bool                        chunkMode_;
         int                         doctypeCnt_;
-        Loc                         loc_;
+        Span                        span_;
         int                         stateCaller_;
         bool                        attrHasValue_;
         Token                       last_;
+        TextStore                   text_;
+        std::vector<char>           vbuf_;
 
         Token ScanToken();
 
@@ -755,8 +758,11 @@ namespace Fb2ToEpub
         {
             for(;;)     // concatenate all DATA together
             {
+                if(chunkMode_ && t->type_ == DATA && t->s_.size() >= FB2TOEPUB_DATA_CHUNK_SIZE)
+                    return;     // chunk is full, the rest is returned by next GetToken
+
                 Token t1 = ScanToken();
-                t1.loc_ = loc_;
+                t1.span_ = span_;
 
                 if(t1.type_ != t->type_)
                 {
@@ -764,22 +770,15 @@ namespace Fb2ToEpub
                     return;
                 }
 
-                t->s_           += t1.s_;
+                text_.Append(&t->s_, t1.s_);
                 t->size_        += t1.size_;
-                t->loc_.lstLn_  = t1.loc_.lstLn_;
-                t->loc_.lstCol_ = t1.loc_.lstCol_;
+                t->span_.lst_   = t1.span_.lst_;
             }
         }
 
-        void NewLn()
-        {
-            ++loc_.lstLn_;
-            loc_.lstCol_ = 1;
-        }
-
-        void OnError(const Loc &loc, const String &what)
+        void OnError(const Span &span, const String &what)
         {
-            ParserError(stm_->UIFileName(), loc, what);
+            ParserError(stm_->UIFileName(), Locate(stm_, span), what);
         }
 
     protected:
@@ -794,8 +793,8 @@ namespace Fb2ToEpub
                             :   stm_            (stm),
                                 skipMode_       (false),
                                 dataMode_       (false),
+                                chunkMode_      (false),
                                 doctypeCnt_     (0),
-                                loc_            (1,1,1,1),
                                 stateCaller_    (0),
                                 attrHasValue_   (false),
                                 last_           (STOP)
@@ -815,7 +814,7 @@ namespace Fb2ToEpub
             }
 
             Token t = ScanToken();
-            t.loc_ = loc_;
+            t.span_ = span_;
             if(t.type_ == DATA || t.type_ == VALUE)
                 ScanAndConcatenateTo(&t);
 
@@ -847,11 +846,35 @@ namespace Fb2ToEpub
             return old;
         }
 
+        //-----------------------------------------------------------------------
+        //virtual
+        bool SetChunkMode(bool newMode)
+        {
+            bool old = chunkMode_;
+            chunkMode_ = newMode;
+            return old;
+        }
+
+        //-----------------------------------------------------------------------
+        //virtual
+        bool SkipRawContent()
+        {
+            return false;   // not supported, content is skipped by tokens
+        }
+
+        //-----------------------------------------------------------------------
+        //virtual
+        bool GetCheckpoint(Checkpoint *cp);
+
+        //-----------------------------------------------------------------------
+        //virtual
+        void Restore(const Checkpoint &cp);
+
         //-----------------------------------------------------------------------
         //virtual
         void Error(const String &what)
         {
-            OnError(last_.loc_, what);
+            OnError(last_.span_, what);
         }
 
         //-----------------------------------------------------------------------
@@ -860,15 +883,14 @@ namespace Fb2ToEpub
     };
 };
 
-static Fb2ToEpub::LexScanner::Token yyterminate()
-{
-    return Fb2ToEpub::LexScanner::STOP;
-}
+// default yyterminate() returns YY_NULL which is converted to CHAR token
+#define yyterminate() \
+    return Fb2ToEpub::LexScanner::Token(Fb2ToEpub::LexScanner::STOP)
+
 #define YY_USER_ACTION  {\
-                            loc_.fstLn_ = loc_.lstLn_; \
-                            loc_.fstCol_ = loc_.lstCol_; \
-                            loc_.lstCol_ += yyleng; \
-                            /*printf("line: %d state: %d act: %d len: %d \"%s\"\n", loc_.fstLn_, (YY_START), yy_act, yyleng, yytext);*/ \
+                            span_.fst_ = span_.lst_; \
+                            span_.lst_ += yyleng; \
+                            /*printf("offset: %lu state: %d act: %d len: %d \"%s\"\n", (unsigned long)span_.fst_, (YY_START), yy_act, yyleng, yytext);*/ \
                         }
 #define YY_DECL	 Fb2ToEpub::LexScanner::Token Fb2ToEpub::ScannerImpl::ScanToken()
 
@@ -884,7 +906,7 @@ static Fb2ToEpub::LexScanner::Token yyterminate()
 
 
 
-#line 888 "scanner.cpp"
+#line 910 "scanner.cpp"
 
 #define INITIAL 0
 #define X0 1
@@ -1002,12 +1024,12 @@ YY_DECL
 	register char *yy_cp, *yy_bp;
 	register int yy_act;
     
-#line 226 "scanner.l"
+#line 248 "scanner.l"
 
 
     /* XML declaration */
 
-#line 1011 "scanner.cpp"
+#line 1033 "scanner.cpp"
 
 	if ( !(yy_init) )
 		{
@@ -1088,198 +1110,198 @@ do_action:	/* This label is used only to access EOF actions. */
 
 case 1:
 YY_RULE_SETUP
-#line 230 "scanner.l"
+#line 252 "scanner.l"
 {BEGIN(X0_WS); return Token(XMLDECL);}
 	YY_BREAK
 case 2:
 YY_RULE_SETUP
-#line 231 "scanner.l"
+#line 253 "scanner.l"
 {BEGIN(X0);}
 	YY_BREAK
 case 3:
 /* rule 3 can match eol */
 YY_RULE_SETUP
-#line 232 "scanner.l"
-{NewLn(); BEGIN(X0);}
+#line 254 "scanner.l"
+{BEGIN(X0);}
 	YY_BREAK
 case 4:
 YY_RULE_SETUP
-#line 233 "scanner.l"
+#line 255 "scanner.l"
 {BEGIN(X1);}
 	YY_BREAK
 case 5:
 YY_RULE_SETUP
-#line 234 "scanner.l"
+#line 256 "scanner.l"
 {BEGIN(X2);}
 	YY_BREAK
 case 6:
 YY_RULE_SETUP
-#line 235 "scanner.l"
+#line 257 "scanner.l"
 {
                                     BEGIN(X3_WS);
                                     yytext[yyleng-1] = '\0';
-                                    return Token(VERSION, yytext+1);
+                                    return Token(VERSION, text_.Store(yytext+1));
                                 }
 	YY_BREAK
 case 7:
 YY_RULE_SETUP
-#line 240 "scanner.l"
+#line 262 "scanner.l"
 {BEGIN(X3);}
 	YY_BREAK
 case 8:
 /* rule 8 can match eol */
 YY_RULE_SETUP
-#line 241 "scanner.l"
-{NewLn(); BEGIN(X3);}
+#line 263 "scanner.l"
+{BEGIN(X3);}
 	YY_BREAK
 case 9:
 YY_RULE_SETUP
-#line 242 "scanner.l"
+#line 264 "scanner.l"
 {return ENCODING;}
 	YY_BREAK
 case 10:
 YY_RULE_SETUP
-#line 243 "scanner.l"
+#line 265 "scanner.l"
 {return EQ;}
 	YY_BREAK
 case 11:
 YY_RULE_SETUP
-#line 244 "scanner.l"
+#line 266 "scanner.l"
 {
                                     BEGIN(X4_WS);
                                     yytext[yyleng-1] = '\0';
-                                    return Token(VALUE, yytext+1);
+                                    return Token(VALUE, text_.Store(yytext+1));
                                 }
 	YY_BREAK
 case 12:
 YY_RULE_SETUP
-#line 249 "scanner.l"
+#line 271 "scanner.l"
 {BEGIN(X4);}
 	YY_BREAK
 case 13:
 /* rule 13 can match eol */
 YY_RULE_SETUP
-#line 250 "scanner.l"
-{NewLn(); BEGIN(X4);}
+#line 272 "scanner.l"
+{BEGIN(X4);}
 	YY_BREAK
 case 14:
 YY_RULE_SETUP
-#line 251 "scanner.l"
+#line 273 "scanner.l"
 {BEGIN(X4); return STANDALONE;}
 	YY_BREAK
 case 15:
 YY_RULE_SETUP
-#line 252 "scanner.l"
+#line 274 "scanner.l"
 {return EQ;}
 	YY_BREAK
 case 16:
 YY_RULE_SETUP
-#line 253 "scanner.l"
+#line 275 "scanner.l"
 {
                                     yytext[yyleng-1] = '\0';
-                                    return Token(VALUE, yytext+1);
+                                    return Token(VALUE, text_.Store(yytext+1));
                                 }
 	YY_BREAK
 case 17:
 YY_RULE_SETUP
-#line 257 "scanner.l"
+#line 279 "scanner.l"
 {BEGIN(OUTSIDE); return CLOSE;}
 	YY_BREAK
 case 18:
 YY_RULE_SETUP
-#line 258 "scanner.l"
+#line 280 "scanner.l"
 {}
 	YY_BREAK
 case 19:
 /* rule 19 can match eol */
 YY_RULE_SETUP
-#line 259 "scanner.l"
-{NewLn();}
+#line 281 "scanner.l"
+{}
 	YY_BREAK
 case 20:
 YY_RULE_SETUP
-#line 260 "scanner.l"
-{OnError(loc_, "xml declaration: unexpected character"); yyterminate();}
+#line 282 "scanner.l"
+{OnError(span_, "xml declaration: unexpected character"); yyterminate();}
 	YY_BREAK
 /* Skip comment */
 case 21:
 YY_RULE_SETUP
-#line 265 "scanner.l"
+#line 287 "scanner.l"
 {stateCaller_ = D1; BEGIN(COMMENT);}
 	YY_BREAK
 case 22:
 YY_RULE_SETUP
-#line 266 "scanner.l"
+#line 288 "scanner.l"
 {stateCaller_ = OUTSIDE; BEGIN(COMMENT);}
 	YY_BREAK
 case 23:
 YY_RULE_SETUP
-#line 267 "scanner.l"
+#line 289 "scanner.l"
 {/* eat */}
 	YY_BREAK
 case 24:
 /* rule 24 can match eol */
 YY_RULE_SETUP
-#line 268 "scanner.l"
-{NewLn();}
+#line 290 "scanner.l"
+{}
 	YY_BREAK
 case 25:
 YY_RULE_SETUP
-#line 269 "scanner.l"
+#line 291 "scanner.l"
 {BEGIN(stateCaller_);}
 	YY_BREAK
 /* Skip CDATA block */
 case 26:
 YY_RULE_SETUP
-#line 274 "scanner.l"
+#line 296 "scanner.l"
 {stateCaller_ = D1; BEGIN(CDB);}
 	YY_BREAK
 case 27:
 YY_RULE_SETUP
-#line 275 "scanner.l"
+#line 297 "scanner.l"
 {stateCaller_ = OUTSIDE; BEGIN(CDB);}
 	YY_BREAK
 case 28:
 YY_RULE_SETUP
-#line 276 "scanner.l"
+#line 298 "scanner.l"
 {/* eat */}
 	YY_BREAK
 case 29:
 /* rule 29 can match eol */
 YY_RULE_SETUP
-#line 277 "scanner.l"
-{NewLn();}
+#line 299 "scanner.l"
+{}
 	YY_BREAK
 case 30:
 YY_RULE_SETUP
-#line 278 "scanner.l"
+#line 300 "scanner.l"
 {BEGIN(stateCaller_);}
 	YY_BREAK
 /* Skip DOCTYPE */
 case 31:
 YY_RULE_SETUP
-#line 283 "scanner.l"
+#line 305 "scanner.l"
 {doctypeCnt_ = 1; BEGIN(DOCTYPE);}
 	YY_BREAK
 case 32:
 YY_RULE_SETUP
-#line 284 "scanner.l"
+#line 306 "scanner.l"
 {++doctypeCnt_;}
 	YY_BREAK
 case 33:
 YY_RULE_SETUP
-#line 285 "scanner.l"
+#line 307 "scanner.l"
 {/* eat */}
 	YY_BREAK
 case 34:
 /* rule 34 can match eol */
 YY_RULE_SETUP
-#line 286 "scanner.l"
-{NewLn();}
+#line 308 "scanner.l"
+{}
 	YY_BREAK
 case 35:
 YY_RULE_SETUP
-#line 287 "scanner.l"
+#line 309 "scanner.l"
 {
                                     if(--doctypeCnt_ <= 0)
                                         BEGIN(OUTSIDE);
@@ -1288,80 +1310,79 @@ YY_RULE_SETUP
 /* Skip reserved xml element */
 case 36:
 YY_RULE_SETUP
-#line 295 "scanner.l"
+#line 317 "scanner.l"
 {stateCaller_ = D1; BEGIN(RESERVED);}
 	YY_BREAK
 case 37:
 YY_RULE_SETUP
-#line 296 "scanner.l"
+#line 318 "scanner.l"
 {stateCaller_ = OUTSIDE; BEGIN(RESERVED);}
 	YY_BREAK
 case 38:
 YY_RULE_SETUP
-#line 297 "scanner.l"
+#line 319 "scanner.l"
 {/* eat */}
 	YY_BREAK
 case 39:
 /* rule 39 can match eol */
 YY_RULE_SETUP
-#line 298 "scanner.l"
-{NewLn();}
+#line 320 "scanner.l"
+{}
 	YY_BREAK
 case 40:
 YY_RULE_SETUP
-#line 299 "scanner.l"
+#line 321 "scanner.l"
 {BEGIN(stateCaller_);}
 	YY_BREAK
 /* Content */
 case 41:
 YY_RULE_SETUP
-#line 304 "scanner.l"
+#line 326 "scanner.l"
 {}
 	YY_BREAK
 case 42:
 /* rule 42 can match eol */
 YY_RULE_SETUP
-#line 305 "scanner.l"
-{NewLn();}
+#line 327 "scanner.l"
+{}
 	YY_BREAK
 case 43:
 YY_RULE_SETUP
-#line 306 "scanner.l"
+#line 328 "scanner.l"
 {
                                     BEGIN(D1);
                                     if(dataMode_)
                                         return  skipMode_ ?
                                                 Token(DATA, yyleng) :
-                                                Token(DATA, yytext, yyleng);
+                                                Token(DATA, text_.Store(yytext), yyleng);
                                 }
 	YY_BREAK
 case 44:
 /* rule 44 can match eol */
 YY_RULE_SETUP
-#line 313 "scanner.l"
+#line 335 "scanner.l"
 {
-                                    NewLn();
                                     BEGIN(D1);
                                     if(dataMode_)
                                         return  skipMode_ ?
                                                 Token(DATA, 1) :
-                                                Token(DATA, "\n", 1);
+                                                Token(DATA, TextView("\n"), 1);
                                 }
 	YY_BREAK
 case 45:
 YY_RULE_SETUP
-#line 321 "scanner.l"
+#line 342 "scanner.l"
 {
                                     BEGIN(yyleng >= 2 ? D2 : D1);   // if number of "]" >= 2, disable ">"
                                     if(dataMode_)
                                         return  skipMode_ ?
                                                 Token(DATA, yyleng) :
-                                                Token(DATA, yytext, yyleng);
+                                                Token(DATA, text_.Store(yytext), yyleng);
                                 }
 	YY_BREAK
 case 46:
 YY_RULE_SETUP
-#line 328 "scanner.l"
+#line 349 "scanner.l"
 {
                                     if(dataMode_)
                                         return gt;
@@ -1369,7 +1390,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 47:
 YY_RULE_SETUP
-#line 332 "scanner.l"
+#line 353 "scanner.l"
 {
                                     BEGIN(D1);
                                     if(dataMode_)
@@ -1378,7 +1399,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 48:
 YY_RULE_SETUP
-#line 337 "scanner.l"
+#line 358 "scanner.l"
 {
                                     BEGIN(D1);
                                     if(dataMode_)
@@ -1387,42 +1408,42 @@ YY_RULE_SETUP
 	YY_BREAK
 case 49:
 YY_RULE_SETUP
-#line 342 "scanner.l"
+#line 363 "scanner.l"
 {
                                     char *tagName = &yytext[1];
                                     tagStack_.push_back(tagName);
                                     BEGIN(MARKUP);
-                                    return Token(START, tagName);
+                                    return Token(START, text_.Store(tagName), LookupElement(tagName, yyleng - 1));
                                 }
 	YY_BREAK
 case 50:
 YY_RULE_SETUP
-#line 348 "scanner.l"
+#line 369 "scanner.l"
 {
                                     char *tagName = &yytext[2];
                                     if(!tagStack_.size())
-                                        OnError(loc_, "tag stack is empty #0");
+                                        OnError(span_, "tag stack is empty #0");
                                     if(tagStack_.back().compare(tagName))
-                                        OnError(loc_, "tag mismatch");
+                                        OnError(span_, "tag mismatch");
                                     tagStack_.pop_back();
                                     BEGIN(MARKUP);
-                                    return Token(END, tagName);
+                                    return Token(END, text_.Store(tagName), LookupElement(tagName, yyleng - 2));
                                 }
 	YY_BREAK
 case 51:
 YY_RULE_SETUP
-#line 358 "scanner.l"
-{OnError(loc_, "not implemented"); yyterminate();}
+#line 379 "scanner.l"
+{OnError(span_, "not implemented"); yyterminate();}
 	YY_BREAK
 /* Garbage */
 case 52:
 YY_RULE_SETUP
-#line 363 "scanner.l"
+#line 384 "scanner.l"
 {/* ignore outside garbage */}
 	YY_BREAK
 case 53:
 YY_RULE_SETUP
-#line 364 "scanner.l"
+#line 385 "scanner.l"
 {
                                     // error character - try to process
                                     BEGIN(D1);
@@ -1441,72 +1462,73 @@ YY_RULE_SETUP
 /* Markup */
 case 54:
 YY_RULE_SETUP
-#line 382 "scanner.l"
+#line 403 "scanner.l"
 {}
 	YY_BREAK
 case 55:
 /* rule 55 can match eol */
 YY_RULE_SETUP
-#line 383 "scanner.l"
-{NewLn();}
+#line 404 "scanner.l"
+{}
 	YY_BREAK
 case 56:
 YY_RULE_SETUP
-#line 384 "scanner.l"
+#line 405 "scanner.l"
 {return EQ;}
 	YY_BREAK
 case 57:
 YY_RULE_SETUP
-#line 385 "scanner.l"
-{attrHasValue_ = false; return Token(NAME, yytext);}
+#line 406 "scanner.l"
+{attrHasValue_ = false; return Token(NAME, text_.Store(yytext));}
 	YY_BREAK
 case 58:
 YY_RULE_SETUP
-#line 386 "scanner.l"
+#line 407 "scanner.l"
 {BEGIN(MARKUP1);}
 	YY_BREAK
 case 59:
 YY_RULE_SETUP
-#line 387 "scanner.l"
+#line 408 "scanner.l"
 {BEGIN(MARKUP2);}
 	YY_BREAK
 case 60:
 YY_RULE_SETUP
-#line 388 "scanner.l"
+#line 409 "scanner.l"
 {
                                     attrHasValue_ = true;
                                     if(skipMode_)
                                         return Token(VALUE);
-                                    std::vector<char> buf;
-                                    Decode(yytext, &buf, true, true);
-                                    return Token(VALUE, &buf[0]);
+                                    vbuf_.clear();
+                                    Decode(yytext, yyleng, &vbuf_, true, true);
+                                    vbuf_.push_back('\0');
+                                    return Token(VALUE, text_.Store(&vbuf_[0]));
                                 }
 	YY_BREAK
 case 61:
 YY_RULE_SETUP
-#line 396 "scanner.l"
+#line 418 "scanner.l"
 {
                                     attrHasValue_ = true;
                                     if(skipMode_)
                                         return Token(VALUE);
-                                    std::vector<char> buf;
-                                    Decode(yytext, &buf, true, true);
-                                    return Token(VALUE, &buf[0]);
+                                    vbuf_.clear();
+                                    Decode(yytext, yyleng, &vbuf_, true, true);
+                                    vbuf_.push_back('\0');
+                                    return Token(VALUE, text_.Store(&vbuf_[0]));
                                 }
 	YY_BREAK
 case 62:
 /* rule 62 can match eol */
 YY_RULE_SETUP
-#line 404 "scanner.l"
+#line 427 "scanner.l"
 {
                                     attrHasValue_ = true;
-                                    NewLn();
-                                    return skipMode_ ? Token(VALUE) : Token(VALUE, "\n");
+                                    return skipMode_ ? Token(VALUE) : Token(VALUE, TextView("\n"));
                                 }
 	YY_BREAK
 case 63:
 YY_RULE_SETUP
-#line 409 "scanner.l"
+#line 431 "scanner.l"
 {
                                     BEGIN(MARKUP);
                                     if(!attrHasValue_)
@@ -1516,7 +1538,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 64:
 YY_RULE_SETUP
-#line 415 "scanner.l"
+#line 437 "scanner.l"
 {
                                     BEGIN(MARKUP);
                                     if(!attrHasValue_)
@@ -1526,10 +1548,10 @@ YY_RULE_SETUP
 	YY_BREAK
 case 65:
 YY_RULE_SETUP
-#line 421 "scanner.l"
+#line 443 "scanner.l"
 {
                                     if(!tagStack_.size())
-                                        OnError(loc_, "tag stack is empty #1");
+                                        OnError(span_, "tag stack is empty #1");
                                     tagStack_.pop_back();
                                     BEGIN(tagStack_.size() ? D1 : OUTSIDE);
                                     return SLASHCLOSE;
@@ -1537,7 +1559,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 66:
 YY_RULE_SETUP
-#line 428 "scanner.l"
+#line 450 "scanner.l"
 {
                                     BEGIN(tagStack_.size() ? D1 : OUTSIDE);
                                     return CLOSE;
@@ -1547,15 +1569,15 @@ YY_RULE_SETUP
 case 67:
 /* rule 67 can match eol */
 YY_RULE_SETUP
-#line 436 "scanner.l"
-{OnError(loc_, "default: unrecognized char"); yyterminate();}
+#line 458 "scanner.l"
+{OnError(span_, "default: unrecognized char"); yyterminate();}
 	YY_BREAK
 case 68:
 YY_RULE_SETUP
-#line 438 "scanner.l"
+#line 460 "scanner.l"
 YY_FATAL_ERROR( "flex scanner jammed" );
 	YY_BREAK
-#line 1559 "scanner.cpp"
+#line 1581 "scanner.cpp"
 case YY_STATE_EOF(INITIAL):
 case YY_STATE_EOF(X0):
 case YY_STATE_EOF(X1):
@@ -2472,7 +2494,7 @@ void yyfree (void * ptr )
 
 #define YYTABLES_NAME "yytables"
 
-#line 438 "scanner.l"
+#line 460 "scanner.l"
 
 
 
@@ -2483,8 +2505,43 @@ namespace Fb2ToEpub
         return stm_->Read(buf, max_size);
     }
 
+    bool ScannerImpl::GetCheckpoint(Checkpoint *cp)
+    {
+        // nothing should be scanned after the tag
+        if(tokenStack_.size() || (last_.type_ != CLOSE && last_.type_ != SLASHCLOSE) || last_.span_.lst_ != span_.lst_)
+            return false;
+
+        cp->offset_     = span_.lst_;
+        cp->tags_       = tagStack_;
+        cp->skipMode_   = skipMode_;
+        cp->dataMode_   = dataMode_;
+        cp->chunkMode_  = chunkMode_;
+        return true;
+    }
+
+    void ScannerImpl::Restore(const Checkpoint &cp)
+    {
+        // drop read-ahead of flex buffer, it's refilled by LexerInput
+        Seek(stm_, cp.offset_);
+        yy_flush_buffer(YY_CURRENT_BUFFER);
+
+        tagStack_       = cp.tags_;
+        skipMode_       = cp.skipMode_;
+        dataMode_       = cp.dataMode_;
+        chunkMode_      = cp.chunkMode_;
+        tokenStack_.clear();
+        doctypeCnt_     = 0;
+        stateCaller_    = tagStack_.size() ? D1 : OUTSIDE;
+        attrHasValue_   = false;
+        BEGIN(stateCaller_);
+
+        span_.fst_ = span_.lst_ = cp.offset_;
+        last_ = CLOSE;
+        last_.span_ = span_;
+    }
+
 
-    Ptr<LexScanner> CreateScanner(InStm *stm)
+    Ptr<LexScanner> CreateFlexScanner(InStm *stm)
     {
         return new ScannerImpl(stm);
     }
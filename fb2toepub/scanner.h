@@ -26,11 +26,236 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <ostream>
+#include <string.h>
 
 namespace Fb2ToEpub
 {
     //-----------------------------------------------------------------------
-    typedef std::map<String, String> AttrMap;
+    // FictionBook elements
+    //-----------------------------------------------------------------------
+    enum ElementType
+    {
+        E_NONE,             // not a FictionBook element
+        E_FICTIONBOOK,
+        E_A,
+        E_ANNOTATION,
+        E_AUTHOR,
+        E_BINARY,
+        E_BODY,
+        E_BOOK_NAME,
+        E_BOOK_TITLE,
+        E_CITE,
+        E_CITY,
+        E_CODE,
+        E_COVERPAGE,
+        E_CUSTOM_INFO,
+        E_DATE,
+        E_DESCRIPTION,
+        E_DOCUMENT_INFO,
+        E_EMAIL,
+        E_EMPHASIS,
+        E_EMPTY_LINE,
+        E_EPIGRAPH,
+        E_FIRST_NAME,
+        E_GENRE,
+        E_HISTORY,
+        E_HOME_PAGE,
+        E_ID,
+        E_ISBN,
+        E_IMAGE,
+        E_KEYWORDS,
+        E_LANG,
+        E_LAST_NAME,
+        E_MIDDLE_NAME,
+        E_NICKNAME,
+        E_OUTPUT_DOCUMENT_CLASS,
+        E_OUTPUT,
+        E_P,
+        E_PART,
+        E_POEM,
+        E_PROGRAM_USED,
+        E_PUBLISH_INFO,
+        E_PUBLISHER,
+        E_SECTION,
+        E_SEQUENCE,
+        E_SRC_LANG,
+        E_SRC_OCR,
+        E_SRC_TITLE_INFO,
+        E_SRC_URL,
+        E_STANZA,
+        E_STRIKETHROUGH,
+        E_STRONG,
+        E_STYLE,
+        E_STYLESHEET,
+        E_SUB,
+        E_SUBTITLE,
+        E_SUP,
+        E_TABLE,
+        E_TD,
+        E_TEXT_AUTHOR,
+        E_TH,
+        E_TITLE,
+        E_TITLE_INFO,
+        E_TR,
+        E_TRANSLATOR,
+        E_V,
+        E_VERSION,
+        E_YEAR,
+
+        // transliteration table
+        E_MAP,
+        E_TRANSTABLE
+    };
+
+    ElementType FB2TOEPUB_DECL LookupElement(const char *name, std::size_t len);   // E_NONE if unknown
+    const char* FB2TOEPUB_DECL ElementName(ElementType element);
+
+    //-----------------------------------------------------------------------
+    // View of token text.
+    // The text is either static or stored in a scanner-owned block, which is
+    // kept alive while any view refers to it. It's always zero-terminated.
+    // Use str() to get a copy of the text.
+    //-----------------------------------------------------------------------
+    class TextView
+    {
+        friend class TextStore;
+
+        Ptr<Object>     owner_;
+        const char      *s_;
+        std::size_t     len_;
+
+    public:
+        TextView()                                      : s_(""), len_(0) {}
+        // doesn't copy the text, it should outlive the view
+        explicit TextView(const char *s)                : s_(s), len_(strlen(s)) {}
+        explicit TextView(const String &s)              : s_(s.c_str()), len_(s.size()) {}
+
+        const char*     c_str() const                   {return s_;}
+        const char*     data() const                    {return s_;}
+        std::size_t     size() const                    {return len_;}
+        bool            empty() const                   {return !len_;}
+        String          str() const                     {return String(s_, len_);}
+
+        int compare(const char *s, std::size_t len) const
+        {
+            int ret = memcmp(s_, s, len_ < len ? len_ : len);
+            return ret ? ret : len_ < len ? -1 : len_ > len ? 1 : 0;
+        }
+        int compare(const char *s) const                {return compare(s, strlen(s));}
+        int compare(const String &s) const              {return compare(s.data(), s.size());}
+        int compare(const TextView &s) const            {return compare(s.s_, s.len_);}
+    };
+
+    inline bool operator==(const TextView &v, const char *s)        {return !v.compare(s);}
+    inline bool operator!=(const TextView &v, const char *s)        {return v.compare(s) != 0;}
+    inline bool operator==(const TextView &v, const String &s)      {return !v.compare(s);}
+    inline bool operator!=(const TextView &v, const String &s)      {return v.compare(s) != 0;}
+    inline std::ostream& operator<<(std::ostream &os, const TextView &v)
+    {
+        return os.write(v.data(), v.size());
+    }
+
+    //-----------------------------------------------------------------------
+    // Scanner-owned storage of token texts.
+    // Blocks are reused as soon as no token refers to them.
+    //-----------------------------------------------------------------------
+    class TextStore : Noncopyable
+    {
+    public:
+        class Block;
+
+        TextStore();
+        ~TextStore();
+
+        TextView    Store(const char *s, std::size_t len);
+        TextView    Store(const char *s)                        {return Store(s, strlen(s));}
+        TextView    Store(const String &s)                      {return Store(s.data(), s.size());}
+        void        Append(TextView *v, const TextView &v1);    // v += v1, v1 may become invalid
+
+        void        Release(Block *b);
+
+    private:
+        char*       Alloc(std::size_t len, TextView *v);
+
+        Ptr<Block>              cur_;
+        std::vector<Block*>     blocks_;
+        std::vector<Block*>     free_;
+    };
+
+    //-----------------------------------------------------------------------
+    // Attributes used by the converter (by local name, i.e. without namespace prefix)
+    //-----------------------------------------------------------------------
+    enum AttrType
+    {
+        A_NONE,             // not used by the converter
+        A_ALIGN,
+        A_ALT,
+        A_COLSPAN,
+        A_CONTENT_TYPE,
+        A_HREF,
+        A_ID,
+        A_IN,
+        A_LANG,
+        A_NAME,
+        A_NUMBER,
+        A_OUT,
+        A_ROWSPAN,
+        A_STYLE,
+        A_TITLE,
+        A_VALIGN,
+        A_VALUE
+    };
+
+    AttrType FB2TOEPUB_DECL LookupAttr(const char *name, std::size_t len);   // A_NONE if unknown
+    const char* FB2TOEPUB_DECL AttrName(AttrType attr);
+
+    //-----------------------------------------------------------------------
+    // Flat list of element attributes.
+    // Names and values are views of scanner text, first attributes are stored
+    // in place, so usually parsing attributes allocates nothing.
+    //-----------------------------------------------------------------------
+    class AttrMap : Noncopyable
+    {
+    public:
+        struct Attr
+        {
+            AttrType    id_;        // id of local name
+            std::size_t local_;     // offset of local name, 0 if there is no prefix
+            TextView    name_;
+            TextView    value_;
+
+            Attr() : id_(A_NONE), local_(0) {}
+        };
+
+        AttrMap() : size_(0) {}
+
+        std::size_t size() const                                {return size_;}
+        const Attr& operator[](std::size_t i) const             {return i < FIXED_SIZE ? fixed_[i] : more_[i - FIXED_SIZE];}
+
+        // find attribute by local name and prefix ("" - no prefix), NULL if not found
+        const Attr*     FindAttr(AttrType id, const char *prefix = "") const;
+        const TextView* Find(AttrType id, const char *prefix = "") const
+        {
+            const Attr *a = FindAttr(id, prefix);
+            return a ? &a->value_ : NULL;
+        }
+        String Get(AttrType id, const char *prefix = "") const  // "" if not found
+        {
+            const Attr *a = FindAttr(id, prefix);
+            return a ? a->value_.str() : String();
+        }
+
+        bool Defined(const TextView &name) const;
+        void Add(const TextView &name, const TextView &value);
+
+    private:
+        enum {FIXED_SIZE = 8};
+
+        Attr                fixed_[FIXED_SIZE];
+        std::vector<Attr>   more_;
+        std::size_t         size_;
+    };
 
     //-----------------------------------------------------------------------
     class LexScanner : public Object
@@ -62,18 +287,29 @@ namespace Fb2ToEpub
 
         typedef ParserException::Loc Loc;
 
+        // Position of token in the input stream.
+        // Line and column numbers are computed from it only on error (see Locate).
+        struct Span
+        {
+            std::size_t fst_;   // offset of the first character
+            std::size_t lst_;   // offset after the last character
+
+            Span() : fst_(0), lst_(0) {}
+        };
+
         struct Token
         {
             TokenType   type_;
             char        c_;
-            String      s_;
+            TextView    s_;
+            ElementType elem_;  // element of START and END
             std::size_t size_;  // approximate size of DATA section (valid in skip mode)
-            Loc         loc_;
+            Span        span_;
 
-            Token(TokenType type, std::size_t size = 0)                         : type_(type), size_(size) {}
-            Token(char c)                                                       : type_(CHAR), c_(c) {}
-            Token(TokenType type, const char *s, std::size_t size = 0)          : type_(type), s_(s), size_(size) {}
-            Token(TokenType type, const String &s, std::size_t size = 0)        : type_(type), s_(s), size_(size) {}
+            Token(TokenType type, std::size_t size = 0)                         : type_(type), c_(0), elem_(E_NONE), size_(size) {}
+            Token(char c)                                                       : type_(CHAR), c_(c), elem_(E_NONE), size_(0) {}
+            Token(TokenType type, const TextView &s, std::size_t size = 0)      : type_(type), c_(0), s_(s), elem_(E_NONE), size_(size) {}
+            Token(TokenType type, const TextView &s, ElementType elem)          : type_(type), c_(0), s_(s), elem_(elem), size_(0) {}
 
             static int compare(const Token &t1, const Token &t2)
             {
@@ -93,11 +329,29 @@ namespace Fb2ToEpub
             }
         };
 
+        // Scanner state at element boundary, i.e. right after '>' of a tag.
+        // Scanning can be resumed from it by Restore without tokenizing the text before,
+        // but the stream is rewound and read up to the offset through all decoders.
+        struct Checkpoint
+        {
+            std::size_t offset_;    // offset in the input stream
+            strvector   tags_;      // names of open elements
+            bool        skipMode_;
+            bool        dataMode_;
+            bool        chunkMode_;
+
+            Checkpoint() : offset_(0), skipMode_(false), dataMode_(false), chunkMode_(false) {}
+        };
+
         virtual ~LexScanner() {}
         virtual const Token& GetToken() = 0;
         virtual void UngetToken(const Token &t) = 0;
         virtual bool SetSkipMode(bool newMode) = 0;
         virtual bool SetDataMode(bool newMode) = 0;
+        virtual bool SetChunkMode(bool newMode) = 0;    // return DATA by pieces of about FB2TOEPUB_DATA_CHUNK_SIZE
+        virtual bool SkipRawContent() = 0;              // skip rest of element content up to etag without tokenizing, false if not supported
+        virtual bool GetCheckpoint(Checkpoint *cp) = 0; // false if not at element boundary or there are tokens to unget
+        virtual void Restore(const Checkpoint &cp) = 0; // rewinds the stream and continues scanning from checkpoint
         virtual void Error(const String &what) = 0;
 
         // helpers
@@ -112,20 +366,26 @@ namespace Fb2ToEpub
         void SkipAttributes                         ();
         void SkipRestOfElementContent               ();
         void SkipElement                            ();
-        void CheckAndSkipElement                    (const String &element);
-        void SkipIfElement                          (const String &element);
-        void SkipAll                                (const String &element);
+        void CheckAndSkipElement                    (ElementType element);
+        void SkipIfElement                          (ElementType element);
+        void SkipAll                                (ElementType element);
         void SkipXMLDeclaration                     ();
-        bool IsNextElement                          (const String &element);
+        bool IsNextElement                          (ElementType element);
         void ParseAttributes                        (AttrMap *attrmap);
-        bool BeginElement                           (const String &element, AttrMap *attrmap = NULL);  // returns true if nonempty, false otherwise
-        void BeginNotEmptyElement                   (const String &element, AttrMap *attrmap = NULL);
-        String SimpleTextElement                    (const String &element, AttrMap *attrmap = NULL);
+        bool BeginElement                           (ElementType element, AttrMap *attrmap = NULL);  // returns true if nonempty, false otherwise
+        void BeginNotEmptyElement                   (ElementType element, AttrMap *attrmap = NULL);
+        String SimpleTextElement                    (ElementType element, AttrMap *attrmap = NULL);
         void EndElement                             ();
 
-        // text processing helpers
-        static void Decode                          (const char *s, std::vector<char> *buf, bool decodeEntities, bool removeLF);    // always removes CR
-        static void Encode                          (const char *s, std::vector<char> *buf);
+        // text processing helpers, result is appended to buf (without terminating '\0')
+        static void Decode                          (const char *s, std::size_t len, std::vector<char> *buf, bool decodeEntities, bool removeLF);    // always removes CR
+        static void Encode                          (const char *s, std::size_t len, std::vector<char> *buf);
+
+    protected:
+        // rewinds the stream and counts lines up to the end of span
+        static Loc Locate                           (InStm *stm, const Span &span);
+        // rewinds the stream and skips offset bytes
+        static void Seek                            (InStm *stm, std::size_t offset);
     };
 
     inline bool operator==(const LexScanner::Token &t1, const LexScanner::Token &t2)   {return !LexScanner::Token::compare(t1, t2);}
@@ -144,8 +404,50 @@ namespace Fb2ToEpub
     struct ClrScannerDataMode : ChangeScannerDataMode {ClrScannerDataMode(LexScanner *s) : ChangeScannerDataMode(s, false) {}};
 
     //-----------------------------------------------------------------------
+    class SetScannerChunkMode
+    {
+        Ptr<LexScanner> s_;
+        bool old_;
+    public:
+        SetScannerChunkMode(LexScanner *s)  : s_(s), old_(s->SetChunkMode(true)) {}
+        ~SetScannerChunkMode()              {s_->SetChunkMode(old_);}
+    };
+
+    //-----------------------------------------------------------------------
+    // Thrown by push scanner if the input pushed so far ends before the token
+    struct NeedInput {};
+
+    //-----------------------------------------------------------------------
+    // Scanner fed by the caller in chunks (push mode).
+    // If GetToken throws NeedInput, the caller returns the scanner to the state
+    // saved by Mark, pushes more input and scans again from there.
+    // Input before the mark is dropped, so Restore isn't supported.
+    //-----------------------------------------------------------------------
+    class PushScanner : public LexScanner
+    {
+    public:
+        virtual void        Push(const void *p, std::size_t cnt) = 0;
+        virtual void        Finish() = 0;               // end of input, NeedInput isn't thrown after it
+        virtual bool        IsFinished() const = 0;
+        virtual void        Mark() = 0;                 // save scanner state
+        virtual void        Reset() = 0;                // return to the state saved by Mark
+        virtual std::size_t Available() const = 0;      // size of input pushed after the mark
+    };
+
+    //-----------------------------------------------------------------------
+    // Scanner selected by FB2TOEPUB_FAST_SCANNER
     Ptr<LexScanner> FB2TOEPUB_DECL CreateScanner(InStm *stm);
 
+    // Table-driven flex scanner (scanner.l)
+    Ptr<LexScanner> FB2TOEPUB_DECL CreateFlexScanner(InStm *stm);
+
+    // Hand-written scanner producing the same tokens (scannerfast.cpp)
+    Ptr<LexScanner> FB2TOEPUB_DECL CreateFastScanner(InStm *stm);
+
+    // Fast scanner in push mode, stm is the input as far as it's pushed,
+    // it's read only to locate errors
+    Ptr<PushScanner> FB2TOEPUB_DECL CreatePushScanner(InStm *stm);
+
 };  //namespace Fb2ToEpub
 
 #endif
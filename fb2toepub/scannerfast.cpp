@@ -0,0 +1,1164 @@
+//
+//  Copyright (C) 2010 Alexey Bobkov
+//
+//  This file is part of Fb2toepub converter.
+//
+//  Fb2toepub converter is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Fb2toepub converter is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Fb2toepub converter.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "hdr.h"
+
+#include "scanner.h"
+#include "charset.h"
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+
+namespace Fb2ToEpub
+{
+
+//-----------------------------------------------------------------------
+// FAST SCANNER
+// Hand-written equivalent of the flex scanner from scanner.l.
+// Every state has the name of the corresponding flex start condition
+// and selects the longest match exactly as flex does, so both scanners
+// produce the same tokens, locations and errors.
+// In push mode input is appended to the buffer by Push, and running out
+// of it throws NeedInput, so the buffer is never moved while scanning.
+//-----------------------------------------------------------------------
+const std::size_t SCANNER_BUFFER_SIZE = 0x10000;
+
+static const TextView           newline ("\n");
+static const LexScanner::Token  lt      (LexScanner::DATA, TextView("&lt;"), 4),
+                                gt      (LexScanner::DATA, TextView("&gt;"), 4),
+                                amp     (LexScanner::DATA, TextView("&amp;"), 5),
+                                apos    (LexScanner::DATA, TextView("&apos;"), 6),
+                                quot    (LexScanner::DATA, TextView("&quot;"), 6);
+
+static const CharSet    dataSet     ("<&>\"']\r\n\0", 9),
+                        value1Set   ("<&\"\r\n\0", 6),
+                        value2Set   ("<&'\r\n\0", 6),
+                        commentSet  ("-\r\n", 3),
+                        cdataSet    ("]\r\n", 3),
+                        reservedSet ("?\r\n", 3),
+                        doctypeSet  ("<>\r\n", 4),
+                        rawDataSet  ("<", 1),
+                        rawTagSet   ("\"'/>", 4),
+                        rawEtagSet  (">", 1),
+                        rawValue1Set("\"", 1),
+                        rawValue2Set("'", 1),
+                        rawDashSet  ("-", 1),
+                        rawCdataSet ("]", 1),
+                        rawQmarkSet ("?", 1);
+
+//-----------------------------------------------------------------------
+static inline bool IsLetter(int c)      {return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');}
+static inline bool IsDigit(int c)       {return c >= '0' && c <= '9';}
+static inline bool IsHexDigit(int c)    {return IsDigit(c) || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');}
+static inline bool IsNameStart(int c)   {return IsLetter(c) || c == '_' || c == ':';}
+static inline bool IsNameChar(int c)    {return IsNameStart(c) || IsDigit(c) || c == '.' || c == '-';}
+static inline bool IsEncChar(int c)     {return IsLetter(c) || IsDigit(c) || c == '.' || c == '_' || c == '-';}
+
+
+//-----------------------------------------------------------------------
+class FastScanner : public PushScanner, Noncopyable
+{
+    enum State
+    {
+        INITIAL,
+        X0, X1, X2, X3, X4, X0_WS, X3_WS, X4_WS,
+        OUTSIDE, MARKUP, MARKUP1, MARKUP2, D1, DOCTYPE,
+        COMMENT, CDB, RESERVED
+    };
+
+    // scanner state saved by Mark (buffer position is in mark_)
+    struct Saved
+    {
+        strvector           tagStack_;
+        std::vector<Token>  tokenStack_;
+        bool                skipMode_, dataMode_, chunkMode_;
+        int                 doctypeCnt_;
+        Span                span_;
+        State               state_, stateCaller_;
+        bool                attrHasValue_, split_, cut_;
+        Token               last_;
+
+        Saved() : last_(STOP) {}
+    };
+
+    Ptr<InStm>	                stm_;
+    std::vector<char>           buf_;
+    std::size_t                 pos_;           // position of the current match in buf_
+    std::size_t                 end_;           // end of data in buf_
+    bool                        eof_;
+    strvector                   tagStack_;
+    std::vector<Token>          tokenStack_;
+    bool                        skipMode_;
+    bool                        dataMode_;
+    bool                        chunkMode_;
+    int                         doctypeCnt_;
+    Span                        span_;          // current match
+    State                       state_;
+    State                       stateCaller_;
+    bool                        attrHasValue_;
+    bool                        split_;         // last DATA or VALUE match was split at the end of buffer
+    bool                        cut_;           // text of split match was cut by '\0'
+    std::vector<char>           vbuf_;
+    TextStore                   text_;
+    Token                       last_;
+    bool                        push_;          // input is pushed by the caller
+    std::size_t                 mark_;          // position in buf_ of state saved by Mark (push mode)
+    Saved                       saved_;
+
+    Token ScanToken();
+
+    void ScanAndConcatenateTo(Token *t)
+    {
+        for(;;)     // concatenate all DATA together
+        {
+            if(chunkMode_ && t->type_ == DATA && t->s_.size() >= FB2TOEPUB_DATA_CHUNK_SIZE)
+                return;     // chunk is full, the rest is returned by next GetToken
+
+            Token t1 = ScanToken();
+            t1.span_ = span_;
+
+            if(t1.type_ != t->type_)
+            {
+                UngetToken(t1);
+                return;
+            }
+
+            text_.Append(&t->s_, t1.s_);
+            t->size_        += t1.size_;
+            t->span_.lst_   = t1.span_.lst_;
+        }
+    }
+
+    // make at least cnt characters available from the current position
+    bool Fill(std::size_t cnt)
+    {
+        while(end_ - pos_ < cnt)
+        {
+            if(eof_)
+                return false;
+            if(push_)
+                throw NeedInput();
+            if(pos_)
+            {
+                ::memmove(&buf_[0], &buf_[pos_], end_ - pos_);
+                end_ -= pos_;
+                pos_ = 0;
+            }
+            if(end_ == buf_.size())
+                buf_.resize(buf_.size() * 2);
+            std::size_t got = stm_->IsEOF() ? 0 : stm_->Read(&buf_[end_], buf_.size() - end_);
+            if(!got)
+                eof_ = true;
+            end_ += got;
+        }
+        return true;
+    }
+
+    // character at offset i from the current position, -1 at the end of input
+    int Ch(std::size_t i)
+    {
+        if(pos_ + i >= end_ && !Fill(i + 1))
+            return -1;
+        return static_cast<unsigned char>(buf_[pos_ + i]);
+    }
+
+    const char* At(std::size_t i) const     {return &buf_[0] + pos_ + i;}
+    const char* End() const                 {return &buf_[0] + end_;}
+
+    bool Lit(const char *s)
+    {
+        for(std::size_t i = 0; s[i]; ++i)
+            if(Ch(i) != static_cast<unsigned char>(s[i]))
+                return false;
+        return true;
+    }
+
+    std::size_t Ws()
+    {
+        std::size_t n = 0;
+        for(int c = Ch(0); c == ' ' || c == '\t'; c = Ch(++n))
+            ;
+        return n;
+    }
+
+    std::size_t Nl(std::size_t i)
+    {
+        switch(Ch(i))
+        {
+        case '\n':  return 1;
+        case '\r':  return Ch(i + 1) == '\n' ? 2 : 1;
+        default:    return 0;
+        }
+    }
+
+    std::size_t Name(std::size_t i)
+    {
+        if(!IsNameStart(Ch(i)))
+            return 0;
+        std::size_t n = 1;
+        while(IsNameChar(Ch(i + n)))
+            ++n;
+        return n;
+    }
+
+    std::size_t Reference(std::size_t i)
+    {
+        std::size_t n = 1;
+        if(Ch(i + n) == '#')
+        {
+            bool hex = Ch(i + ++n) == 'x';
+            if(hex)
+                ++n;
+            std::size_t start = n;
+            while(hex ? IsHexDigit(Ch(i + n)) : IsDigit(Ch(i + n)))
+                ++n;
+            if(n == start)
+                return 0;
+        }
+        else
+        {
+            std::size_t len = Name(i + n);
+            if(!len)
+                return 0;
+            n += len;
+        }
+        return Ch(i + n) == ';' ? n + 1 : 0;
+    }
+
+    // quoted value with at least one character from the given position
+    std::size_t QuotedValue(std::size_t from, bool (*isChar)(int))
+    {
+        int q = Ch(0);
+        if(q != '"' && q != '\'')
+            return 0;
+        std::size_t n = from;
+        while(isChar(Ch(n)))
+            ++n;
+        return (n > from && Ch(n) == q) ? n + 1 : 0;
+    }
+
+    // run of text and references, stops at the end of buffer
+    std::size_t Run(const CharSet &set, std::size_t *nul)
+    {
+        std::size_t n = 0;
+        for(;;)
+        {
+            const char *p = At(n), *q = set.Skip(p, End());
+            n += q - p;
+            if(q == End())
+            {
+                split_ = !eof_;
+                return n;
+            }
+            if(*q == '&')
+            {
+                std::size_t len = Reference(n);
+                if(!len)
+                    return n;
+                n += len;
+            }
+            else if(!*q)
+            {
+                if(*nul == std::size_t(-1))
+                    *nul = n;
+                ++n;
+            }
+            else
+                return n;
+        }
+    }
+
+    // cont - the match continues previous one split at the end of buffer
+    // run of skipped text, where character ec is allowed only in sequences
+    // "-x" (comment), "]x", "]]..]x" with x != '>' (CDATA), "??..?x" with x != '>' (reserved)
+    std::size_t SkipRun(const CharSet &set, char ec)
+    {
+        std::size_t n = 0;
+        for(;;)
+        {
+            const char *p = At(n), *q = set.Skip(p, End());
+            n += q - p;
+            if(q == End())
+            {
+                split_ = !eof_;
+                return n;
+            }
+            if(*q != ec)
+                return n;
+
+            std::size_t k = 1;
+            while(Ch(n + k) == ec)
+                ++k;
+            int c = Ch(n + k);
+            if(c < 0 || c == '\r' || c == '\n')
+                return n;
+            if(ec == '-' ? k > 1 : (c == '>' && (ec == '?' || k > 1)))
+                return n;
+            n += k + 1;
+        }
+    }
+
+    // cont - the match continues previous one split at the end of buffer
+    void Advance(std::size_t n, bool cont = false)
+    {
+        if(!cont)
+            span_.fst_ = span_.lst_;
+        span_.lst_ += n;
+        pos_ += n;
+    }
+
+    void OnError(const Span &span, const String &what)
+    {
+        ParserError(stm_->UIFileName(), Locate(stm_, span), what);
+    }
+
+    void DefaultError()
+    {
+        std::size_t n = Nl(0);
+        Advance(n ? n : 1);
+        OnError(span_, "default: unrecognized char");
+    }
+
+    void XmlDeclError()
+    {
+        Advance(1);
+        OnError(span_, "xml declaration: unexpected character");
+    }
+
+    // skip up to and including the first character from set, returns this character
+    int SkipTo(const CharSet &set)
+    {
+        for(;;)
+        {
+            if(pos_ == end_ && !Fill(1))
+                OnError(span_, "unexpected end of file");
+            const char *p = At(0), *q = set.Skip(p, End());
+            Advance(q - p, true);
+            if(q != End())
+            {
+                Advance(1, true);
+                return static_cast<unsigned char>(*q);
+            }
+        }
+    }
+
+    // skip markup after '<', returns nesting depth change
+    int SkipRawMarkup();
+
+public:
+    FastScanner(InStm *stm, bool push)
+                        :   stm_            (stm),
+                            buf_            (SCANNER_BUFFER_SIZE),
+                            pos_            (0),
+                            end_            (0),
+                            eof_            (false),
+                            skipMode_       (false),
+                            dataMode_       (false),
+                            chunkMode_      (false),
+                            doctypeCnt_     (0),
+                            state_          (INITIAL),
+                            stateCaller_    (INITIAL),
+                            attrHasValue_   (false),
+                            split_          (false),
+                            cut_            (false),
+                            last_           (STOP),
+                            push_           (push),
+                            mark_           (0)
+    {
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    const Token& GetToken()
+    {
+        while(tokenStack_.size())
+        {
+            Token t = tokenStack_.back();
+            tokenStack_.pop_back();
+            if(t.type_ != DATA || dataMode_)
+                return last_ = t;
+        }
+
+        Token t = ScanToken();
+        t.span_ = span_;
+        if(t.type_ == DATA || t.type_ == VALUE)
+            ScanAndConcatenateTo(&t);
+
+        return last_ = t;
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    void UngetToken(const Token &t)
+    {
+        tokenStack_.push_back(t);
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    bool SetSkipMode(bool newMode)
+    {
+        bool old = skipMode_;
+        skipMode_ = newMode;
+        return old;
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    bool SetDataMode(bool newMode)
+    {
+        bool old = dataMode_;
+        dataMode_ = newMode;
+        return old;
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    bool SetChunkMode(bool newMode)
+    {
+        bool old = chunkMode_;
+        chunkMode_ = newMode;
+        return old;
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    bool SkipRawContent();
+
+    //-----------------------------------------------------------------------
+    //virtual
+    bool GetCheckpoint(Checkpoint *cp);
+
+    //-----------------------------------------------------------------------
+    //virtual
+    void Restore(const Checkpoint &cp);
+
+    //-----------------------------------------------------------------------
+    //virtual
+    void Error(const String &what)
+    {
+        OnError(last_.span_, what);
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    void Push(const void *p, std::size_t cnt);
+
+    //-----------------------------------------------------------------------
+    //virtual
+    void Finish()
+    {
+        eof_ = true;
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    bool IsFinished() const
+    {
+        return eof_;
+    }
+
+    //-----------------------------------------------------------------------
+    //virtual
+    void Mark();
+
+    //-----------------------------------------------------------------------
+    //virtual
+    void Reset();
+
+    //-----------------------------------------------------------------------
+    //virtual
+    std::size_t Available() const
+    {
+        return end_ - mark_;
+    }
+};
+
+//-----------------------------------------------------------------------
+LexScanner::Token FastScanner::ScanToken()
+{
+    for(;;)
+    {
+        int c = Ch(0);
+        if(c < 0)
+            return STOP;
+
+        // the match may continue a run split at the end of buffer
+        bool cont = split_;
+        split_ = false;
+
+        std::size_t n;
+        switch(state_)
+        {
+        case INITIAL:
+            if(!Lit("<?xml"))
+                DefaultError();
+            Advance(5);
+            state_ = X0_WS;
+            return XMLDECL;
+
+        //-----------------------------------------------------------------------
+        // XML declaration
+        case X0_WS:
+        case X3_WS:
+        case X4_WS:
+            {
+                State next = state_ == X0_WS ? X0 : state_ == X3_WS ? X3 : X4;
+                if((n = Ws()) != 0)
+                    Advance(n);
+                else if((n = Nl(0)) != 0)
+                    Advance(n);
+                else if(state_ != X0_WS && Lit("?>"))
+                {
+                    Advance(2);
+                    state_ = OUTSIDE;
+                    return CLOSE;
+                }
+                else
+                    DefaultError();
+                state_ = next;
+                continue;
+            }
+
+        case X0:
+        case X1:
+        case X2:
+        case X3:
+        case X4:
+            if((n = Ws()) != 0)
+            {
+                Advance(n);
+                continue;
+            }
+            if((n = Nl(0)) != 0)
+            {
+                Advance(n);
+                continue;
+            }
+            switch(state_)
+            {
+            default:
+                break;
+
+            case X0:
+                if(Lit("version"))
+                {
+                    Advance(7);
+                    state_ = X1;
+                    continue;
+                }
+                break;
+
+            case X1:
+                if(c == '=')
+                {
+                    Advance(1);
+                    state_ = X2;
+                    continue;
+                }
+                break;
+
+            case X2:
+                if(Ch(1) == '1' && Ch(2) == '.' && (n = QuotedValue(3, IsDigit)) != 0)
+                {
+                    Token t(VERSION, text_.Store(At(1), n - 2));
+                    Advance(n);
+                    state_ = X3_WS;
+                    return t;
+                }
+                break;
+
+            case X3:
+            case X4:
+                if(c == '=')
+                {
+                    Advance(1);
+                    return EQ;
+                }
+                if(Lit("?>"))
+                {
+                    Advance(2);
+                    state_ = OUTSIDE;
+                    return CLOSE;
+                }
+                if(Lit("standalone"))
+                {
+                    Advance(10);
+                    state_ = X4;
+                    return STANDALONE;
+                }
+                if(state_ == X3)
+                {
+                    if(Lit("encoding"))
+                    {
+                        Advance(8);
+                        return ENCODING;
+                    }
+                    if(IsLetter(Ch(1)) && (n = QuotedValue(1, IsEncChar)) != 0)
+                    {
+                        Token t(VALUE, text_.Store(At(1), n - 2));
+                        Advance(n);
+                        state_ = X4_WS;
+                        return t;
+                    }
+                }
+                else if(Lit("\"yes\"") || Lit("'yes'") || Lit("\"no\"") || Lit("'no'"))
+                {
+                    n = Ch(1) == 'y' ? 5 : 4;
+                    Token t(VALUE, text_.Store(At(1), n - 2));
+                    Advance(n);
+                    return t;
+                }
+                break;
+            }
+            XmlDeclError();
+            continue;   // not reached, XmlDeclError throws
+
+        //-----------------------------------------------------------------------
+        // Skip comment
+        case COMMENT:
+            if((n = SkipRun(commentSet, '-')) != 0)
+                Advance(n, cont);
+            else if(c == '-')
+            {
+                if(Ch(1) == '-' && Ch(2) == '>')
+                {
+                    Advance(3);
+                    state_ = stateCaller_;
+                }
+                else if((n = Nl(1)) != 0)
+                    Advance(n + 1);
+                else
+                    DefaultError();
+            }
+            else
+                Advance(Nl(0));
+            continue;
+
+        //-----------------------------------------------------------------------
+        // Skip CDATA block and reserved xml element
+        case CDB:
+        case RESERVED:
+            {
+                const char ec = state_ == CDB ? ']' : '?';
+                if((n = SkipRun(state_ == CDB ? cdataSet : reservedSet, ec)) != 0)
+                {
+                    Advance(n, cont);
+                    continue;
+                }
+                std::size_t k = 0;
+                while(Ch(k) == ec)
+                    ++k;
+                if((n = Nl(k)) != 0)
+                    Advance(k + n);
+                else if(Ch(k) == '>' && k >= (ec == '?' ? 1U : 2U))
+                {
+                    Advance(k + 1);
+                    state_ = stateCaller_;
+                }
+                else
+                    DefaultError();
+                continue;
+            }
+
+        //-----------------------------------------------------------------------
+        // Skip DOCTYPE
+        case DOCTYPE:
+            if(c == '<')
+            {
+                Advance(1);
+                ++doctypeCnt_;
+            }
+            else if(c == '>')
+            {
+                Advance(1);
+                if(--doctypeCnt_ <= 0)
+                    state_ = OUTSIDE;
+            }
+            else if((n = Nl(0)) != 0)
+                Advance(n);
+            else
+            {
+                std::size_t nul = std::size_t(-1);
+                Advance(Run(doctypeSet, &nul), cont);
+            }
+            continue;
+
+        //-----------------------------------------------------------------------
+        // Content
+        case OUTSIDE:
+        case D1:
+            switch(c)
+            {
+            case '<':
+                if(Lit("<!--"))
+                {
+                    Advance(4);
+                    stateCaller_ = state_;
+                    state_ = COMMENT;
+                    continue;
+                }
+                if(Lit("<![CDATA["))
+                {
+                    Advance(9);
+                    stateCaller_ = state_;
+                    state_ = CDB;
+                    continue;
+                }
+                if(state_ == OUTSIDE && Lit("<!DOCTYPE"))
+                {
+                    Advance(9);
+                    doctypeCnt_ = 1;
+                    state_ = DOCTYPE;
+                    continue;
+                }
+                if(Lit("<?xml"))
+                {
+                    Advance(5);
+                    stateCaller_ = state_;
+                    state_ = RESERVED;
+                    continue;
+                }
+                if((n = Name(1)) != 0)
+                {
+                    Token t(START, text_.Store(At(1), n), LookupElement(At(1), n));
+                    Advance(n + 1);
+                    tagStack_.push_back(t.s_.str());
+                    state_ = MARKUP;
+                    return t;
+                }
+                if(state_ == D1 && Ch(1) == '/' && (n = Name(2)) != 0)
+                {
+                    Token t(END, text_.Store(At(2), n), LookupElement(At(2), n));
+                    Advance(n + 2);
+                    if(!tagStack_.size())
+                        OnError(span_, "tag stack is empty #0");
+                    if(t.s_ != tagStack_.back())
+                        OnError(span_, "tag mismatch");
+                    tagStack_.pop_back();
+                    state_ = MARKUP;
+                    return t;
+                }
+                if(Ch(1) == '!')
+                {
+                    Advance(2);
+                    OnError(span_, "not implemented");
+                }
+                Advance(1);
+                if(state_ == D1 && dataMode_)
+                    return lt;
+                continue;
+
+            case '\r':
+            case '\n':
+                Advance(Nl(0));
+                if(state_ == D1 && dataMode_)
+                    return skipMode_ ? Token(DATA, 1) : Token(DATA, newline, 1);
+                continue;
+
+            case ' ':
+            case '\t':
+                if(state_ == OUTSIDE)
+                {
+                    Advance(Ws());
+                    continue;
+                }
+                break;
+            }
+
+            if(state_ == OUTSIDE)
+            {
+                Advance(1);     // ignore outside garbage
+                continue;
+            }
+
+            switch(c)
+            {
+            case ']':
+                for(n = 1; Ch(n) == ']'; ++n)
+                    ;
+                break;
+
+            case '>':
+            case '\'':
+            case '"':
+                Advance(1);
+                if(dataMode_)
+                    return c == '>' ? gt : c == '"' ? quot : apos;
+                continue;
+
+            default:
+                {
+                    std::size_t nul = std::size_t(-1);
+                    n = Run(dataSet, &nul);
+                    if(!n)
+                    {
+                        Advance(1);     // '&' is not a reference
+                        if(dataMode_)
+                            return amp;
+                        continue;
+                    }
+                    bool cut = cont && cut_;
+                    cut_ = cut || nul != std::size_t(-1);
+                    if(!dataMode_)
+                    {
+                        Advance(n, cont);
+                        continue;
+                    }
+                    Token t(DATA, n);
+                    if(!skipMode_)
+                        t.s_ = text_.Store(At(0), cut ? 0 : nul < n ? nul : n);
+                    Advance(n, cont);
+                    return t;
+                }
+            }
+
+            // run of ']'
+            {
+                Token t(DATA, n);
+                if(!skipMode_ && dataMode_)
+                    t.s_ = text_.Store(String(n, ']'));
+                Advance(n);
+                if(dataMode_)
+                    return t;
+                continue;
+            }
+
+        //-----------------------------------------------------------------------
+        // Markup
+        case MARKUP:
+            switch(c)
+            {
+            case ' ':
+            case '\t':
+                Advance(Ws());
+                continue;
+
+            case '\r':
+            case '\n':
+                Advance(Nl(0));
+                continue;
+
+            case '=':
+                Advance(1);
+                return EQ;
+
+            case '"':
+                Advance(1);
+                state_ = MARKUP1;
+                continue;
+
+            case '\'':
+                Advance(1);
+                state_ = MARKUP2;
+                continue;
+
+            case '/':
+                if(Ch(1) != '>')
+                    DefaultError();
+                Advance(2);
+                if(!tagStack_.size())
+                    OnError(span_, "tag stack is empty #1");
+                tagStack_.pop_back();
+                state_ = tagStack_.size() ? D1 : OUTSIDE;
+                return SLASHCLOSE;
+
+            case '>':
+                Advance(1);
+                state_ = tagStack_.size() ? D1 : OUTSIDE;
+                return CLOSE;
+            }
+
+            if((n = Name(0)) == 0)
+                DefaultError();
+            {
+                Token t(NAME, text_.Store(At(0), n));
+                Advance(n);
+                attrHasValue_ = false;
+                return t;
+            }
+
+        case MARKUP1:
+        case MARKUP2:
+            if(c == (state_ == MARKUP1 ? '"' : '\''))
+            {
+                Advance(1);
+                state_ = MARKUP;
+                if(!attrHasValue_)
+                    return VALUE;
+                attrHasValue_ = false;
+                continue;
+            }
+            if((n = Nl(0)) != 0)
+            {
+                attrHasValue_ = true;
+                Advance(n);
+                return skipMode_ ? Token(VALUE) : Token(VALUE, newline);
+            }
+            {
+                std::size_t nul = std::size_t(-1);
+                n = Run(state_ == MARKUP1 ? value1Set : value2Set, &nul);
+                if(!n)
+                    DefaultError();
+                attrHasValue_ = true;
+                bool cut = cont && cut_;
+                cut_ = cut || nul != std::size_t(-1);
+                if(skipMode_ || cut)
+                {
+                    Advance(n, cont);
+                    return VALUE;
+                }
+                vbuf_.clear();
+                Decode(At(0), n, &vbuf_, true, true);
+                vbuf_.push_back('\0');
+                Advance(n, cont);
+                Token t(VALUE, text_.Store(&vbuf_[0]));
+                cut_ = cut_ || t.s_.size() + 1 < vbuf_.size();
+                return t;
+            }
+
+        default:
+            InternalError(__FILE__, __LINE__, "bad scanner state");
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------
+// Raw skip: only the nesting depth is tracked, so errors inside
+// the skipped content (except the final etag) are not detected.
+//-----------------------------------------------------------------------
+int FastScanner::SkipRawMarkup()
+{
+    const CharSet *set;
+    const char *term;
+    std::size_t n;
+    if(Lit("!--"))
+    {
+        n = 3;
+        set = &rawDashSet;
+        term = "->";
+    }
+    else if(Lit("![CDATA["))
+    {
+        n = 8;
+        set = &rawCdataSet;
+        term = "]>";
+    }
+    else if(Ch(0) == '?')
+    {
+        n = 1;
+        set = &rawQmarkSet;
+        term = ">";
+    }
+    else if((n = Name(0)) != 0)
+    {
+        // stag
+        Advance(n, true);
+        for(;;)
+            switch(SkipTo(rawTagSet))
+            {
+            case '"':
+                SkipTo(rawValue1Set);
+                continue;
+            case '\'':
+                SkipTo(rawValue2Set);
+                continue;
+            case '/':
+                if(Ch(0) != '>')
+                    continue;
+                Advance(1, true);
+                return 0;
+            default:    // '>'
+                return 1;
+            }
+    }
+    else
+        return 0;       // '<' is not a markup
+
+    Advance(n, true);
+    do
+        SkipTo(*set);
+    while(!Lit(term));
+    Advance(strlen(term), true);
+    return 0;
+}
+
+//-----------------------------------------------------------------------
+bool FastScanner::SkipRawContent()
+{
+    if(tokenStack_.size() || state_ != D1)
+        return false;
+    split_ = cut_ = false;
+
+    for(int depth = 0;;)
+    {
+        SkipTo(rawDataSet);
+        if(Ch(0) != '/')
+        {
+            depth += SkipRawMarkup();
+            continue;
+        }
+
+        std::size_t n = Name(1);
+        if(!n)
+            continue;
+        if(depth)
+        {
+            --depth;
+            Advance(n + 1, true);
+            SkipTo(rawEtagSet);
+            continue;
+        }
+
+        // etag of the skipped element, the rest is scanned as usual
+        bool match = !tagStack_.back().compare(0, String::npos, At(1), n);
+        span_.fst_ = span_.lst_ - 1;
+        Advance(n + 1, true);
+        if(!match)
+            OnError(span_, "tag mismatch");
+        tagStack_.pop_back();
+        state_ = MARKUP;
+        last_ = END;
+        last_.span_ = span_;
+        return true;
+    }
+}
+
+//-----------------------------------------------------------------------
+bool FastScanner::GetCheckpoint(Checkpoint *cp)
+{
+    // nothing should be scanned after the tag
+    if(tokenStack_.size() || (last_.type_ != CLOSE && last_.type_ != SLASHCLOSE) || last_.span_.lst_ != span_.lst_)
+        return false;
+
+    cp->offset_     = span_.lst_;
+    cp->tags_       = tagStack_;
+    cp->skipMode_   = skipMode_;
+    cp->dataMode_   = dataMode_;
+    cp->chunkMode_  = chunkMode_;
+    return true;
+}
+
+//-----------------------------------------------------------------------
+void FastScanner::Restore(const Checkpoint &cp)
+{
+    if(push_)
+        InternalError(__FILE__, __LINE__, "push scanner can't be restored");
+
+    Seek(stm_, cp.offset_);
+    pos_ = end_ = 0;
+    eof_ = split_ = cut_ = false;
+
+    tagStack_       = cp.tags_;
+    skipMode_       = cp.skipMode_;
+    dataMode_       = cp.dataMode_;
+    chunkMode_      = cp.chunkMode_;
+    tokenStack_.clear();
+    doctypeCnt_     = 0;
+    state_          = stateCaller_ = tagStack_.size() ? D1 : OUTSIDE;
+    attrHasValue_   = false;
+
+    span_.fst_ = span_.lst_ = cp.offset_;
+    last_ = CLOSE;
+    last_.span_ = span_;
+}
+
+
+//-----------------------------------------------------------------------
+void FastScanner::Push(const void *p, std::size_t cnt)
+{
+    if(!push_ || eof_)
+        InternalError(__FILE__, __LINE__, "push scanner: unexpected input");
+
+    // drop input before the mark if it takes at least a half of the data
+    if(mark_ && mark_ * 2 >= end_)
+    {
+        ::memmove(&buf_[0], &buf_[mark_], end_ - mark_);
+        end_ -= mark_;
+        pos_ -= mark_;
+        mark_ = 0;
+    }
+    if(buf_.size() - end_ < cnt)
+        buf_.resize(std::max(buf_.size() * 2, end_ + cnt));
+    ::memcpy(&buf_[end_], p, cnt);
+    end_ += cnt;
+}
+
+//-----------------------------------------------------------------------
+void FastScanner::Mark()
+{
+    if(!push_)
+        InternalError(__FILE__, __LINE__, "scanner is not in push mode");
+
+    mark_                   = pos_;
+    saved_.tagStack_        = tagStack_;
+    saved_.tokenStack_      = tokenStack_;
+    saved_.skipMode_        = skipMode_;
+    saved_.dataMode_        = dataMode_;
+    saved_.chunkMode_       = chunkMode_;
+    saved_.doctypeCnt_      = doctypeCnt_;
+    saved_.span_            = span_;
+    saved_.state_           = state_;
+    saved_.stateCaller_     = stateCaller_;
+    saved_.attrHasValue_    = attrHasValue_;
+    saved_.split_           = split_;
+    saved_.cut_             = cut_;
+    saved_.last_            = last_;
+}
+
+//-----------------------------------------------------------------------
+void FastScanner::Reset()
+{
+    if(!push_)
+        InternalError(__FILE__, __LINE__, "scanner is not in push mode");
+
+    pos_            = mark_;
+    tagStack_       = saved_.tagStack_;
+    tokenStack_     = saved_.tokenStack_;
+    skipMode_       = saved_.skipMode_;
+    dataMode_       = saved_.dataMode_;
+    chunkMode_      = saved_.chunkMode_;
+    doctypeCnt_     = saved_.doctypeCnt_;
+    span_           = saved_.span_;
+    state_          = saved_.state_;
+    stateCaller_    = saved_.stateCaller_;
+    attrHasValue_   = saved_.attrHasValue_;
+    split_          = saved_.split_;
+    cut_            = saved_.cut_;
+    last_           = saved_.last_;
+}
+
+
+//-----------------------------------------------------------------------
+Ptr<LexScanner> FB2TOEPUB_DECL CreateFastScanner(InStm *stm)
+{
+    return new FastScanner(stm, false);
+}
+
+//-----------------------------------------------------------------------
+Ptr<PushScanner> FB2TOEPUB_DECL CreatePushScanner(InStm *stm)
+{
+    return new FastScanner(stm, true);
+}
+
+
+};  //namespace Fb2ToEpub
@@ -21,11 +21,376 @@
 #include "hdr.h"
 
 #include <sstream>
+#include <algorithm>
 #include "scanner.h"
+#include "charset.h"
 
 namespace Fb2ToEpub
 {
 
+//-----------------------------------------------------------------------
+// TEXT STORE
+//-----------------------------------------------------------------------
+const std::size_t TEXT_BLOCK_SIZE = 0x10000;
+
+//-----------------------------------------------------------------------
+class TextStore::Block : public Object, Noncopyable
+{
+public:
+    std::vector<char>   buf_;
+    std::size_t         used_;
+    TextStore           *store_;    // NULL if store is destroyed
+
+    Block(std::size_t size, TextStore *store) : buf_(size), used_(0), store_(store) {}
+
+    char*       End()           {return &buf_[0] + used_;}
+    std::size_t Room() const    {return buf_.size() - used_;}
+
+protected:
+    //virtual
+    void DeleteUnreferenced()
+    {
+        if(store_)
+            store_->Release(this);
+        else
+            delete this;
+    }
+};
+
+//-----------------------------------------------------------------------
+TextStore::TextStore()
+{
+}
+
+//-----------------------------------------------------------------------
+TextStore::~TextStore()
+{
+    cur_ = NULL;
+    std::vector<Block*>::const_iterator it;
+    for(it = blocks_.begin(); it != blocks_.end(); ++it)
+        (*it)->store_ = NULL;               // blocks in use are deleted by the last view
+    for(it = free_.begin(); it != free_.end(); ++it)
+        delete *it;
+}
+
+//-----------------------------------------------------------------------
+void TextStore::Release(Block *b)
+{
+    b->used_ = 0;
+    if(b->buf_.size() <= TEXT_BLOCK_SIZE)
+    {
+        free_.push_back(b);
+        return;
+    }
+
+    // don't keep large blocks
+    blocks_.erase(std::find(blocks_.begin(), blocks_.end(), b));
+    delete b;
+}
+
+//-----------------------------------------------------------------------
+char* TextStore::Alloc(std::size_t len, TextView *v)
+{
+    if(!cur_ || cur_->Room() < len + 1)
+    {
+        Block *b = NULL;
+        for(std::vector<Block*>::iterator it = free_.begin(); it != free_.end(); ++it)
+            if((*it)->Room() >= len + 1)
+            {
+                b = *it;
+                free_.erase(it);
+                break;
+            }
+        if(!b)
+        {
+            b = new Block(std::max(TEXT_BLOCK_SIZE, 2 * (len + 1)), this);
+            blocks_.push_back(b);
+        }
+        cur_ = b;
+    }
+
+    char *p = cur_->End();
+    cur_->used_ += len + 1;
+    p[len] = '\0';
+
+    v->owner_   = cur_.ptr();
+    v->s_       = p;
+    v->len_     = len;
+    return p;
+}
+
+//-----------------------------------------------------------------------
+TextView TextStore::Store(const char *s, std::size_t len)
+{
+    TextView v;
+    memcpy(Alloc(len, &v), s, len);
+    return v;
+}
+
+//-----------------------------------------------------------------------
+void TextStore::Append(TextView *v, const TextView &v1)
+{
+    if(!v1.len_)
+        return;
+    if(!v->len_)
+    {
+        *v = v1;
+        return;
+    }
+
+    Block *b = cur_.ptr();
+    char *end = const_cast<char*>(v->s_) + v->len_;
+    if(b && v->owner_ == b && end + 1 == b->End())
+    {
+        // v is the last text in block
+        if(b->Room() >= v1.len_)
+        {
+            memcpy(end, v1.s_, v1.len_);
+            end[v1.len_] = '\0';
+            b->used_ += v1.len_;
+            v->len_ += v1.len_;
+            return;
+        }
+    }
+    else if(b && v->owner_ == b && v1.owner_ == b && end + 1 == v1.s_ && v1.s_ + v1.len_ + 1 == b->End())
+    {
+        // v1 is stored right after v, remove the gap
+        memmove(end, v1.s_, v1.len_ + 1);
+        --b->used_;
+        v->len_ += v1.len_;
+        return;
+    }
+
+    TextView nv;
+    char *p = Alloc(v->len_ + v1.len_, &nv);
+    memcpy(p, v->s_, v->len_);
+    memcpy(p + v->len_, v1.s_, v1.len_);
+    *v = nv;
+}
+
+//-----------------------------------------------------------------------
+// ELEMENTS
+//-----------------------------------------------------------------------
+static const char *elementNames[] =
+{
+    "",
+    "FictionBook",
+    "a",
+    "annotation",
+    "author",
+    "binary",
+    "body",
+    "book-name",
+    "book-title",
+    "cite",
+    "city",
+    "code",
+    "coverpage",
+    "custom-info",
+    "date",
+    "description",
+    "document-info",
+    "email",
+    "emphasis",
+    "empty-line",
+    "epigraph",
+    "first-name",
+    "genre",
+    "history",
+    "home-page",
+    "id",
+    "isbn",
+    "image",
+    "keywords",
+    "lang",
+    "last-name",
+    "middle-name",
+    "nickname",
+    "output-document-class",
+    "output",
+    "p",
+    "part",
+    "poem",
+    "program-used",
+    "publish-info",
+    "publisher",
+    "section",
+    "sequence",
+    "src-lang",
+    "src-ocr",
+    "src-title-info",
+    "src-url",
+    "stanza",
+    "strikethrough",
+    "strong",
+    "style",
+    "stylesheet",
+    "sub",
+    "subtitle",
+    "sup",
+    "table",
+    "td",
+    "text-author",
+    "th",
+    "title",
+    "title-info",
+    "tr",
+    "translator",
+    "v",
+    "version",
+    "year",
+
+    // transliteration table
+    "map",
+    "transtable",
+};
+
+//-----------------------------------------------------------------------
+// Perfect hash of element names: every name in elementNames gets its own slot.
+// If the list changes, pick new multipliers and rebuild the table.
+static inline unsigned ElementHash(const char *name, std::size_t len)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char*>(name);
+    return (len*19 + s[0]*9 + s[len/2]*4 + s[len-1]) & 0xff;
+}
+
+static const unsigned char elementHashTable[256] =
+{
+     0,  0, 66,  0,  0, 14,  0, 67,  0, 51,  0,  0,  0,  0,  0,  0,
+    10,  0,  0,  0,  0,  0,  0,  0,  0,  3,  0, 22, 18,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 56,  0,
+     0,  0,  0, 35, 45,  0,  7, 29,  0,  0, 48,  0,  0, 37,  0,  0,
+     0,  0, 58,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0, 12,  0, 20,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    55,  2,  0,  0, 19,  8,  0, 15,  0,  0,  0,  0, 24, 21,  1, 13,
+     0,  0,  0,  0, 61,  0, 23,  0, 36,  0, 52,  0,  0,  0,  0,  0,
+     0,  0,  0, 65,  0,  0,  0, 63, 54,  0, 28,  0,  0, 34,  0,  0,
+    30,  0,  0, 32,  0,  0, 47,  0,  0,  0,  0,  0, 42,  0,  0, 31,
+    49,  0, 16,  0,  0,  0,  0,  0, 59,  0,  0,  0, 53,  0,  0,  0,
+    46, 40,  0, 50,  0,  0, 44,  0,  0,  0, 43,  0, 11, 33,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  6,  0,  0,  0, 25,  0,  0, 41,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 57, 17,  0,  0,  0,
+     0,  5,  0, 39,  0, 64,  0,  0,  0,  0,  0,  0, 38,  4,  0,  0,
+     0,  0,  0, 26, 62, 60,  0,  0,  0, 27,  0,  0,  9,  0,  0,  0,
+};
+
+//-----------------------------------------------------------------------
+ElementType LookupElement(const char *name, std::size_t len)
+{
+    if(!len)
+        return E_NONE;
+    ElementType e = static_cast<ElementType>(elementHashTable[ElementHash(name, len)]);
+    const char *ename = elementNames[e];
+    if(e == E_NONE || strncmp(ename, name, len) || ename[len])
+        return E_NONE;
+    return e;
+}
+
+//-----------------------------------------------------------------------
+const char* ElementName(ElementType element)
+{
+    return elementNames[element];
+}
+
+
+//-----------------------------------------------------------------------
+// ATTRIBUTES
+//-----------------------------------------------------------------------
+static const char *attrNames[] =
+{
+    "",
+    "align",
+    "alt",
+    "colspan",
+    "content-type",
+    "href",
+    "id",
+    "in",
+    "lang",
+    "name",
+    "number",
+    "out",
+    "rowspan",
+    "style",
+    "title",
+    "valign",
+    "value",
+};
+
+//-----------------------------------------------------------------------
+// Perfect hash of attribute names (see ElementHash)
+static inline unsigned AttrHash(const char *name, std::size_t len)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char*>(name);
+    return (len*17 + s[0]*1 + s[len/2]*11 + s[len-1]) & 0x1f;
+}
+
+static const unsigned char attrHashTable[32] =
+{
+    13,  0,  0,  0,  0,  0,  9,  1, 12,  5, 14,  0,  2, 15,  0,  0,
+     4,  8,  0,  7, 16,  0,  0,  0,  0,  3,  0,  6, 10, 11,  0,  0,
+};
+
+//-----------------------------------------------------------------------
+AttrType LookupAttr(const char *name, std::size_t len)
+{
+    if(!len)
+        return A_NONE;
+    AttrType a = static_cast<AttrType>(attrHashTable[AttrHash(name, len)]);
+    const char *aname = attrNames[a];
+    if(a == A_NONE || strncmp(aname, name, len) || aname[len])
+        return A_NONE;
+    return a;
+}
+
+//-----------------------------------------------------------------------
+const char* AttrName(AttrType attr)
+{
+    return attrNames[attr];
+}
+
+//-----------------------------------------------------------------------
+const AttrMap::Attr* AttrMap::FindAttr(AttrType id, const char *prefix) const
+{
+    std::size_t plen = strlen(prefix), local = plen ? plen + 1 : 0;
+    for(std::size_t i = 0; i < size_; ++i)
+    {
+        const Attr &a = (*this)[i];
+        if(a.id_ == id && a.local_ == local && !memcmp(a.name_.data(), prefix, plen))
+            return &a;
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------
+bool AttrMap::Defined(const TextView &name) const
+{
+    for(std::size_t i = 0; i < size_; ++i)
+        if(!(*this)[i].name_.compare(name))
+            return true;
+    return false;
+}
+
+//-----------------------------------------------------------------------
+void AttrMap::Add(const TextView &name, const TextView &value)
+{
+    Attr *a;
+    if(size_ < FIXED_SIZE)
+        a = &fixed_[size_];
+    else
+    {
+        more_.push_back(Attr());
+        a = &more_.back();
+    }
+    ++size_;
+
+    const char *colon = static_cast<const char*>(memchr(name.data(), ':', name.size()));
+    a->local_ = colon ? colon + 1 - name.data() : 0;
+    a->id_ = LookupAttr(name.data() + a->local_, name.size() - a->local_);
+    a->name_ = name;
+    a->value_ = value;
+}
+
 //-----------------------------------------------------------------------
 class SetScannerSkipMode
 {
@@ -55,22 +420,26 @@ void LexScanner::SkipRestOfElementContent()
     SetScannerSkipMode skipMode(this);
     for(;;)
     {
-        Token t = GetToken();
-        switch(t.type_)
+        if(!SkipRawContent())
         {
-        case DATA:
-            continue;
-        case START:
-            UngetToken(t);
-            SkipElement();
-            continue;
-        case END:
-            if (GetToken().type_ != CLOSE)
-                Error("'close' of etag expected");
-            return;
-        default:
-            Error("unexpected token");
+            Token t = GetToken();
+            switch(t.type_)
+            {
+            case DATA:
+                continue;
+            case START:
+                UngetToken(t);
+                SkipElement();
+                continue;
+            case END:
+                break;
+            default:
+                Error("unexpected token");
+            }
         }
+        if (GetToken().type_ != CLOSE)
+            Error("'close' of etag expected");
+        return;
     }
 }
 
@@ -98,7 +467,7 @@ void LexScanner::SkipElement()
 }
 
 //-----------------------------------------------------------------------
-void LexScanner::CheckAndSkipElement(const String &element)
+void LexScanner::CheckAndSkipElement(ElementType element)
 {
     if(!IsNextElement(element))
         Error("expected element not found");
@@ -106,17 +475,16 @@ void LexScanner::CheckAndSkipElement(const String &element)
 }
 
 //-----------------------------------------------------------------------
-void LexScanner::SkipIfElement(const String &element)
+void LexScanner::SkipIfElement(ElementType element)
 {
-    if(LookAhead() == Token(START, element))
+    if(IsNextElement(element))
         SkipElement();
 }
 
 //-----------------------------------------------------------------------
-void LexScanner::SkipAll(const String &element)
+void LexScanner::SkipAll(ElementType element)
 {
-    Token t(START, element);
-    while(LookAhead() == t)
+    while(IsNextElement(element))
         SkipElement();
 }
 
@@ -149,9 +517,10 @@ void LexScanner::SkipXMLDeclaration ()
 }
 
 //-----------------------------------------------------------------------
-bool LexScanner::IsNextElement(const String &element)
+bool LexScanner::IsNextElement(ElementType element)
 {
-    return (LookAhead() == Token(START, element));
+    Token t = LookAhead();
+    return t.type_ == START && t.elem_ == element;
 }
 
 //-----------------------------------------------------------------------
@@ -166,28 +535,28 @@ void LexScanner::ParseAttributes(AttrMap *attrmap)
             return;
         }
 
-        AttrMap::iterator it = attrmap->lower_bound(tname.s_);
-        if(it != attrmap->end() && it->first == tname.s_)
+        if(attrmap->Defined(tname.s_))
             Error("attribute redefinition");
 
         if (GetToken() != Token(EQ))
             Error("'=' expected in attribute definition");
         
-        Token tval = GetToken();
+        const Token &tval = GetToken();
         if(tval.type_ != VALUE)
             Error("'value' expected in attribute definition");
 
-        attrmap->insert(it, AttrMap::value_type(tname.s_, tval.s_));
+        attrmap->Add(tname.s_, tval.s_);
     }
 }
 
 //-----------------------------------------------------------------------
-bool LexScanner::BeginElement(const String &element, AttrMap *attrmap)
+bool LexScanner::BeginElement(ElementType element, AttrMap *attrmap)
 {
-    if(GetToken() != Token(START, element))
+    const Token &t0 = GetToken();
+    if(t0.type_ != START || t0.elem_ != element)
     {
         std::ostringstream ss;
-        ss << "element <" << element << "> expected";
+        ss << "element <" << ElementName(element) << "> expected";
         Error(ss.str());
     }
 
@@ -205,7 +574,7 @@ bool LexScanner::BeginElement(const String &element, AttrMap *attrmap)
     default:
         {
             std::ostringstream ss;
-            ss << "element <" << element << "> expected";
+            ss << "element <" << ElementName(element) << "> expected";
             Error(ss.str());
         }
         return false;
@@ -213,18 +582,18 @@ bool LexScanner::BeginElement(const String &element, AttrMap *attrmap)
 }
 
 //-----------------------------------------------------------------------
-void LexScanner::BeginNotEmptyElement(const String &element, AttrMap *attrmap)
+void LexScanner::BeginNotEmptyElement(ElementType element, AttrMap *attrmap)
 {
     if(!BeginElement(element, attrmap))
     {
         std::ostringstream ss;
-        ss << "element <" << element << "> can't be empty";
+        ss << "element <" << ElementName(element) << "> can't be empty";
         Error(ss.str());
     }
 }
 
 //-----------------------------------------------------------------------
-String LexScanner::SimpleTextElement(const String &element, AttrMap *attrmap)
+String LexScanner::SimpleTextElement(ElementType element, AttrMap *attrmap)
 {
     if(!BeginElement(element, attrmap))
         return "";
@@ -234,7 +603,7 @@ String LexScanner::SimpleTextElement(const String &element, AttrMap *attrmap)
     LexScanner::Token t = GetToken();
     if(t.type_ == DATA)
     {
-        text = t.s_;
+        text = t.s_.str();
         t = GetToken();
     }
     if(t.type_ != END || GetToken().type_ != CLOSE)
@@ -275,33 +644,34 @@ static void ConvertToUtf8(unsigned long x, std::vector<char> *buf)
 }
 
 //-----------------------------------------------------------------------
-static const bool DecodeDecimal(const char **s, std::vector<char> *buf)
+static const bool DecodeDecimal(const char **s, const char *end, std::vector<char> *buf)
 {
     const char *pc = *s;
     unsigned long x = 0;
-    char c = *pc++;
     do
     {
-        if(c < '0' || c > '9')
+        if(pc == end || *pc < '0' || *pc > '9')
             return false;
 
-        x = x*10 + (c - '0');
-        c = *pc++;
+        x = x*10 + (*pc++ - '0');
     }
-    while(c != ';');
+    while(pc == end || *pc != ';');
     ConvertToUtf8(x, buf);
-    *s = pc;
+    *s = pc + 1;
     return true;
 }
 
 //-----------------------------------------------------------------------
-static const bool DecodeHex(const char **s, std::vector<char> *buf)
+static const bool DecodeHex(const char **s, const char *end, std::vector<char> *buf)
 {
     const char *pc = *s;
     unsigned long x = 0;
-    char c = *pc++;
     do
     {
+        if(pc == end)
+            return false;
+
+        char c = *pc++;
         if(c >= '0' && c <= '9')
             x = x*16 + (c - '0');
         else if(c >= 'a' && c <= 'f')
@@ -310,17 +680,15 @@ static const bool DecodeHex(const char **s, std::vector<char> *buf)
             x = x*16 + (c + 10 - 'A');
         else
             return false;
-
-        c = *pc++;
     }
-    while(c != ';');
+    while(pc == end || *pc != ';');
     ConvertToUtf8(x, buf);
-    *s = pc;
+    *s = pc + 1;
     return true;
 }
 
 //-----------------------------------------------------------------------
-static bool DecodeEntity(const char **s, const char *etext, char val, std::vector<char> *buf)
+static bool DecodeEntity(const char **s, const char *end, const char *etext, char val, std::vector<char> *buf)
 {
     const char *pc = *s;
     for(;;)
@@ -332,78 +700,86 @@ static bool DecodeEntity(const char **s, const char *etext, char val, std::vecto
             *s = pc;
             return true;
         }
-        if(*pc++ != c)
+        if(pc == end || *pc++ != c)
             return false;
     }
 }
 
 //-----------------------------------------------------------------------
-static void UnknownEntity(const char **s, std::vector<char> *buf)
+static void UnknownEntity(std::vector<char> *buf)
 {
     static const char amp[] = "&amp;";
     buf->insert(buf->end(), amp, amp + strlen(amp));
 }
 
 //-----------------------------------------------------------------------
-void LexScanner::Decode(const char *s, std::vector<char> *buf, bool decodeEntities, bool removeLF)
+// Characters processed by Decode, depending on decodeEntities and removeLF
+static const CharSet    decodeSet       ("\r", 1),
+                        decodeLFSet     ("\r\n", 2),
+                        decodeEntSet    ("&\r", 2),
+                        decodeEntLFSet  ("&\r\n", 3);
+
+//-----------------------------------------------------------------------
+void LexScanner::Decode(const char *s, std::size_t len, std::vector<char> *buf, bool decodeEntities, bool removeLF)
 {
+    const CharSet &set = decodeEntities ?   (removeLF ? decodeEntLFSet : decodeEntSet) :
+                                            (removeLF ? decodeLFSet : decodeSet);
+    const char *end = s + len;
     for(;;)
     {
-        char c = *s++;
-        switch(c)
-        {
-        default:    buf->push_back(c); continue;
-        case '\0':  buf->push_back('\0'); return;
+        // copy run of plain text
+        const char *p = set.Skip(s, end);
+        buf->insert(buf->end(), s, p);
+        if(p == end)
+            return;
 
-        case '\n':
-            if(!removeLF)
-                buf->push_back(c);
+        s = p + 1;
+        switch(*p)
+        {
+        case '\n':      // removeLF
             continue;
 
         case '\r':
             if(!removeLF)
             {
                 buf->push_back('\n');
-                if(*s == '\n')
+                if(s < end && *s == '\n')
                     ++s;
             }
             continue;
 
-        case '&':
-            if(!decodeEntities)
-                buf->push_back('&');
-            else
+        default:        // '&', decodeEntities
+            if(s < end && *s == '#')
             {
-                const char *sOld = s;
-                if(*s == '#')
+                const char *sNum = s + 1;
+                if(sNum == end || *sNum != 'x')
                 {
-                    if(*++s != 'x')
+                    if(DecodeDecimal(&sNum, end, buf))
                     {
-                        if(DecodeDecimal(&s, buf))
-                            continue;
-                    }
-                    else
-                    {
-                        ++s;
-                        if(DecodeHex(&s, buf))
-                            continue;
+                        s = sNum;
+                        continue;
                     }
                 }
                 else
                 {
-                    if (DecodeEntity(&s, "lt;", '<', buf) ||
-                        DecodeEntity(&s, "gt;", '>', buf) ||
-                        DecodeEntity(&s, "amp;", '&', buf) ||
-                        DecodeEntity(&s, "apos;", '\'', buf) ||
-                        DecodeEntity(&s, "quot;", '"', buf))
+                    ++sNum;
+                    if(DecodeHex(&sNum, end, buf))
                     {
+                        s = sNum;
                         continue;
                     }
                 }
-
-                s = sOld;
-                UnknownEntity(&s, buf);
             }
+            else if (DecodeEntity(&s, end, "lt;", '<', buf) ||
+                     DecodeEntity(&s, end, "gt;", '>', buf) ||
+                     DecodeEntity(&s, end, "amp;", '&', buf) ||
+                     DecodeEntity(&s, end, "apos;", '\'', buf) ||
+                     DecodeEntity(&s, end, "quot;", '"', buf))
+            {
+                continue;
+            }
+
+            UnknownEntity(buf);
             continue;
         }
     }
@@ -416,22 +792,97 @@ static void EncodeEntity(const char *s, std::vector<char> *buf)
 }
 
 //-----------------------------------------------------------------------
-void LexScanner::Encode(const char *s, std::vector<char> *buf)
+static const CharSet encodeSet("<>&'\"", 5);
+
+//-----------------------------------------------------------------------
+void LexScanner::Encode(const char *s, std::size_t len, std::vector<char> *buf)
 {
+    const char *end = s + len;
     for(;;)
     {
-        char c = *s++;
-        switch(c)
+        // copy run of plain text
+        const char *p = encodeSet.Skip(s, end);
+        buf->insert(buf->end(), s, p);
+        if(p == end)
+            return;
+
+        s = p + 1;
+        switch(*p)
         {
-        case '\0':  buf->push_back('\0');           return;
         case '<':   EncodeEntity("&lt;", buf);      continue;
         case '>':   EncodeEntity("&gt;", buf);      continue;
         case '&':   EncodeEntity("&amp;", buf);     continue;
         case '\'':  EncodeEntity("&apos;", buf);    continue;
-        case '"':   EncodeEntity("&quot;", buf);    continue;
-        default:    buf->push_back(c);              continue;
+        default:    EncodeEntity("&quot;", buf);    continue;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------
+LexScanner::Loc LexScanner::Locate(InStm *stm, const Span &span)
+{
+    // "\r\n", "\r" and "\n" are line ends, column is counted in bytes
+    Loc loc;
+    stm->Rewind();
+
+    std::vector<char> buf(0x10000);
+    std::size_t pos = 0, lnStart = 0, i = 0, cnt = 0;
+    int ln = 1;
+    char prev = '\0';
+    for(;; ++pos)
+    {
+        if(pos == span.fst_)
+        {
+            loc.fstLn_ = ln;
+            loc.fstCol_ = static_cast<int>(pos - lnStart) + 1;
         }
+        if(pos == span.lst_)
+            break;
+
+        if(i == cnt)
+        {
+            if(stm->IsEOF() || (cnt = stm->Read(&buf[0], buf.size())) == 0)
+                break;
+            i = 0;
+        }
+        char c = buf[i++];
+        if(c == '\r' || c == '\n')
+        {
+            if(c == '\r' || prev != '\r')
+                ++ln;
+            lnStart = pos + 1;
+        }
+        prev = c;
     }
+
+    loc.lstLn_ = ln;
+    loc.lstCol_ = static_cast<int>(pos - lnStart) + 1;
+    return loc;
+}
+
+//-----------------------------------------------------------------------
+void LexScanner::Seek(InStm *stm, std::size_t offset)
+{
+    stm->Rewind();
+
+    std::vector<char> buf(0x10000);
+    while(offset)
+    {
+        std::size_t cnt = offset < buf.size() ? offset : buf.size();
+        if(stm->IsEOF() || (cnt = stm->Read(&buf[0], cnt)) == 0)
+            IOError(stm->UIFileName(), "checkpoint is beyond the end of file");
+        offset -= cnt;
+    }
+}
+
+//-----------------------------------------------------------------------
+Ptr<LexScanner> FB2TOEPUB_DECL CreateScanner(InStm *stm)
+{
+#if FB2TOEPUB_FAST_SCANNER
+    return CreateFastScanner(stm);
+#else
+    return CreateFlexScanner(stm);
+#endif
 }
 
 
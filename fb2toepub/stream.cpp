@@ -23,6 +23,15 @@
 #include <vector>
 #include "stream.h"
 #include "error.h"
+#include "threads.h"
+
+#if (defined unix)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace Fb2ToEpub
 {
@@ -125,6 +134,99 @@ Ptr<InStm> CreateInFileStm(const char *name)
 }
 
 
+#if (defined unix)
+//-----------------------------------------------------------------------
+// InMmapStm implementation
+//-----------------------------------------------------------------------
+class InMmapStm : public InStm, Noncopyable
+{
+    const char  *pbegin_, *pend_;   // mapped file
+    const char  *p_;                // current position
+    String      name_;              // file name
+
+public:
+    InMmapStm(const char *pbegin, size_t size, const char *name)
+        : pbegin_(pbegin), pend_(pbegin + size), p_(pbegin), name_(name) {}
+    ~InMmapStm() {::munmap(const_cast<char*>(pbegin_), pend_ - pbegin_);}
+
+    //virtuals
+    bool        IsEOF() const                       {return p_ >= pend_;}
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind()                            {p_ = pbegin_;}
+    String      UIFileName() const                  {return name_;}
+};
+
+//-----------------------------------------------------------------------
+char InMmapStm::GetChar()
+{
+    if(p_ >= pend_)
+        IOError(name_, "mmap: EOF");
+    return *p_++;
+}
+
+//-----------------------------------------------------------------------
+size_t InMmapStm::Read(void *buffer, size_t max_cnt)
+{
+    size_t cnt = pend_ - p_;
+    if(cnt > max_cnt)
+        cnt = max_cnt;
+    ::memcpy(buffer, p_, cnt);
+    p_ += cnt;
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+void InMmapStm::UngetChar(char c)
+{
+    // the mapped data is read-only, so only the char just read can be returned
+    if(p_ == pbegin_ || p_[-1] != c)
+        IOError(name_, "mmap: unget char error");
+    --p_;
+}
+
+//-----------------------------------------------------------------------
+Ptr<InStm> CreateInMmapStm(const char *name, bool *mapped)
+{
+    if(mapped)
+        *mapped = false;
+
+    int fd = ::open(name, O_RDONLY);
+    if(fd < 0)
+        IOError(name, "can't open src file");
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if(!::fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        static_cast<size_t>(st.st_size) == static_cast<unsigned long long>(st.st_size))
+    {
+        p = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);    // mapping stays valid after close
+
+    if(p == MAP_FAILED)
+        return CreateInFileStm(name);   // empty file, pipe, no mmap support etc.
+
+    ::madvise(p, st.st_size, MADV_SEQUENTIAL);
+    if(mapped)
+        *mapped = true;
+    return new InMmapStm(reinterpret_cast<const char*>(p), st.st_size, name);
+}
+
+#else
+
+//-----------------------------------------------------------------------
+Ptr<InStm> CreateInMmapStm(const char *name, bool *mapped)
+{
+    if(mapped)
+        *mapped = false;
+    return CreateInFileStm(name);
+}
+
+#endif
+
+
 //-----------------------------------------------------------------------
 // OutFileStm implementation
 //-----------------------------------------------------------------------
@@ -169,7 +271,475 @@ Ptr<OutStm> CreateOutFileStm(const char *name)
 }
 
 
-/*
+//-----------------------------------------------------------------------
+// InSpoolStm implementation
+//-----------------------------------------------------------------------
+class InSpoolStm : public InStm, Noncopyable
+{
+    Ptr<InStm>          stm_;       // source stream
+    size_t              memLimit_;  // max size of data kept in memory
+    std::vector<char>   mem_;       // spooled data (while in memory)
+    FILE                *f_;        // spooled data (when above memLimit_)
+    std::vector<char>   fbuf_;      // read buffer for spooled data in file
+    size_t              fbufPos_;   // offset of fbuf_ data in spooled data
+    size_t              fbufSize_;  // size of fbuf_ data
+    size_t              size_;      // spooled data size
+    size_t              pos_;       // current position
+
+    void    Append(const char *p, size_t cnt);
+    size_t  ReadSpooled(char *p, size_t cnt);
+    bool    InBuffer() const        {return pos_ >= fbufPos_ && pos_ < fbufPos_ + fbufSize_;}
+
+public:
+    InSpoolStm(InStm *stm, size_t memLimit)
+        : stm_(stm), memLimit_(memLimit), f_(NULL), fbufPos_(0), fbufSize_(0), size_(0), pos_(0) {}
+    ~InSpoolStm() {if(f_) fclose(f_);}
+
+    //virtuals
+    bool        IsEOF() const           {return pos_ >= size_ && stm_->IsEOF();}
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind()                {pos_ = 0;}
+    String      UIFileName() const      {return stm_->UIFileName();}
+};
+
+//-----------------------------------------------------------------------
+void InSpoolStm::Append(const char *p, size_t cnt)
+{
+    if(!f_ && size_ + cnt > memLimit_)
+    {
+        // too big to keep in memory - move it to temporary file
+        if(!(f_ = tmpfile()))
+            IOError(UIFileName(), "spool: can't create temporary file");
+        if(size_ && fwrite(&mem_[0], 1, size_, f_) != size_)
+            IOError(UIFileName(), "spool: fwrite error");
+        std::vector<char>().swap(mem_);
+    }
+
+    if(!f_)
+        mem_.insert(mem_.end(), p, p + cnt);
+    else if(fseek(f_, 0, SEEK_END) || fwrite(p, 1, cnt, f_) != cnt)
+        IOError(UIFileName(), "spool: fwrite error");
+    size_ += cnt;
+}
+
+//-----------------------------------------------------------------------
+size_t InSpoolStm::ReadSpooled(char *p, size_t cnt)
+{
+    if(cnt > size_ - pos_)
+        cnt = size_ - pos_;
+    if(!f_)
+    {
+        ::memcpy(p, &mem_[pos_], cnt);
+        pos_ += cnt;
+        return cnt;
+    }
+
+    const size_t FBUF_SIZE = 0x10000;
+    if(!InBuffer())
+    {
+        if(cnt >= FBUF_SIZE)
+        {
+            // big read - bypass the buffer
+            if(fseek(f_, pos_, SEEK_SET) || fread(p, 1, cnt, f_) != cnt)
+                IOError(UIFileName(), "spool: fread error");
+            pos_ += cnt;
+            return cnt;
+        }
+
+        fbuf_.resize(FBUF_SIZE);
+        fbufPos_ = pos_;
+        fbufSize_ = size_ - pos_ < FBUF_SIZE ? size_ - pos_ : FBUF_SIZE;
+        if(fseek(f_, fbufPos_, SEEK_SET) || fread(&fbuf_[0], 1, fbufSize_, f_) != fbufSize_)
+        {
+            fbufSize_ = 0;
+            IOError(UIFileName(), "spool: fread error");
+        }
+    }
+
+    size_t avail = fbufPos_ + fbufSize_ - pos_;
+    if(cnt > avail)
+        cnt = avail;
+    ::memcpy(p, &fbuf_[pos_ - fbufPos_], cnt);
+    pos_ += cnt;
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+char InSpoolStm::GetChar()
+{
+    if(pos_ < size_)
+    {
+        if(!f_)
+            return mem_[pos_++];
+        if(InBuffer())
+            return fbuf_[pos_++ - fbufPos_];
+    }
+
+    char c;
+    if(!Read(&c, 1))
+        IOError(UIFileName(), "spool: EOF");
+    return c;
+}
+
+//-----------------------------------------------------------------------
+size_t InSpoolStm::Read(void *buffer, size_t max_cnt)
+{
+    char *cb = reinterpret_cast<char*>(buffer);
+
+    // replay spooled data first
+    size_t cnt = 0;
+    while(cnt < max_cnt && pos_ < size_)
+        cnt += ReadSpooled(cb + cnt, max_cnt - cnt);
+    if(cnt == max_cnt)
+        return cnt;
+
+    // then read new data from the source and spool it
+    size_t cnt_read = stm_->Read(cb + cnt, max_cnt - cnt);
+    Append(cb + cnt, cnt_read);
+    pos_ += cnt_read;
+    return cnt + cnt_read;
+}
+
+//-----------------------------------------------------------------------
+void InSpoolStm::UngetChar(char)
+{
+    // everything read is spooled and never changes, so just step back
+    if(!pos_)
+        IOError(UIFileName(), "spool: unget char error");
+    --pos_;
+}
+
+//-----------------------------------------------------------------------
+Ptr<InStm> CreateSpoolStm(InStm *stm, size_t memLimit)
+{
+    return new InSpoolStm(stm, memLimit);
+}
+
+
+//-----------------------------------------------------------------------
+// READ-AHEAD STREAM IMPLEMENTATION
+// Background thread fills one block while the other one is consumed.
+// The source stream is accessed by the background thread only,
+// except Rewind which is made when the thread is idle.
+//-----------------------------------------------------------------------
+class InReadAheadStm : public InStm, Noncopyable
+{
+    struct Block
+    {
+        std::vector<char>   data_;      // data_[0] is reserved for unget
+        size_t              size_;
+        bool                eof_;       // last block
+        bool                ready_;     // filled by background thread
+        String              error_;     // error message if filling failed
+    };
+
+    class Worker : public Runnable
+    {
+        InReadAheadStm *owner_;
+    public:
+        explicit Worker(InReadAheadStm *owner) : owner_(owner) {}
+        void Run() {owner_->Work();}
+    };
+
+    Ptr<InStm>          stm_;
+    String              name_;
+    Ptr<Monitor>        mon_;
+    mutable Block       blocks_[2];
+    int                 fillIdx_;       // next block to fill by background thread
+    mutable int         requested_;     // number of blocks requested to fill
+    bool                stop_;
+    Ptr<Worker>         worker_;
+    Ptr<Thread>         thread_;
+
+    mutable int         curIdx_;        // block being consumed
+    mutable const char  *cur_, *end_;
+
+    void Work();
+    void FillBlock(Block *b);
+    bool Next() const;
+
+public:
+    InReadAheadStm(InStm *stm, size_t blockSize);
+    ~InReadAheadStm();
+
+    //virtuals
+    bool        IsEOF() const               {return cur_ == end_ && !Next();}
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind();
+    String      UIFileName() const          {return name_;}
+};
+
+//-----------------------------------------------------------------------
+InReadAheadStm::InReadAheadStm(InStm *stm, size_t blockSize)
+                                :   stm_(stm),
+                                    name_(stm->UIFileName()),
+                                    mon_(CreateMonitor()),
+                                    fillIdx_(0),
+                                    requested_(1),
+                                    stop_(false),
+                                    curIdx_(1)
+{
+    for(int i = 0; i < 2; ++i)
+    {
+        blocks_[i].data_.resize(1 + blockSize);
+        blocks_[i].size_ = 0;
+        blocks_[i].eof_ = blocks_[i].ready_ = false;
+    }
+    cur_ = end_ = &blocks_[curIdx_].data_[1];
+
+    worker_ = new Worker(this);
+    thread_ = StartThread(worker_);
+}
+
+//-----------------------------------------------------------------------
+InReadAheadStm::~InReadAheadStm()
+{
+    {
+        MonitorLock lock(mon_);
+        stop_ = true;
+        mon_->NotifyAll();
+    }
+    thread_->Join();
+}
+
+//-----------------------------------------------------------------------
+void InReadAheadStm::FillBlock(Block *b)
+{
+    b->size_ = 0;
+    b->eof_ = false;
+    b->error_.clear();
+    try
+    {
+        char *p = &b->data_[1];
+        size_t max_cnt = b->data_.size() - 1;
+        while(b->size_ < max_cnt && !stm_->IsEOF())
+            b->size_ += stm_->Read(p + b->size_, max_cnt - b->size_);
+        b->eof_ = stm_->IsEOF();
+    }
+    catch(const Exception &ex)
+    {
+        b->error_ = ex.What();
+        b->eof_ = true;
+    }
+    catch(...)
+    {
+        b->error_ = name_ + ": read-ahead error";
+        b->eof_ = true;
+    }
+}
+
+//-----------------------------------------------------------------------
+void InReadAheadStm::Work()
+{
+    MonitorLock lock(mon_);
+    for(;;)
+    {
+        while(!stop_ && !requested_)
+            mon_->Wait();
+        if(stop_)
+            return;
+
+        Block &b = blocks_[fillIdx_];
+        mon_->Leave();
+        FillBlock(&b);
+        mon_->Enter();
+
+        b.ready_ = true;
+        fillIdx_ ^= 1;
+        --requested_;
+        mon_->NotifyAll();
+    }
+}
+
+//-----------------------------------------------------------------------
+bool InReadAheadStm::Next() const
+{
+    Block &cur = blocks_[curIdx_];
+    if(cur.eof_)
+        return false;
+
+    // keep last char to make unget possible
+    bool hasLast = cur_ > &cur.data_[1];
+    char last = hasLast ? cur_[-1] : 0;
+
+    Block &next = blocks_[curIdx_ ^ 1];
+    {
+        // release current block and wait for the next one
+        MonitorLock lock(mon_);
+        cur.ready_ = false;
+        ++requested_;
+        mon_->NotifyAll();
+        while(!next.ready_)
+            mon_->Wait();
+    }
+    if(hasLast)
+        next.data_[0] = last;
+
+    curIdx_ ^= 1;
+    cur_ = &next.data_[1];
+    end_ = cur_ + next.size_;
+    if(!next.error_.empty())
+        ExternalError(next.error_);
+    return cur_ < end_;
+}
+
+//-----------------------------------------------------------------------
+char InReadAheadStm::GetChar()
+{
+    if(cur_ == end_ && !Next())
+        IOError(name_, "read-ahead: end reached");
+    return *cur_++;
+}
+
+//-----------------------------------------------------------------------
+size_t InReadAheadStm::Read(void *buffer, size_t max_cnt)
+{
+    char *cb = reinterpret_cast<char*>(buffer);
+    size_t cnt = 0;
+    while(cnt < max_cnt && (cur_ < end_ || Next()))
+    {
+        size_t n = end_ - cur_;
+        if(n > max_cnt - cnt)
+            n = max_cnt - cnt;
+        memcpy(cb + cnt, cur_, n);
+        cur_ += n;
+        cnt += n;
+    }
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+void InReadAheadStm::UngetChar(char c)
+{
+    if(cur_ == &blocks_[curIdx_].data_[0])
+        IOError(name_, "read-ahead: unget error");
+    *const_cast<char*>(--cur_) = c;
+}
+
+//-----------------------------------------------------------------------
+void InReadAheadStm::Rewind()
+{
+    MonitorLock lock(mon_);
+
+    // wait until background thread is idle
+    while(requested_)
+        mon_->Wait();
+
+    stm_->Rewind();
+    for(int i = 0; i < 2; ++i)
+        blocks_[i].ready_ = blocks_[i].eof_ = false;
+    fillIdx_ = 0;
+    curIdx_ = 1;
+    cur_ = end_ = &blocks_[curIdx_].data_[1];
+    requested_ = 1;
+    mon_->NotifyAll();
+}
+
+//-----------------------------------------------------------------------
+Ptr<InStm> CreateReadAheadStm(InStm *stm, size_t blockSize)
+{
+    return new InReadAheadStm(stm, blockSize);
+}
+
+
+//-----------------------------------------------------------------------
+// PUSH STREAM IMPLEMENTATION
+// Consumed data is dropped lazily, last consumed char is kept for unget.
+//-----------------------------------------------------------------------
+class InPushStmImpl : public InPushStm, Noncopyable
+{
+    String              name_;
+    std::vector<char>   buf_;       // pushed data
+    size_t              pos_;       // read position in buf_
+    bool                finished_;  // no more data will be pushed
+
+    bool HasData() const;
+
+public:
+    explicit InPushStmImpl(const String &uiFileName)
+        : name_(uiFileName), pos_(0), finished_(false) {}
+
+    //virtuals
+    bool        IsEOF() const           {return pos_ == buf_.size() && finished_;}
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind()                {IOError(name_, "push: can't rewind");}
+    String      UIFileName() const      {return name_;}
+
+    void        Push(const void *p, size_t cnt);
+    void        Finish()                {finished_ = true;}
+    size_t      Available() const       {return buf_.size() - pos_;}
+};
+
+//-----------------------------------------------------------------------
+bool InPushStmImpl::HasData() const
+{
+    if(pos_ < buf_.size())
+        return true;
+    if(!finished_)
+        InternalError(__FILE__, __LINE__, "push: data is read before it's pushed");
+    return false;
+}
+
+//-----------------------------------------------------------------------
+char InPushStmImpl::GetChar()
+{
+    if(!HasData())
+        IOError(name_, "push: end reached");
+    return buf_[pos_++];
+}
+
+//-----------------------------------------------------------------------
+size_t InPushStmImpl::Read(void *buffer, size_t max_cnt)
+{
+    if(!max_cnt || !HasData())
+        return 0;
+
+    size_t cnt = buf_.size() - pos_;
+    if(cnt > max_cnt)
+        cnt = max_cnt;
+    memcpy(buffer, &buf_[pos_], cnt);
+    pos_ += cnt;
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+void InPushStmImpl::UngetChar(char c)
+{
+    if(!pos_)
+        IOError(name_, "push: unget char error");
+    buf_[--pos_] = c;
+}
+
+//-----------------------------------------------------------------------
+void InPushStmImpl::Push(const void *p, size_t cnt)
+{
+    const char *cp = reinterpret_cast<const char*>(p);
+
+    if(finished_)
+        IOError(name_, "push: data after end of input");
+
+    // drop consumed data if it takes more than a half of the buffer
+    if(pos_ > 1 && pos_ * 2 >= buf_.size())
+    {
+        buf_.erase(buf_.begin(), buf_.begin() + (pos_ - 1));
+        pos_ = 1;
+    }
+    buf_.insert(buf_.end(), cp, cp + cnt);
+}
+
+//-----------------------------------------------------------------------
+Ptr<InPushStm> CreateInPushStm(const String &uiFileName)
+{
+    return new InPushStmImpl(uiFileName);
+}
+
+
 //-----------------------------------------------------------------------
 // MEMORY INPUT STREAM
 //-----------------------------------------------------------------------
@@ -235,8 +805,7 @@ size_t MemInStm::Read(void *buffer, size_t max_cnt)
     size_t to_copy = max_cnt - cnt;
     if(to_copy > static_cast<size_t>(pend_ - p_))
         to_copy = pend_ - p_;
-    if(!(cnt += to_copy))
-        IOError("memory stream", "end reached");
+    cnt += to_copy;
 
     memcpy(cb, p_, to_copy);
     p_ += to_copy;
@@ -263,7 +832,6 @@ Ptr<InStm> FB2TOEPUB_DECL CreateInMemStm(const void *p, std::size_t size)
 {
     return new MemInStm(reinterpret_cast<const char*>(p), size);
 }
-*/
 
 
 /*
@@ -364,7 +932,11 @@ void OutStmI::VWriteFmt(const char *fmt, va_list ap)
     for(;;)
     {
         // Try to print in the allocated space.
-        int cnt = vsnprintf(&buf[0], size, fmt, ap);
+        // (va_list can't be reused after vsnprintf on some platforms, so work with a copy)
+        va_list ap1;
+        va_copy(ap1, ap);
+        int cnt = vsnprintf(&buf[0], size, fmt, ap1);
+        va_end(ap1);
 
         // If that worked, write string and return.
         if(cnt > -1 && cnt < size)
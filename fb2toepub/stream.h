@@ -64,7 +64,7 @@ public:
         return c;
     }
 };
-class InStm : public InStmI, public Object {};
+class InStm : public Object, public InStmI {};
 
 //-----------------------------------------------------------------------
 // OUTPUT STREAM INTERFACE, OBJECT
@@ -89,7 +89,7 @@ public:
     }
     void VWriteFmt(const char *fmt, va_list ap);
 };
-class OutStm : public OutStmI, public Object {};
+class OutStm : public Object, public OutStmI {};
 
 //-----------------------------------------------------------------------
 // INPUT AND OUTPUT STREAM IMPLEMENTATION FOR FILE
@@ -97,10 +97,46 @@ class OutStm : public OutStmI, public Object {};
 Ptr<InStm> FB2TOEPUB_DECL   CreateInFileStm(const char *name);
 Ptr<OutStm> FB2TOEPUB_DECL  CreateOutFileStm(const char *name);
 
+//-----------------------------------------------------------------------
+// INPUT STREAM FROM MEMORY MAPPED FILE
+// (falls back to CreateInFileStm if the file can't be mapped)
+// If mapped is not NULL, it is set to true if the file is mapped
+//-----------------------------------------------------------------------
+Ptr<InStm> FB2TOEPUB_DECL   CreateInMmapStm(const char *name, bool *mapped = NULL);
+
+//-----------------------------------------------------------------------
+// INPUT STREAM WRAPPER KEEPING ALL DATA READ FROM THE SOURCE STREAM
+// Rewind replays the kept data instead of rewinding the source.
+// Data is kept in memory up to memLimit bytes, then in temporary file.
+//-----------------------------------------------------------------------
+Ptr<InStm> FB2TOEPUB_DECL   CreateSpoolStm(InStm *stm, size_t memLimit);
+
+//-----------------------------------------------------------------------
+// INPUT STREAM WRAPPER READING THE SOURCE STREAM AHEAD IN BACKGROUND THREAD
+// (double buffering, blockSize bytes per block)
+//-----------------------------------------------------------------------
+Ptr<InStm> FB2TOEPUB_DECL   CreateReadAheadStm(InStm *stm, size_t blockSize);
+
+//-----------------------------------------------------------------------
+// INPUT STREAM FED BY THE CALLER IN CHUNKS (PUSH MODE)
+// Reading more than Available() before Finish is an error, the reader
+// should wait for more data instead. Consumed data is dropped, so Rewind
+// isn't supported (wrap it by CreateSpoolStm to read the input twice).
+//-----------------------------------------------------------------------
+class InPushStm : public InStm
+{
+public:
+    virtual void    Push(const void *p, size_t cnt) = 0;    // append next chunk
+    virtual void    Finish()                        = 0;    // end of input
+    virtual size_t  Available() const               = 0;    // size of pushed data not read yet
+};
+
+Ptr<InPushStm> FB2TOEPUB_DECL   CreateInPushStm(const String &uiFileName);
+
 //-----------------------------------------------------------------------
 // INPUT STREAM FROM MEMORY
 //-----------------------------------------------------------------------
-//Ptr<InStm> FB2TOEPUB_DECL   CreateInMemStm(const void *p, std::size_t size);
+Ptr<InStm> FB2TOEPUB_DECL   CreateInMemStm(const void *p, std::size_t size);
 
 //-----------------------------------------------------------------------
 // INPUT STREAM WRAPPER WITH INFINITE UNGET
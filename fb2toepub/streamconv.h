@@ -33,8 +33,9 @@ Ptr<InStm> FB2TOEPUB_DECL CreateInConvStm(InStm *stm, const char* tocode, const
 
 //-----------------------------------------------------------------------
 // INPUT STREAM WITH CONVERSION TO UTF-8
+// If converted is not NULL, it is set to true if input is not UTF-8
 //-----------------------------------------------------------------------
-Ptr<InStm> FB2TOEPUB_DECL CreateInUnicodeStm(InStm *stm);
+Ptr<InStm> FB2TOEPUB_DECL CreateInUnicodeStm(InStm *stm, bool *converted = NULL);
 
 
 };  //namespace Fb2ToEpub
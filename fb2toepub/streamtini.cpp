@@ -22,6 +22,7 @@
 #include "hdr.h"
 
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <ctype.h>
 #include "streamconv.h"
@@ -40,9 +41,10 @@ class FB2TOEPUB_DECL ConvTini : Noncopyable
     ::tiniconv_ctx_s ctx_;
 
     typedef std::pair<String, int> TblEntry;
-    static int EncToCharset(String code);
 
 public:
+    static int EncToCharset(String code);
+
     ConvTini(const char* tocode, const char* fromcode, bool translit = true, bool ignore = true);
 
     bool Convert (const char* * inbuf, size_t *inbytesleft, char* * outbuf, size_t *outbytesleft);
@@ -198,23 +200,27 @@ int ConvTini::EncToCharset(String code)
 
 //-----------------------------------------------------------------------
 // stream converter buffer sizes
-const size_t IN_CONVBUF_SIZE = 256;
-const size_t OUT_CONVBUF_SIZE = 512;
+const size_t IN_CONVBUF_SIZE    = FB2TOEPUB_CONV_BUFFER_SIZE;
+const size_t OUT_CONVBUF_SIZE   = 2*FB2TOEPUB_CONV_BUFFER_SIZE;
+const size_t IN_CONVBUF_REST    = 16;   // unconverted input rest which is enough for any codesymbol
 
 //-----------------------------------------------------------------------
 // InConvStmTini implementation
 //-----------------------------------------------------------------------
 class InConvStmTini : public InStm, Noncopyable
 {
-    Ptr<InStm>          stm_;                       // input stream
-    mutable ConvTini    conv_;                      // converter
-    mutable char        ibuf_[IN_CONVBUF_SIZE];     // input buffer
-    mutable char        *iend_;                     // input buffer unconverted data end
-    mutable char        obuf_[OUT_CONVBUF_SIZE];    // output buffer
-    mutable char        *ocur_;                     // output buffer current position
-    mutable char        *oend_;                     // output buffer concerted data end
-
-    size_t Fill() const;
+    Ptr<InStm>                  stm_;       // input stream
+    mutable ConvTini            conv_;      // converter
+    mutable std::vector<char>   ibuf_;      // input buffer
+    mutable char                *icur_;     // input buffer unconverted data begin
+    mutable char                *iend_;     // input buffer unconverted data end
+    mutable std::vector<char>   obuf_;      // output buffer (obuf_[0] is reserved for unget)
+    mutable char                *ocur_;     // output buffer current position
+    mutable char                *oend_;     // output buffer converted data end
+
+    bool    ReadInput() const;
+    size_t  ConvertTo(char *out, size_t size) const;
+    size_t  Fill() const;
 
 public:
     InConvStmTini(InStm *stm, const char* tocode, const char* fromcode);
@@ -232,44 +238,65 @@ public:
 InConvStmTini::InConvStmTini(InStm *stm, const char* tocode, const char* fromcode)
                             :   stm_(stm),
                                 conv_(tocode, fromcode),
-                                iend_(ibuf_),
-                                ocur_(obuf_),
-                                oend_(obuf_)
+                                ibuf_(IN_CONVBUF_SIZE),
+                                obuf_(1 + OUT_CONVBUF_SIZE)
 {
+    icur_ = iend_ = &ibuf_[0];
+    ocur_ = oend_ = &obuf_[1];
 }
 
 //-----------------------------------------------------------------------
-bool InConvStmTini::IsEOF() const
+bool InConvStmTini::ReadInput() const
 {
-    return (ocur_ == oend_) && (stm_->IsEOF() || !Fill());
+    size_t left = iend_ - icur_;
+    if(left >= IN_CONVBUF_REST)
+        return true;
+
+    // move small unconverted rest to beginning and read next data block
+    if(left)
+        ::memmove(&ibuf_[0], icur_, left);
+    icur_ = &ibuf_[0];
+    iend_ = icur_ + left;
+    if(!stm_->IsEOF())
+        iend_ += stm_->Read(iend_, ibuf_.size() - left);
+    return iend_ > icur_;
 }
 
 //-----------------------------------------------------------------------
-size_t InConvStmTini::Fill() const
+size_t InConvStmTini::ConvertTo(char *out, size_t size) const
 {
-    // fix output pointers
-    ocur_ = oend_ = obuf_;
-
-    // read data to input buffer
-    iend_ += stm_->Read(iend_, ibuf_ + sizeof(ibuf_) - iend_);
-    size_t inleft  = iend_ - ibuf_;
-    if(!inleft)
-        return 0;
-
-    // convert data
-    const char  *pi = ibuf_;
-    size_t outleft = sizeof(obuf_);
-    if(!conv_.Convert(&pi, &inleft, &oend_, &outleft))
-        IOError(UIFileName(), "tiniconv: invalid codesymbol");
+    char *po = out, *pend = out + size;
+    while(po < pend && ReadInput())
+    {
+        const char *pi = icur_, *po_start = po;
+        size_t inleft = iend_ - icur_, outleft = pend - po;
+        if(!conv_.Convert(&pi, &inleft, &po, &outleft))
+            IOError(UIFileName(), "tiniconv: invalid codesymbol");
+        if(pi == icur_ && po == po_start)
+            break;  // incomplete codesymbol at the end or no room for output
+        icur_ = const_cast<char*>(pi);
+    }
+    return po - out;
+}
 
-    // fix input data and pointers
-    iend_ = ibuf_ + inleft;
-    if(inleft)
-        ::memmove(ibuf_, pi, inleft);   // move unconverted rest to beginning
+//-----------------------------------------------------------------------
+size_t InConvStmTini::Fill() const
+{
+    // keep last char to make unget possible
+    if(ocur_ > &obuf_[1])
+        obuf_[0] = ocur_[-1];
 
+    ocur_ = &obuf_[1];
+    oend_ = ocur_ + ConvertTo(ocur_, obuf_.size() - 1);
     return oend_ - ocur_;
 }
 
+//-----------------------------------------------------------------------
+bool InConvStmTini::IsEOF() const
+{
+    return (ocur_ == oend_) && !Fill();
+}
+
 //-----------------------------------------------------------------------
 char InConvStmTini::GetChar()
 {
@@ -282,29 +309,46 @@ char InConvStmTini::GetChar()
 size_t InConvStmTini::Read(void *buffer, size_t max_cnt)
 {
     char *pc = reinterpret_cast<char*> (buffer);
-    for (size_t cnt = 0; cnt < max_cnt;)
+    size_t cnt = 0;
+    while(cnt < max_cnt)
     {
         size_t num_to_copy = oend_ - ocur_;
-        if (num_to_copy <= 0 && (num_to_copy = Fill ()) == 0)
-            return cnt;
-        if (num_to_copy > max_cnt - cnt)
+        if(!num_to_copy)
+        {
+            // large request - convert directly to the caller buffer
+            if(max_cnt - cnt >= obuf_.size() - 1)
+            {
+                size_t num_conv = ConvertTo(pc, max_cnt - cnt);
+                if(num_conv)
+                {
+                    obuf_[0] = pc[num_conv-1];  // keep last char to make unget possible
+                    ocur_ = oend_ = &obuf_[1];
+                    pc  += num_conv;
+                    cnt += num_conv;
+                    continue;
+                }
+            }
+            if((num_to_copy = Fill()) == 0)
+                break;
+        }
+        if(num_to_copy > max_cnt - cnt)
             num_to_copy = max_cnt - cnt;
 
-        ::memcpy (pc, ocur_, num_to_copy);
+        ::memcpy(pc, ocur_, num_to_copy);
 
         pc      += num_to_copy;
         ocur_   += num_to_copy;
         cnt     += num_to_copy;
     }
-    return max_cnt;
+    return cnt;
 }
 
 //-----------------------------------------------------------------------
 void InConvStmTini::UngetChar(char c)
 {
-    if(ocur_ == obuf_)
+    if(ocur_ == &obuf_[0])
         IOError(UIFileName(), "tiniconv: can't unget");
-    --ocur_;
+    *--ocur_ = c;
 }
 
 //-----------------------------------------------------------------------
@@ -312,8 +356,220 @@ void InConvStmTini::Rewind()
 {
     stm_->Rewind();
     conv_.Reset();
-    iend_ = ibuf_;
-    ocur_ = oend_ = obuf_;
+    icur_ = iend_ = &ibuf_[0];
+    ocur_ = oend_ = &obuf_[1];
+}
+
+
+//-----------------------------------------------------------------------
+// SINGLE-BYTE CHARSET TO UTF-8 CONVERTER
+//-----------------------------------------------------------------------
+static bool IsSingleByteCharset(int charset)
+{
+    // stateless single-byte charsets (CP1255 and CP1258 compose combining characters)
+    switch(charset)
+    {
+    case TINICONV_CHARSET_ASCII:
+    case TINICONV_CHARSET_CP1250:
+    case TINICONV_CHARSET_CP1251:
+    case TINICONV_CHARSET_CP1252:
+    case TINICONV_CHARSET_CP1253:
+    case TINICONV_CHARSET_CP1254:
+    case TINICONV_CHARSET_CP1256:
+    case TINICONV_CHARSET_CP1257:
+    case TINICONV_CHARSET_ISO_8859_1:
+    case TINICONV_CHARSET_ISO_8859_2:
+    case TINICONV_CHARSET_ISO_8859_3:
+    case TINICONV_CHARSET_ISO_8859_4:
+    case TINICONV_CHARSET_ISO_8859_5:
+    case TINICONV_CHARSET_ISO_8859_6:
+    case TINICONV_CHARSET_ISO_8859_7:
+    case TINICONV_CHARSET_ISO_8859_8:
+    case TINICONV_CHARSET_ISO_8859_9:
+    case TINICONV_CHARSET_ISO_8859_10:
+#if !defined(TINICONV_NO_ASIAN_ENCODINGS)
+    case TINICONV_CHARSET_ISO_8859_11:
+#endif
+    case TINICONV_CHARSET_ISO_8859_13:
+    case TINICONV_CHARSET_ISO_8859_14:
+    case TINICONV_CHARSET_ISO_8859_15:
+    case TINICONV_CHARSET_ISO_8859_16:
+    case TINICONV_CHARSET_CP866:
+    case TINICONV_CHARSET_KOI8_R:
+    case TINICONV_CHARSET_KOI8_RU:
+    case TINICONV_CHARSET_KOI8_U:
+    case TINICONV_CHARSET_MACCYRILLIC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+//-----------------------------------------------------------------------
+class InConvStmSingleByte : public InStm, Noncopyable
+{
+    // UTF-8 sequence for single byte (len_ == 0 if byte is invalid)
+    struct Entry
+    {
+        char            s_[3];
+        unsigned char   len_;
+    };
+
+    Ptr<InStm>                  stm_;       // input stream
+    Entry                       table_[256];// conversion table
+    mutable std::vector<char>   ibuf_;      // input buffer
+    mutable std::vector<char>   obuf_;      // output buffer (obuf_[0] is reserved for unget)
+    mutable char                *ocur_;     // output buffer current position
+    mutable char                *oend_;     // output buffer converted data end
+
+    char*   Convert(const char *in, size_t cnt, char *out) const;
+    size_t  Fill() const;
+
+public:
+    InConvStmSingleByte(InStm *stm, int charset);
+
+    //virtuals
+    bool        IsEOF() const;
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind();
+    String      UIFileName() const {return stm_->UIFileName();}
+};
+
+//-----------------------------------------------------------------------
+InConvStmSingleByte::InConvStmSingleByte(InStm *stm, int charset)
+                            :   stm_(stm),
+                                ibuf_(IN_CONVBUF_SIZE),
+                                obuf_(1 + 3*IN_CONVBUF_SIZE)
+{
+    ocur_ = oend_ = &obuf_[1];
+
+    // build conversion table using tiniconv
+    ::tiniconv_ctx_s ctx;
+    if(::tiniconv_init(charset, TINICONV_CHARSET_UFT_8, 0, &ctx) != TINICONV_INIT_OK)
+        ExternalError("tiniconv_init error");
+    for(int i = 0; i < 256; ++i)
+    {
+        unsigned char in = static_cast<unsigned char>(i), out[8];
+        int in_consumed = 0, out_consumed = 0;
+        int ret = ::tiniconv_convert(&ctx, &in, 1, &in_consumed, out, sizeof(out), &out_consumed);
+        Entry &e = table_[i];
+        e.s_[0] = e.s_[1] = e.s_[2] = 0;
+        e.len_ = 0;
+        if(ret == TINICONV_CONVERT_OK && in_consumed == 1 && out_consumed > 0 && out_consumed <= 3)
+        {
+            memcpy(e.s_, out, out_consumed);
+            e.len_ = static_cast<unsigned char>(out_consumed);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------
+// Convert input bytes, out should have room for 3*cnt bytes
+char* InConvStmSingleByte::Convert(const char *in, size_t cnt, char *out) const
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(in), *p_end = p + cnt;
+    for(; p < p_end; ++p)
+    {
+        const Entry &e = table_[*p];
+        if(e.len_ == 1)
+        {
+            *out++ = e.s_[0];
+            continue;
+        }
+        if(!e.len_)
+            IOError(UIFileName(), "tiniconv: invalid codesymbol");
+        out[0] = e.s_[0];
+        if(e.len_ > 1)
+        {
+            out[1] = e.s_[1];
+            out[2] = e.s_[2];
+        }
+        out += e.len_;
+    }
+    return out;
+}
+
+//-----------------------------------------------------------------------
+size_t InConvStmSingleByte::Fill() const
+{
+    // keep last char to make unget possible
+    if(ocur_ > &obuf_[1])
+        obuf_[0] = ocur_[-1];
+    ocur_ = oend_ = &obuf_[1];
+
+    if(stm_->IsEOF())
+        return 0;
+    oend_ = Convert(&ibuf_[0], stm_->Read(&ibuf_[0], ibuf_.size()), ocur_);
+    return oend_ - ocur_;
+}
+
+//-----------------------------------------------------------------------
+bool InConvStmSingleByte::IsEOF() const
+{
+    return (ocur_ == oend_) && !Fill();
+}
+
+//-----------------------------------------------------------------------
+char InConvStmSingleByte::GetChar()
+{
+    if(ocur_ == oend_ && !Fill())
+        IOError(UIFileName(), "tiniconv: EOF");
+    return *ocur_++;
+}
+
+//-----------------------------------------------------------------------
+size_t InConvStmSingleByte::Read(void *buffer, size_t max_cnt)
+{
+    char *pc = reinterpret_cast<char*> (buffer);
+    size_t cnt = 0;
+    while(cnt < max_cnt)
+    {
+        size_t num_to_copy = oend_ - ocur_;
+        if(!num_to_copy)
+        {
+            // large request - convert directly to the caller buffer
+            size_t rest = max_cnt - cnt;
+            if(rest >= 3*ibuf_.size() && !stm_->IsEOF())
+            {
+                char *pend = Convert(&ibuf_[0], stm_->Read(&ibuf_[0], ibuf_.size()), pc);
+                if(pend == pc)
+                    break;
+                obuf_[0] = pend[-1];    // keep last char to make unget possible
+                ocur_ = oend_ = &obuf_[1];
+                cnt += pend - pc;
+                pc = pend;
+                continue;
+            }
+            if((num_to_copy = Fill()) == 0)
+                break;
+        }
+        if(num_to_copy > max_cnt - cnt)
+            num_to_copy = max_cnt - cnt;
+
+        ::memcpy(pc, ocur_, num_to_copy);
+
+        pc      += num_to_copy;
+        ocur_   += num_to_copy;
+        cnt     += num_to_copy;
+    }
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+void InConvStmSingleByte::UngetChar(char c)
+{
+    if(ocur_ == &obuf_[0])
+        IOError(UIFileName(), "tiniconv: can't unget");
+    *--ocur_ = c;
+}
+
+//-----------------------------------------------------------------------
+void InConvStmSingleByte::Rewind()
+{
+    stm_->Rewind();
+    ocur_ = oend_ = &obuf_[1];
 }
 
 
@@ -321,6 +577,11 @@ void InConvStmTini::Rewind()
 //-----------------------------------------------------------------------
 Ptr<InStm> CreateInConvStm(InStm *stm, const char* tocode, const char* fromcode)
 {
+    // fast table conversion of single-byte charsets to UTF-8
+    int charset = ConvTini::EncToCharset(fromcode);
+    if(IsSingleByteCharset(charset) && ConvTini::EncToCharset(tocode) == TINICONV_CHARSET_UFT_8)
+        return new InConvStmSingleByte(stm, charset);
+
     return new InConvStmTini(stm, tocode, fromcode);
 }
 
@@ -23,42 +23,750 @@
 #include <string.h>
 #include <string>
 #include <algorithm>
+#include <vector>
+#include <sstream>
 #include <ctype.h>
 #include "streamconv.h"
-#include "scanner.h"
+#include "error.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FB2TOEPUB_UNICODE_SSE2
+#endif
 
 
 namespace Fb2ToEpub
 {
 
 //-----------------------------------------------------------------------
+// XML PROLOG SNIFFER
+//-----------------------------------------------------------------------
+const std::size_t PROLOG_SIZE = 1024;   // enough for XML declaration even in UTF-32
+
+struct PrologInfo
+{
+    const char  *rough_;    // encoding detected by byte order mark or first bytes
+    std::size_t width_;     // code unit size (1, 2 or 4), 0 if not ASCII-compatible
+    bool        be_;        // big endian code units
+};
+
+//-----------------------------------------------------------------------
+static bool RoughEncoding(const unsigned char *p, std::size_t len, PrologInfo *info)
+{
+    // byte order marks and typical first bytes of XML document (see XML 1.0, appendix F)
+    static const struct
+    {
+        unsigned char   sig_[4];
+        std::size_t     siglen_;
+        const char      *enc_;
+        std::size_t     width_;
+        bool            be_;
+    } table[] =
+    {
+        {{0x00, 0x00, 0xFE, 0xFF},  4, "UTF-32BE",      4, true},
+        {{0xFF, 0xFE, 0x00, 0x00},  4, "UTF-32LE",      4, false},
+        {{0x00, 0x00, 0x00, '<'},   4, "UTF-32BE",      4, true},
+        {{'<',  0x00, 0x00, 0x00},  4, "UTF-32LE",      4, false},
+        {{0xFE, 0xFF},              2, "UTF-16BE",      2, true},
+        {{0xFF, 0xFE},              2, "UTF-16LE",      2, false},
+        {{0x00, '<',  0x00, '?'},   4, "UTF-16BE",      2, true},
+        {{'<',  0x00, '?',  0x00},  4, "UTF-16LE",      2, false},
+        {{0xEF, 0xBB, 0xBF},        3, "UTF-8",         1, false},
+        {{'<'},                     1, "UTF-8",         1, false},     // temporary assume UTF-8 XML
+        {{0x0E, 0xFE, 0xFF},        3, "SCSU",          0, false},
+        {{0x2B, 0x2F, 0x76},        3, "UTF-7",         0, false},
+        {{0x84, 0x31, 0x95, 0x33},  4, "GB-18030",      0, false},
+        {{0xDD, 0x73, 0x66, 0x73},  4, "UTF-EBCDIC",    0, false},
+        {{0xF7, 0x64, 0x4C},        3, "UTF-1",         0, false},
+        {{0xFB, 0xEE, 0x28},        3, "BOCU-1",        0, false},
+    };
+
+    for(std::size_t i = 0; i < sizeof(table)/sizeof(table[0]); ++i)
+        if(len >= table[i].siglen_ && !memcmp(p, table[i].sig_, table[i].siglen_))
+        {
+            info->rough_    = table[i].enc_;
+            info->width_    = table[i].width_;
+            info->be_       = table[i].be_;
+            return true;
+        }
+    return false;
+}
+
+//-----------------------------------------------------------------------
+// Get ASCII prolog text (stop at first non-ASCII character)
+static String PrologText(const unsigned char *p, std::size_t len, const PrologInfo &info)
+{
+    const std::size_t w = info.width_;
+
+    // skip byte order mark
+    if(w == 1 && len >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF)
+    {
+        p += 3;
+        len -= 3;
+    }
+    else if(w > 1 && (p[0] == 0xFE || p[0] == 0xFF || p[w-1] == 0xFE || p[w-1] == 0xFF))
+    {
+        p += w;
+        len -= w;
+    }
+
+    String s;
+    for(; len >= w; p += w, len -= w)
+    {
+        unsigned long c = 0;
+        for(std::size_t i = 0; i < w; ++i)
+            c = (c << 8) | p[info.be_ ? i : w - 1 - i];
+        if(c == 0 || c >= 0x80)
+            break;
+        s += static_cast<char>(c);
+    }
+    return s;
+}
+
+//-----------------------------------------------------------------------
+inline bool IsXmlSpace(char c) {return c == ' ' || c == '\t' || c == '\r' || c == '\n';}
+
+//-----------------------------------------------------------------------
+// Find encoding pseudo-attribute of <?xml version="1.0" encoding="..."?>
+static bool PrologEncoding(const String &s, String *encoding)
+{
+    if(s.compare(0, 5, "<?xml") || s.length() < 6 || !IsXmlSpace(s[5]))
+        return false;
+
+    std::size_t i = 5, len = s.length();
+    for(;;)
+    {
+        while(i < len && IsXmlSpace(s[i]))
+            ++i;
+        if(i >= len || s[i] == '?')
+            return false;
+
+        // name
+        std::size_t nbeg = i;
+        while(i < len && s[i] != '=' && !IsXmlSpace(s[i]) && s[i] != '?')
+            ++i;
+        String name = s.substr(nbeg, i - nbeg);
+
+        // '='
+        while(i < len && IsXmlSpace(s[i]))
+            ++i;
+        if(i >= len || s[i++] != '=')
+            return false;
+        while(i < len && IsXmlSpace(s[i]))
+            ++i;
+
+        // value
+        if(i >= len || (s[i] != '"' && s[i] != '\''))
+            return false;
+        char q = s[i++];
+        std::size_t vbeg = i;
+        while(i < len && s[i] != q)
+            ++i;
+        if(i >= len)
+            return false;
+        if(name == "encoding")
+        {
+            *encoding = s.substr(vbeg, i - vbeg);
+            return true;
+        }
+        ++i;
+    }
+}
+
+//-----------------------------------------------------------------------
+// Remove all non digits and letters, convert to uppercase
+static String NormEncName(const String &encoding)
+{
+    String s;
+    for(String::const_iterator cit = encoding.begin(), cit_end = encoding.end(); cit != cit_end; ++cit)
+        if(isalnum(static_cast<unsigned char>(*cit)))
+            s += static_cast<char>(toupper(static_cast<unsigned char>(*cit)));
+    return s;
+}
+
+//-----------------------------------------------------------------------
+// Detect encoding by first bytes of XML document
+static String SniffEncoding(const unsigned char *p, std::size_t len, const String &uiname)
+{
+    PrologInfo info = {NULL, 0, false};
+    if(!RoughEncoding(p, len, &info))
+        IOError(uiname, "bad XML or unknown encoding");
+    if(!info.width_)
+        return info.rough_;     // not ASCII-compatible, no way to refine
+
+    // refine the encoding by XML declaration
+    String encoding;
+    if(!PrologEncoding(PrologText(p, len, info), &encoding))
+        return info.rough_;     // no encoding - UTF-8 or UTF-16/32 according to byte order mark
+    String norm = NormEncName(encoding);
+    if(norm == "UTF8")
+        return "UTF-8";
+    if(info.width_ == 2 && (!norm.compare(0, 5, "UTF16") || !norm.compare(0, 4, "UCS2")))
+        return info.rough_;     // byte order is defined by byte order mark or first bytes
+    return encoding;
+}
+
+//-----------------------------------------------------------------------
+// INPUT STREAM WITH PEEKED PROLOG
+//-----------------------------------------------------------------------
+class InPrologStm : public InStm, Noncopyable
+{
+    Ptr<InStm>  stm_;
+    char        buf_[PROLOG_SIZE];
+    char        *cur_, *end_;
+    bool        inStm_;     // prolog buffer is passed, read directly from underlying stream
+
+public:
+    explicit InPrologStm(InStm *stm);
+
+    const unsigned char* Prolog() const             {return reinterpret_cast<const unsigned char*>(buf_);}
+    std::size_t PrologSize() const                  {return end_ - buf_;}
+
+    //virtuals
+    bool        IsEOF() const                       {return cur_ == end_ && stm_->IsEOF();}
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind();
+    String      UIFileName() const                  {return stm_->UIFileName();}
+};
+
+//-----------------------------------------------------------------------
+InPrologStm::InPrologStm(InStm *stm) : stm_(stm), cur_(buf_), end_(buf_), inStm_(false)
+{
+    while(end_ < buf_ + sizeof(buf_) && !stm_->IsEOF())
+        end_ += stm_->Read(end_, buf_ + sizeof(buf_) - end_);
+}
+
+//-----------------------------------------------------------------------
+char InPrologStm::GetChar()
+{
+    if(cur_ < end_)
+        return *cur_++;
+    inStm_ = true;
+    return stm_->GetChar();
+}
+
+//-----------------------------------------------------------------------
+size_t InPrologStm::Read(void *buffer, size_t max_cnt)
+{
+    size_t cnt = end_ - cur_;
+    if(cnt > max_cnt)
+        cnt = max_cnt;
+    memcpy(buffer, cur_, cnt);
+    cur_ += cnt;
+    if(cnt < max_cnt && !stm_->IsEOF())
+    {
+        inStm_ = true;
+        cnt += stm_->Read(reinterpret_cast<char*>(buffer) + cnt, max_cnt - cnt);
+    }
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+void InPrologStm::UngetChar(char c)
+{
+    if(inStm_)
+        stm_->UngetChar(c);
+    else if(cur_ > buf_)
+        *--cur_ = c;
+    else
+        IOError(stm_->UIFileName(), "ungetc error");
+}
+
+//-----------------------------------------------------------------------
+void InPrologStm::Rewind()
+{
+    // underlying stream starts from the beginning, prolog buffer is not needed any more
+    stm_->Rewind();
+    cur_ = end_ = buf_;
+    inStm_ = true;
+}
+
+//-----------------------------------------------------------------------
+// INPUT UTF-8 VALIDATING STREAM
+//-----------------------------------------------------------------------
+const std::size_t UTF8_BLOCK_SIZE = 0x10000;
+
+//-----------------------------------------------------------------------
+// Skip ASCII characters
+static inline const unsigned char* SkipAscii(const unsigned char *p, const unsigned char *end)
+{
+#if defined(FB2TOEPUB_UNICODE_SSE2)
+    for(; end - p >= 16; p += 16)
+        if(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))))
+            break;
+#endif
+    while(p < end && *p < 0x80)
+        ++p;
+    return p;
+}
+
+//-----------------------------------------------------------------------
+// Check UTF-8 sequence starting with non-ASCII byte.
+// Returns: >0 - length of valid sequence,
+//           0 - sequence is incomplete (truncated by end),
+//          <0 - negated length of invalid sequence (maximal subpart).
+static inline int CheckUtf8Seq(const unsigned char *p, const unsigned char *end)
+{
+    unsigned char c = *p;
+    int len;
+    unsigned char lo = 0x80, hi = 0xBF;     // second byte range
+    if(c < 0xC2)
+        return -1;
+    else if(c < 0xE0)
+        len = 2;
+    else if(c < 0xF0)
+    {
+        len = 3;
+        if(c == 0xE0)
+            lo = 0xA0;      // overlong
+        else if(c == 0xED)
+            hi = 0x9F;      // surrogates
+    }
+    else if(c < 0xF5)
+    {
+        len = 4;
+        if(c == 0xF0)
+            lo = 0x90;      // overlong
+        else if(c == 0xF4)
+            hi = 0x8F;      // above U+10FFFF
+    }
+    else
+        return -1;
+
+    for(int i = 1; i < len; ++i)
+    {
+        if(p + i >= end)
+            return 0;
+        unsigned char cc = p[i];
+        if(cc < lo || cc > hi)
+            return -i;
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return len;
+}
+
+//-----------------------------------------------------------------------
+class InStmUtf8Check : public InStm, Noncopyable
+{
+    Ptr<InStm>                  stm_;
+    bool                        replace_;   // replace invalid sequences, otherwise error
+    mutable std::vector<char>   ibuf_;      // input data
+    mutable std::vector<char>   obuf_;      // output data (only if replacements are made)
+    mutable const char          *cur_, *end_;   // current output data
+    mutable std::size_t         carryPos_, carryLen_;   // incomplete sequence at the end of input data
+    mutable std::size_t         offset_;    // input offset of ibuf_ beginning
+    mutable int                 c_;         // last buffered character
+
+    bool Fill() const;
+    void Invalid(std::size_t pos) const;
+
+public:
+    InStmUtf8Check(InStm *stm, bool replace);
+
+    //virtuals
+    bool        IsEOF() const;
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind();
+    String      UIFileName() const                  {return stm_->UIFileName();}
+};
+
+//-----------------------------------------------------------------------
+InStmUtf8Check::InStmUtf8Check(InStm *stm, bool replace)
+                        :   stm_(stm),
+                            replace_(replace),
+                            ibuf_(UTF8_BLOCK_SIZE),
+                            cur_(NULL),
+                            end_(NULL),
+                            carryPos_(0),
+                            carryLen_(0),
+                            offset_(0),
+                            c_(EOF)
+{
+}
+
+//-----------------------------------------------------------------------
+void InStmUtf8Check::Invalid(std::size_t pos) const
+{
+    std::ostringstream ss;
+    ss << "invalid UTF-8 sequence at offset " << offset_ + pos;
+    IOError(stm_->UIFileName(), ss.str());
+}
+
+//-----------------------------------------------------------------------
+bool InStmUtf8Check::Fill() const
+{
+    for(;;)
+    {
+        // move incomplete sequence to the beginning and read next block
+        offset_ += carryPos_;
+        if(carryLen_)
+            memmove(&ibuf_[0], &ibuf_[carryPos_], carryLen_);
+        std::size_t n = carryLen_;
+        if(!stm_->IsEOF())
+            n += stm_->Read(&ibuf_[n], ibuf_.size() - n);
+        bool eof = stm_->IsEOF();
+        if(!n)
+        {
+            carryPos_ = carryLen_ = 0;
+            return false;
+        }
+
+        const unsigned char *in = reinterpret_cast<const unsigned char*>(&ibuf_[0]);
+        const unsigned char *p = in, *e = in + n;
+        std::size_t done = 0;   // input bytes already moved to output buffer
+        char *o = NULL;
+        for(;;)
+        {
+            p = SkipAscii(p, e);
+            if(p >= e)
+                break;
+            int len = CheckUtf8Seq(p, e);
+            if(len > 0)
+            {
+                p += len;
+                continue;
+            }
+            if(!len)
+            {
+                if(!eof)
+                    break;      // wait for the rest of sequence
+                len = -static_cast<int>(e - p);
+            }
+
+            // invalid sequence
+            if(!replace_)
+                Invalid(p - in);
+            if(!o)
+            {
+                obuf_.resize(ibuf_.size() * 3);
+                o = &obuf_[0];
+            }
+            std::size_t valid = (p - in) - done;
+            memcpy(o, in + done, valid);
+            o += valid;
+            *o++ = '\xEF';     // U+FFFD
+            *o++ = '\xBF';
+            *o++ = '\xBD';
+            p -= len;
+            done = p - in;
+        }
+
+        carryPos_ = p - in;
+        carryLen_ = n - carryPos_;
+        if(o)
+        {
+            std::size_t valid = carryPos_ - done;
+            memcpy(o, in + done, valid);
+            cur_ = &obuf_[0];
+            end_ = o + valid;
+        }
+        else
+        {
+            cur_ = &ibuf_[0];
+            end_ = cur_ + carryPos_;
+        }
+        if(cur_ < end_)
+            return true;
+    }
+}
+
+//-----------------------------------------------------------------------
+bool InStmUtf8Check::IsEOF() const
+{
+    return c_ == EOF && cur_ == end_ && !Fill();
+}
+
+//-----------------------------------------------------------------------
+char InStmUtf8Check::GetChar()
+{
+    if(c_ != EOF)
+    {
+        char cret = static_cast<char>(c_);
+        c_ = EOF;
+        return cret;
+    }
+    if(cur_ == end_ && !Fill())
+        IOError(stm_->UIFileName(), "UTF-8 stream: end reached");
+    return *cur_++;
+}
+
+//-----------------------------------------------------------------------
+size_t InStmUtf8Check::Read(void *buffer, size_t max_cnt)
+{
+    char *cb = reinterpret_cast<char*>(buffer);
+    size_t cnt = 0;
+    if(max_cnt && c_ != EOF)
+    {
+        *cb++ = static_cast<char>(c_);
+        c_ = EOF;
+        ++cnt;
+    }
+    while(cnt < max_cnt && (cur_ < end_ || Fill()))
+    {
+        size_t n = end_ - cur_;
+        if(n > max_cnt - cnt)
+            n = max_cnt - cnt;
+        memcpy(cb, cur_, n);
+        cur_ += n;
+        cb += n;
+        cnt += n;
+    }
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+void InStmUtf8Check::UngetChar(char c)
+{
+    if(c_ != EOF)
+        IOError(stm_->UIFileName(), "UTF-8 stream: ungetc error");
+    c_ = static_cast<unsigned char>(c);
+}
+
+//-----------------------------------------------------------------------
+void InStmUtf8Check::Rewind()
+{
+    stm_->Rewind();
+    cur_ = end_ = NULL;
+    carryPos_ = carryLen_ = offset_ = 0;
+    c_ = EOF;
+}
+
+//-----------------------------------------------------------------------
+// INPUT UTF-16 TO UTF-8 CONVERTING STREAM
+//-----------------------------------------------------------------------
+class InStmUtf16 : public InStm, Noncopyable
+{
+    Ptr<InStm>                  stm_;       // input stream
+    bool                        be_;        // big endian
+    mutable std::vector<char>   ibuf_;      // input buffer
+    mutable char                *icur_;     // input buffer unconverted data begin
+    mutable char                *iend_;     // input buffer unconverted data end
+    mutable std::vector<char>   obuf_;      // output buffer (obuf_[0] is reserved for unget)
+    mutable char                *ocur_;     // output buffer current position
+    mutable char                *oend_;     // output buffer converted data end
+
+    bool    ReadInput() const;
+    char*   Convert(const unsigned char **pp, const unsigned char *end, char *out) const;
+    size_t  ConvertTo(char *out, size_t size) const;
+    size_t  Fill() const;
+
+public:
+    InStmUtf16(InStm *stm, bool be);
+
+    //virtuals
+    bool        IsEOF() const;
+    char        GetChar();
+    size_t      Read(void *buffer, size_t max_cnt);
+    void        UngetChar(char c);
+    void        Rewind();
+    String      UIFileName() const {return stm_->UIFileName();}
+};
+
+//-----------------------------------------------------------------------
+InStmUtf16::InStmUtf16(InStm *stm, bool be)
+                        :   stm_(stm),
+                            be_(be),
+                            ibuf_(FB2TOEPUB_CONV_BUFFER_SIZE),
+                            obuf_(1 + 3*(FB2TOEPUB_CONV_BUFFER_SIZE/2) + 4)
+{
+    icur_ = iend_ = &ibuf_[0];
+    ocur_ = oend_ = &obuf_[1];
+}
+
+//-----------------------------------------------------------------------
+bool InStmUtf16::ReadInput() const
+{
+    size_t left = iend_ - icur_;
+    if(left >= 4)
+        return true;
+
+    // move incomplete surrogate pair to beginning and read next data block
+    if(left)
+        ::memmove(&ibuf_[0], icur_, left);
+    icur_ = &ibuf_[0];
+    iend_ = icur_ + left;
+    if(!stm_->IsEOF())
+        iend_ += stm_->Read(iend_, ibuf_.size() - left);
+    return iend_ > icur_;
+}
+
 //-----------------------------------------------------------------------
+// Convert complete code units of [*pp, end), out should have room for 3/2 of input size
+char* InStmUtf16::Convert(const unsigned char **pp, const unsigned char *end, char *out) const
+{
+    const unsigned char *p = *pp;
+    const int hi = be_ ? 0 : 1, lo = 1 - hi;
+#if defined(FB2TOEPUB_UNICODE_SSE2)
+    const __m128i ascii_mask = _mm_set1_epi16(static_cast<short>(0xFF80)), zero = _mm_setzero_si128();
+#endif
+
+    while(end - p >= 2)
+    {
+#if defined(FB2TOEPUB_UNICODE_SSE2)
+        // 8 ASCII characters at once
+        if(end - p >= 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            if(be_)
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, ascii_mask), zero)) == 0xFFFF)
+            {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(v, v));
+                p += 16;
+                out += 8;
+                continue;
+            }
+        }
+#endif
+
+        unsigned long c = (static_cast<unsigned long>(p[hi]) << 8) | p[lo];
+        if(c < 0x80)
+            *out++ = static_cast<char>(c);
+        else if(c < 0x800)
+        {
+            *out++ = static_cast<char>(0xC0 | (c >> 6));
+            *out++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if(c < 0xD800 || c > 0xDFFF)
+        {
+            *out++ = static_cast<char>(0xE0 | (c >> 12));
+            *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            *out++ = static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            // surrogate pair
+            if(c > 0xDBFF)
+                IOError(UIFileName(), "UTF-16: unpaired low surrogate");
+            if(end - p < 4)
+                break;  // wait for the rest
+            unsigned long c2 = (static_cast<unsigned long>(p[2 + hi]) << 8) | p[2 + lo];
+            if(c2 < 0xDC00 || c2 > 0xDFFF)
+                IOError(UIFileName(), "UTF-16: unpaired high surrogate");
+            c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+            *out++ = static_cast<char>(0xF0 | (c >> 18));
+            *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            *out++ = static_cast<char>(0x80 | (c & 0x3F));
+            p += 2;
+        }
+        p += 2;
+    }
+
+    *pp = p;
+    return out;
+}
 
-static const char* RoughEncoding(InStm *stm)
+//-----------------------------------------------------------------------
+size_t InStmUtf16::ConvertTo(char *out, size_t size) const
 {
-    // usually it's enough to test the first byte only...
-    switch(stm->GetUChar())
+    char *po = out;
+    while(ReadInput())
     {
-    case 0x00:  return "UTF-32BE";
-    case 0x0E:  return "SCSU";
-    case 0x2B:  return "UTF-7";
-    case '<':   return "UTF-8";     // temporary assume UTF-8 XML
-    case 0x84:  return "GB-18030";
-    case 0xEF:  return "UTF-8";
-    case 0xDD:  return "UTF-EBCDIC";
-    case 0xF7:  return "UTF-1";
-    case 0xFB:  return "BOCU-1";
-    case 0xFE:  return "UTF-16BE";
-    case 0xFF:
-        if(stm->GetUChar() != 0xFE)
+        // limit input by output room
+        size_t avail = iend_ - icur_, inleft = avail, room = 2*((size - (po - out))/3);
+        if(inleft > room)
+            inleft = room;
+        if(inleft < 4 && inleft < avail)
+            break;  // no room
+
+        const unsigned char *pi = reinterpret_cast<const unsigned char*>(icur_);
+        po = Convert(&pi, pi + inleft, po);
+        if(pi == reinterpret_cast<const unsigned char*>(icur_))
+        {
+            // incomplete code unit or surrogate pair
+            if(inleft == avail && stm_->IsEOF())
+                IOError(UIFileName(), "UTF-16: unexpected end of file");
             break;
-        return stm->GetUChar() ? "UTF-16LE" : "UTF-32LE";
-    default:
-        break;
+        }
+        icur_ = reinterpret_cast<char*>(const_cast<unsigned char*>(pi));
     }
+    return po - out;
+}
+
+//-----------------------------------------------------------------------
+size_t InStmUtf16::Fill() const
+{
+    // keep last char to make unget possible
+    if(ocur_ > &obuf_[1])
+        obuf_[0] = ocur_[-1];
+
+    ocur_ = &obuf_[1];
+    oend_ = ocur_ + ConvertTo(ocur_, obuf_.size() - 1);
+    return oend_ - ocur_;
+}
 
-    IOError(stm->UIFileName(), "bad XML or unknown encoding");
-    return NULL;
+//-----------------------------------------------------------------------
+bool InStmUtf16::IsEOF() const
+{
+    return (ocur_ == oend_) && !Fill();
+}
+
+//-----------------------------------------------------------------------
+char InStmUtf16::GetChar()
+{
+    if(ocur_ == oend_ && !Fill())
+        IOError(UIFileName(), "UTF-16: EOF");
+    return *ocur_++;
+}
+
+//-----------------------------------------------------------------------
+size_t InStmUtf16::Read(void *buffer, size_t max_cnt)
+{
+    char *pc = reinterpret_cast<char*> (buffer);
+    size_t cnt = 0;
+    while(cnt < max_cnt)
+    {
+        size_t num_to_copy = oend_ - ocur_;
+        if(!num_to_copy)
+        {
+            // large request - convert directly to the caller buffer
+            if(max_cnt - cnt >= obuf_.size() - 1)
+            {
+                size_t num_conv = ConvertTo(pc, max_cnt - cnt);
+                if(num_conv)
+                {
+                    obuf_[0] = pc[num_conv-1];  // keep last char to make unget possible
+                    ocur_ = oend_ = &obuf_[1];
+                    pc  += num_conv;
+                    cnt += num_conv;
+                    continue;
+                }
+            }
+            if((num_to_copy = Fill()) == 0)
+                break;
+        }
+        if(num_to_copy > max_cnt - cnt)
+            num_to_copy = max_cnt - cnt;
+
+        ::memcpy(pc, ocur_, num_to_copy);
+
+        pc      += num_to_copy;
+        ocur_   += num_to_copy;
+        cnt     += num_to_copy;
+    }
+    return cnt;
+}
+
+//-----------------------------------------------------------------------
+void InStmUtf16::UngetChar(char c)
+{
+    if(ocur_ == &obuf_[0])
+        IOError(UIFileName(), "UTF-16: can't unget");
+    *--ocur_ = c;
+}
+
+//-----------------------------------------------------------------------
+void InStmUtf16::Rewind()
+{
+    stm_->Rewind();
+    icur_ = iend_ = &ibuf_[0];
+    ocur_ = oend_ = &obuf_[1];
 }
 
 //-----------------------------------------------------------------------
@@ -84,8 +792,16 @@ public:
 //-----------------------------------------------------------------------
 InStmUtf8::InStmUtf8(InStm *stm, const char *fromcode)
 {
-    stm->Rewind();
-    stm_ =  strcmp(fromcode, "UTF-8") ? CreateInConvStm(stm, "UTF-8", fromcode) : Ptr<InStm>(stm);
+    if(!strcmp(fromcode, "UTF-16LE") || !strcmp(fromcode, "UTF-16BE"))
+        stm_ = new InStmUtf16(stm, fromcode[6] == 'B');
+    else if(strcmp(fromcode, "UTF-8"))
+        stm_ = CreateInConvStm(stm, "UTF-8", fromcode);
+    else
+#if FB2TOEPUB_INVALID_UTF8
+        stm_ = new InStmUtf8Check(stm, FB2TOEPUB_INVALID_UTF8 == 1);
+#else
+        stm_ = stm;
+#endif
     unsigned char uc = stm_->GetUChar();
     // skip byte order mark
     has_bom_ = (uc == 0xEF);
@@ -108,43 +824,16 @@ void InStmUtf8::Rewind()
     }
 }
 
-static String ParseEncoding(InStm *stm)
-{
-    Ptr<LexScanner> scanner = CreateScanner(stm);
-
-    // skip version
-    if (scanner->GetToken() != LexScanner::Token(LexScanner::XMLDECL) ||
-        scanner->GetToken().type_ != LexScanner::VERSION)
-    {
-        scanner->Error("XML version error");
-    }
-
-    // check if next is encoding
-    LexScanner::Token t = scanner->GetToken();
-    if(t != LexScanner::Token(LexScanner::ENCODING))
-        return "UTF-8";
-
-    // skip '='
-    if (scanner->GetToken().type_ != LexScanner::EQ)
-        scanner->Error("XML header: '=' expected");
-
-    // next should be string value
-    t = scanner->GetToken();
-    if(t.type_ != LexScanner::VALUE)
-        scanner->Error("XML header: 'value' expected");
-    return t.s_;
-}
-
 //-----------------------------------------------------------------------
-Ptr<InStm> FB2TOEPUB_DECL CreateInUnicodeStm(InStm *stm)
+Ptr<InStm> FB2TOEPUB_DECL CreateInUnicodeStm(InStm *stm, bool *converted)
 {
-    // analize bit order mark to get rough encoding
-    const char *fromcode = RoughEncoding(stm);
-
-    // parse <?xml version="1.0" encoding="..."?>
-    // to refine the encoding
-    Ptr<InStm> tmp = new InStmUtf8(stm, fromcode);
-    return new InStmUtf8(stm, ParseEncoding(tmp).c_str());
+    // peek the beginning of the document, analize byte order mark
+    // and <?xml version="1.0" encoding="..."?> to get the encoding
+    Ptr<InPrologStm> prolog = new InPrologStm(stm);
+    String encoding = SniffEncoding(prolog->Prolog(), prolog->PrologSize(), stm->UIFileName());
+    if(converted)
+        *converted = !!strcmp(encoding.c_str(), "UTF-8");
+    return new InStmUtf8(prolog, encoding.c_str());
 }
 
 
@@ -23,8 +23,11 @@
 #include "error.h"
 #include "minizip/unzip.h"
 #include "minizip/zip.h"
+#include "threads.h"
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <time.h>
 
 namespace Fb2ToEpub
@@ -41,17 +44,41 @@ void OutPackStm::AddFile(InStm *pin, const char *name, bool compress)
     }
 }
 
+//-----------------------------------------------------------------------
+// Opened zip archive, shared by archive and stream objects
+//-----------------------------------------------------------------------
+struct UnzFile : public Object, Noncopyable
+{
+    ::unzFile   uf_;
+    String      name_;
+    int         openCnt_;   // number of file openings (to detect stale file streams)
+
+    explicit UnzFile(const char *name) : uf_(::unzOpen(name)), name_(name), openCnt_(0)
+    {
+        if(!uf_)
+            IOError(name_, "unzOpen error");
+    }
+    ~UnzFile() {::unzClose(uf_);}
+};
+
 //-----------------------------------------------------------------------
 // UnzipStm implementation
 //-----------------------------------------------------------------------
 class UnzipStm : public InStm, Noncopyable
 {
-    ::unzFile   uf_;
-    mutable int c_; // last buffered character
-    String name_;
+    Ptr<UnzFile>                uf_;
+    String                      name_;
+    int                         openId_;    // uf_->openCnt_ value at the moment of opening
+    mutable std::vector<char>   buf_;       // inflated data (buf_[0] is reserved for unget)
+    mutable char                *cur_;      // buffer current position
+    mutable char                *end_;      // buffer data end
+
+    void    Open();
+    void    CheckCurrent() const;
+    size_t  Fill() const;
 
 public:
-    explicit UnzipStm(const char *name);
+    UnzipStm(UnzFile *uf, const String &name);
     ~UnzipStm();
 
     //virtuals
@@ -64,167 +91,494 @@ public:
 };
 
 //-----------------------------------------------------------------------
-UnzipStm::UnzipStm(const char *name) : uf_(::unzOpen(name)), c_(EOF), name_(name)
+UnzipStm::UnzipStm(UnzFile *uf, const String &name)
+                    :   uf_(uf),
+                        name_(name),
+                        buf_(FB2TOEPUB_UNZIP_BUFFER_SIZE + 1)
 {
-    if(!uf_)
-        IOError(name_, "unzOpen error");
-    if(UNZ_OK != ::unzOpenCurrentFile(uf_))
-        IOError(name_, "unzOpenCurrentFile error");
+    Open();
 }
 
 //-----------------------------------------------------------------------
 UnzipStm::~UnzipStm()
 {
-    ::unzCloseCurrentFile(uf_);
-    ::unzClose(uf_);
+    if(openId_ == uf_->openCnt_)
+        ::unzCloseCurrentFile(uf_->uf_);
+}
+
+//-----------------------------------------------------------------------
+void UnzipStm::Open()
+{
+    if(UNZ_OK != ::unzOpenCurrentFile(uf_->uf_))
+        IOError(name_, "unzOpenCurrentFile error");
+    openId_ = ++uf_->openCnt_;
+    cur_ = end_ = &buf_[1];
+}
+
+//-----------------------------------------------------------------------
+void UnzipStm::CheckCurrent() const
+{
+    if(openId_ != uf_->openCnt_)
+        IOError(name_, "zip: file is not current");
+}
+
+//-----------------------------------------------------------------------
+size_t UnzipStm::Fill() const
+{
+    CheckCurrent();
+
+    // keep last char to make unget possible
+    if(cur_ > &buf_[1])
+        buf_[0] = cur_[-1];
+
+    int cnt = ::unzReadCurrentFile(uf_->uf_, &buf_[1], buf_.size() - 1);
+    if(cnt < 0)
+        IOError(name_, "unzReadCurrentFile read error");
+
+    cur_ = &buf_[1];
+    end_ = cur_ + cnt;
+    return cnt;
 }
 
 //-----------------------------------------------------------------------
 bool UnzipStm::IsEOF() const
 {
-    return (c_ == EOF) && (::unzeof(uf_) == 1);
+    return (cur_ == end_) && !Fill();
 }
 
 //-----------------------------------------------------------------------
 char UnzipStm::GetChar()
 {
-    if(c_ == EOF)
-    {
-        char c;
-        if(::unzReadCurrentFile(uf_, &c, 1) != 1)
-            IOError(name_, "unzReadCurrentFile EOF or read error");
-        return c;
-    }
-    else
-    {
-        char cret = static_cast<char>(c_);
-        c_ = EOF;
-        return cret;
-    }
+    if(cur_ == end_ && !Fill())
+        IOError(name_, "unzReadCurrentFile EOF or read error");
+    return *cur_++;
 }
 
 //-----------------------------------------------------------------------
 size_t UnzipStm::Read(void *buffer, size_t max_cnt)
 {
-    if(!max_cnt)
-        return 0;
-
     char *cb = reinterpret_cast<char*>(buffer);
-    size_t cnt = 0;
 
-    if(c_ != EOF)
+    // copy buffered data
+    size_t cnt = end_ - cur_;
+    if(cnt > max_cnt)
+        cnt = max_cnt;
+    ::memcpy(cb, cur_, cnt);
+    cur_ += cnt;
+    if(cnt == max_cnt)
+        return cnt;
+
+    // rest
+    cb += cnt;
+    max_cnt -= cnt;
+    if(max_cnt < buf_.size() - 1)
     {
-        *cb++ = static_cast<char>(c_);
-        if(max_cnt == 1)
-            return 1;
-        cnt = 1;
-        c_ = EOF;
+        // small request - read through buffer
+        size_t cnt_read = Fill();
+        if(cnt_read > max_cnt)
+            cnt_read = max_cnt;
+        ::memcpy(cb, cur_, cnt_read);
+        cur_ += cnt_read;
+        return cnt + cnt_read;
     }
 
-    int cnt_read = ::unzReadCurrentFile(uf_, cb, max_cnt - cnt);
+    // large request - inflate directly to the caller buffer
+    CheckCurrent();
+    int cnt_read = ::unzReadCurrentFile(uf_->uf_, cb, max_cnt);
     if(cnt_read < 0)
         IOError(name_, "unzReadCurrentFile read error");
-
-    return cnt + static_cast<size_t>(cnt_read);
+    if(cnt_read > 0)
+    {
+        buf_[0] = cb[cnt_read-1];   // keep last char to make unget possible
+        cur_ = end_ = &buf_[1];
+    }
+    return cnt + cnt_read;
 }
 
 //-----------------------------------------------------------------------
 void UnzipStm::UngetChar(char c)
 {
-    if(c_ != EOF)
+    if(cur_ == &buf_[0])
         IOError(name_, "zip: unget char error");
-    c_ = static_cast<unsigned char>(c);
+    *--cur_ = c;
 }
 
 //-----------------------------------------------------------------------
 void UnzipStm::Rewind()
 {
-    // reopen
-    c_ = EOF;
-    ::unzCloseCurrentFile(uf_);
-    ::unzClose(uf_);
-    uf_ = ::unzOpen(name_.c_str());
-    if(!uf_)
-        IOError(name_, "unzOpen error");
-    if(UNZ_OK != ::unzOpenCurrentFile(uf_))
-        IOError(name_, "unzOpenCurrentFile error");
+    // reopen current file (no need to reopen the archive)
+    CheckCurrent();
+    ::unzCloseCurrentFile(uf_->uf_);
+    Open();
 }
 
 //-----------------------------------------------------------------------
-Ptr<InStm> CreateUnpackStm(const char *name)
+// ZipArchive implementation
+//-----------------------------------------------------------------------
+class ZipArchive : public InPackArchive, Noncopyable
 {
-    // check if zip
-    Ptr<InStm> stm = CreateInFileStm(name);
-    if (stm->GetChar() == 0x50 &&
-        stm->GetChar() == 0x4B &&
-        stm->GetChar() == 0x03 &&
-        stm->GetChar() == 0x04)
+    Ptr<UnzFile>    uf_;
+    bool            started_;
+    String          fname_;
+
+public:
+    explicit ZipArchive(const char *name) : uf_(new UnzFile(name)), started_(false) {}
+
+    //virtuals
+    bool        NextFile();
+    String      FileName() const    {return fname_;}
+    Ptr<InStm>  GetFileStm();
+};
+
+//-----------------------------------------------------------------------
+bool ZipArchive::NextFile()
+{
+    // close current file and make its streams stale
+    if(started_)
     {
-        return new UnzipStm(name);
+        ::unzCloseCurrentFile(uf_->uf_);
+        ++uf_->openCnt_;
     }
+
+    int ret = started_ ? ::unzGoToNextFile(uf_->uf_) : ::unzGoToFirstFile(uf_->uf_);
+    started_ = true;
+    fname_ = "";
+    if(ret == UNZ_END_OF_LIST_OF_FILE)
+        return false;
+    if(ret != UNZ_OK)
+        IOError(uf_->name_, "zip: can't go to next file");
+
+    ::unz_file_info info;
+    if(UNZ_OK != ::unzGetCurrentFileInfo(uf_->uf_, &info, NULL, 0, NULL, 0, NULL, 0))
+        IOError(uf_->name_, "unzGetCurrentFileInfo error");
+    std::vector<char> fname(info.size_filename + 1);
+    if(UNZ_OK != ::unzGetCurrentFileInfo(uf_->uf_, NULL, &fname[0], fname.size(), NULL, 0, NULL, 0))
+        IOError(uf_->name_, "unzGetCurrentFileInfo error");
+    fname_ = &fname[0];
+    return true;
+}
+
+//-----------------------------------------------------------------------
+Ptr<InStm> ZipArchive::GetFileStm()
+{
+    if(fname_.empty())
+        IOError(uf_->name_, "zip: no current file");
+    return new UnzipStm(uf_, uf_->name_ + "/" + fname_);
+}
+
+//-----------------------------------------------------------------------
+Ptr<InPackArchive> CreateInPackArchive(const char *name)
+{
+    return new ZipArchive(name);
+}
+
+//-----------------------------------------------------------------------
+Ptr<InStm> CreateUnpackStm(const char *name, bool *packed, bool *mapped)
+{
+    // check if zip
+    bool mmapped = false;
+    Ptr<InStm> stm = CreateInMmapStm(name, &mmapped);
+    bool zip =  stm->GetChar() == 0x50 &&
+                stm->GetChar() == 0x4B &&
+                stm->GetChar() == 0x03 &&
+                stm->GetChar() == 0x04;
+    if(packed)
+        *packed = zip;
+    if(mapped)
+        *mapped = mmapped && !zip;
+    if(zip)
+        return new UnzipStm(new UnzFile(name), name);
     stm->Rewind();    
     return stm;
 }
 
 //-----------------------------------------------------------------------
 // ZipStm implementation
+// If there are background threads, compressed file is kept in memory until
+// it's finished, then it is deflated by one of the threads while the next
+// files are written. Deflated files are stored to the archive in the original
+// order by the thread writing the stream.
 //-----------------------------------------------------------------------
 class ZipStm : public OutPackStm, Noncopyable
 {
-    ::zipFile   zf_;
-    String      name_;
-    bool        file_open;
-    
+    // file deflated by background thread
+    struct Entry
+    {
+        String              name_;
+        ::zip_fileinfo      zi_;
+        std::vector<char>   data_;      // file contents, then deflated data
+        uLong               size_;      // uncompressed size
+        uLong               crc_;
+        bool                ready_;     // deflated by background thread
+        String              error_;     // error message if deflating failed
+
+        Entry(const char *name, const ::zip_fileinfo &zi) : name_(name), zi_(zi), size_(0), crc_(0), ready_(false) {}
+    };
+    typedef std::deque<Entry*> EntryQueue;
+
+    class Worker : public Runnable
+    {
+        ZipStm *owner_;
+    public:
+        explicit Worker(ZipStm *owner) : owner_(owner) {}
+        void Run() {owner_->Work();}
+    };
+
+    ::zipFile                   zf_;
+    String                      name_;
+    bool                        file_open;
+    Entry                       *cur_;      // file being written to memory
+    EntryQueue                  pending_;   // files to store, in original order
+    EntryQueue                  work_;      // files to deflate
+    bool                        stop_;
+    Ptr<Monitor>                mon_;
+    Ptr<Worker>                 worker_;
+    std::vector<Ptr<Thread> >   threads_;
+
+    void        Work();
+    void        CloseFile();
+    void        StoreEntries(std::size_t maxPending);
+    void        StoreEntry(const Entry *e);
+    static void Deflate(Entry *e);
+
 public:
-    explicit ZipStm(const char *name);
+    ZipStm(const char *name, int threads);
     ~ZipStm();
 
     //virtuals
     void    PutChar(char c);
     void    Write (const void *p, size_t cnt);
     void    BeginFile(const char *name, bool compress);
+    void    Close();
 };
 
 //-----------------------------------------------------------------------
-ZipStm::ZipStm(const char *name) : zf_(::zipOpen(name, APPEND_STATUS_CREATE)), name_(name), file_open(false)
+ZipStm::ZipStm(const char *name, int threads)
+                :   zf_(::zipOpen(name, APPEND_STATUS_CREATE)),
+                    name_(name),
+                    file_open(false),
+                    cur_(NULL),
+                    stop_(false)
 {
     if(!zf_)
         IOError(name_, "zipOpen error");
+
+    if(threads > 1)
+    {
+        mon_ = CreateMonitor();
+        worker_ = new Worker(this);
+        for(int i = 0; i < threads; ++i)
+            threads_.push_back(StartThread(worker_));
+    }
 }
 
 //-----------------------------------------------------------------------
 ZipStm::~ZipStm()
 {
-    if(file_open)
-        ::zipCloseFileInZip(zf_);
-    ::zipClose(zf_, NULL);
+    if(zf_)
+    {
+        try
+        {
+            CloseFile();
+            StoreEntries(0);
+        }
+        catch(const Exception&)
+        {
+            // not closed by Close, errors are ignored here as well as zipClose errors
+        }
+    }
+
+    if(mon_)
+    {
+        {
+            MonitorLock lock(mon_);
+            stop_ = true;
+            mon_->NotifyAll();
+        }
+        for(std::size_t i = 0; i < threads_.size(); ++i)
+            threads_[i]->Join();
+    }
+
+    delete cur_;
+    for(EntryQueue::iterator it = pending_.begin(), it_end = pending_.end(); it != it_end; ++it)
+        delete *it;
+    if(zf_)
+        ::zipClose(zf_, NULL);
+}
+
+//-----------------------------------------------------------------------
+void ZipStm::Close()
+{
+    if(!zf_)
+        return;
+
+    // store files still waiting for background threads
+    CloseFile();
+    StoreEntries(0);
+
+    ::zipFile zf = zf_;
+    zf_ = NULL;
+    if(ZIP_OK != ::zipClose(zf, NULL))
+        IOError(name_, "zipClose error");
+}
+
+//-----------------------------------------------------------------------
+void ZipStm::Deflate(Entry *e)
+{
+    try
+    {
+        const Bytef *p = reinterpret_cast<const Bytef*>(e->data_.empty() ? NULL : &e->data_[0]);
+        e->size_ = e->data_.size();
+        e->crc_ = ::crc32(::crc32(0L, Z_NULL, 0), p, e->size_);
+
+        // the same parameters as zipOpenNewFileInZip uses, to get the same result
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(Z_OK != ::deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY))
+        {
+            e->error_ = "deflateInit2 error";
+            return;
+        }
+        std::vector<char> out(::deflateBound(&zs, e->size_));
+        zs.next_in      = const_cast<Bytef*>(p);
+        zs.avail_in     = e->size_;
+        zs.next_out     = reinterpret_cast<Bytef*>(&out[0]);
+        zs.avail_out    = out.size();
+        int err = ::deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        if(zs.data_type == Z_ASCII)
+            e->zi_.internal_fa = Z_ASCII;   // zipCloseFileInZip marks text files
+        ::deflateEnd(&zs);
+
+        if(err != Z_STREAM_END)
+            e->error_ = "deflate error";
+        else
+            e->data_.swap(out);
+    }
+    catch(...)
+    {
+        e->error_ = "deflate: out of memory";
+    }
+}
+
+//-----------------------------------------------------------------------
+void ZipStm::Work()
+{
+    MonitorLock lock(mon_);
+    for(;;)
+    {
+        while(!stop_ && work_.empty())
+            mon_->Wait();
+        if(stop_)
+            return;
+
+        Entry *e = work_.front();
+        work_.pop_front();
+        mon_->Leave();
+        Deflate(e);
+        mon_->Enter();
+
+        e->ready_ = true;
+        mon_->NotifyAll();
+    }
+}
+
+//-----------------------------------------------------------------------
+void ZipStm::CloseFile()
+{
+    if(cur_)
+    {
+        // pass it to background threads
+        MonitorLock lock(mon_);
+        pending_.push_back(cur_);
+        work_.push_back(cur_);
+        cur_ = NULL;
+        mon_->NotifyAll();
+    }
+    else if(file_open)
+    {
+        file_open = false;
+        if(ZIP_OK != ::zipCloseFileInZip(zf_))
+            IOError(name_, "zipCloseFileInZip error");
+    }
+}
+
+//-----------------------------------------------------------------------
+// Stores deflated files (waiting for them) until there are no more than maxPending
+// files left, then stores the rest of files which are ready
+void ZipStm::StoreEntries(std::size_t maxPending)
+{
+    while(!pending_.empty())
+    {
+        Entry *e = pending_.front();
+        {
+            MonitorLock lock(mon_);
+            if(!e->ready_ && pending_.size() <= maxPending)
+                return;
+            while(!e->ready_)
+                mon_->Wait();
+        }
+        pending_.pop_front();
+        try
+        {
+            StoreEntry(e);
+        }
+        catch(...)
+        {
+            delete e;
+            throw;
+        }
+        delete e;
+    }
+}
+
+//-----------------------------------------------------------------------
+void ZipStm::StoreEntry(const Entry *e)
+{
+    if(!e->error_.empty())
+        IOError(name_, e->error_);
+
+    // store deflated data as is
+    if(ZIP_OK != ::zipOpenNewFileInZip2(zf_, e->name_.c_str(), &e->zi_, NULL, 0, NULL, 0, NULL,
+                                        Z_DEFLATED, Z_BEST_COMPRESSION, 1))
+        IOError(name_, "zipOpenNewFileInZip2 error");
+    if(!e->data_.empty() && ::zipWriteInFileInZip(zf_, &e->data_[0], e->data_.size()) < 0)
+        IOError(name_, "zipWriteInFileInZip error");
+    if(ZIP_OK != ::zipCloseFileInZipRaw(zf_, e->size_, e->crc_))
+        IOError(name_, "zipCloseFileInZipRaw error");
 }
 
 //-----------------------------------------------------------------------
 void ZipStm::PutChar(char c)
 {
-    if(!file_open)
+    if(cur_)
+        cur_->data_.push_back(c);
+    else if(!file_open)
         IOError(name_, "zip: file not added to zip");
-    if(::zipWriteInFileInZip(zf_, &c, 1) < 0)
+    else if(::zipWriteInFileInZip(zf_, &c, 1) < 0)
         IOError(name_, "zipWriteInFileInZip error");
 }
 
 //-----------------------------------------------------------------------
 void ZipStm::Write (const void *p, size_t cnt)
 {
-    if(!file_open)
+    if(cur_)
+    {
+        const char *pc = reinterpret_cast<const char*>(p);
+        cur_->data_.insert(cur_->data_.end(), pc, pc + cnt);
+    }
+    else if(!file_open)
         IOError(name_, "zip: file not added to zip");
-    if(::zipWriteInFileInZip(zf_, p, cnt) < 0)
+    else if(::zipWriteInFileInZip(zf_, p, cnt) < 0)
         IOError(name_, "zipWriteInFileInZip error");
 }
 
 //-----------------------------------------------------------------------
 void ZipStm::BeginFile(const char *name, bool compress)
 {
-    if(!file_open)
-        file_open = true;
-    else if(ZIP_OK != ::zipCloseFileInZip(zf_))
-        IOError(name_, "zipCloseFileInZip error");
+    if(!zf_)
+        IOError(name_, "zip: archive is closed");
+    CloseFile();
 
     ::zip_fileinfo zi;
     if(IsTestMode())
@@ -252,19 +606,30 @@ void ZipStm::BeginFile(const char *name, bool compress)
     zi.dosDate          = 0;
     zi.internal_fa      = 0;
     zi.external_fa      = 0;
-    
+
+    if(compress && mon_)
+    {
+        // limit memory used by files waiting for background threads
+        StoreEntries(2 * threads_.size());
+        cur_ = new Entry(name, zi);
+        return;
+    }
+
+    // the file is written directly, all previous files should be stored before
+    StoreEntries(0);
     if(ZIP_OK != ::zipOpenNewFileInZip (zf_, name, &zi, NULL, 0, NULL, 0, NULL,
                                         compress ? Z_DEFLATED : 0,
                                         compress ? Z_BEST_COMPRESSION : Z_NO_COMPRESSION))
     {
         IOError(name_, "zipOpenNewFileInZip error");
     }
+    file_open = true;
 }
 
 //-----------------------------------------------------------------------
 Ptr<OutPackStm> FB2TOEPUB_DECL CreatePackStm(const char *name)
 {
-    return new ZipStm(name);
+    return new ZipStm(name, FB2TOEPUB_PACK_THREADS);
 }
 
 };  //namespace Fb2ToEpub
@@ -31,8 +31,26 @@ namespace Fb2ToEpub
 // Supported formats:
 //  1) No packing
 //  2) Zip (only first file is unpacked)
+// If packed is not NULL, it is set to true for zip file
+// If mapped is not NULL, it is set to true for memory mapped unpacked file
 //-----------------------------------------------------------------------
-Ptr<InStm> FB2TOEPUB_DECL   CreateUnpackStm(const char *name);
+Ptr<InStm> FB2TOEPUB_DECL   CreateUnpackStm(const char *name, bool *packed = NULL, bool *mapped = NULL);
+
+//-----------------------------------------------------------------------
+// INPUT ZIP ARCHIVE (ALL FILES)
+//-----------------------------------------------------------------------
+class FB2TOEPUB_DECL InPackArchive : public Object
+{
+public:
+    // go to next file (first call goes to the first file), false if no more files
+    virtual bool        NextFile()          = 0;
+    // current file name inside archive
+    virtual String      FileName() const    = 0;
+    // current file stream (valid until next call to NextFile)
+    virtual Ptr<InStm>  GetFileStm()        = 0;
+};
+
+Ptr<InPackArchive> FB2TOEPUB_DECL CreateInPackArchive(const char *name);
 
 //-----------------------------------------------------------------------
 // OUTPUT ZIP STREAM
@@ -41,6 +59,9 @@ class FB2TOEPUB_DECL OutPackStm : public OutStm
 {
 public:
     virtual void BeginFile(const char *name, bool compress) = 0;
+    // finish writing of archive and report errors
+    // (archive not closed explicitly is closed by destructor ignoring errors)
+    virtual void Close() = 0;
 
     // helper
     void AddFile(InStm *pin, const char *name, bool compress);
@@ -0,0 +1,188 @@
+//
+//  Copyright (C) 2010 Alexey Bobkov
+//
+//  This file is part of Fb2toepub converter.
+//
+//  Fb2toepub converter is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Fb2toepub converter is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Fb2toepub converter.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "hdr.h"
+
+#include "threads.h"
+#include "error.h"
+
+#if (defined WIN32)
+
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600     // condition variables
+#endif
+#include <windows.h>
+namespace Fb2ToEpub
+{
+    //-----------------------------------------------------------------------
+    // OS-dependent Monitor implementation
+    //-----------------------------------------------------------------------
+    class WinMonitor : public Monitor, Noncopyable
+    {
+        CRITICAL_SECTION    cs_;
+        CONDITION_VARIABLE  cv_;
+    public:
+        WinMonitor()
+        {
+            ::InitializeCriticalSection(&cs_);
+            ::InitializeConditionVariable(&cv_);
+        }
+        ~WinMonitor()               {::DeleteCriticalSection(&cs_);}
+
+        //virtuals
+        void Enter()                {::EnterCriticalSection(&cs_);}
+        void Leave()                {::LeaveCriticalSection(&cs_);}
+        void Wait()                 {::SleepConditionVariableCS(&cv_, &cs_, INFINITE);}
+        void NotifyAll()            {::WakeAllConditionVariable(&cv_);}
+    };
+
+    //-----------------------------------------------------------------------
+    // OS-dependent Thread implementation
+    //-----------------------------------------------------------------------
+    class WinThread : public Thread, Noncopyable
+    {
+        HANDLE h_;
+
+        static DWORD WINAPI Start(LPVOID p)
+        {
+            reinterpret_cast<Runnable*>(p)->Run();
+            return 0;
+        }
+
+    public:
+        explicit WinThread(Runnable *r) : h_(::CreateThread(NULL, 0, Start, r, 0, NULL))
+        {
+            if(!h_)
+                ExternalError("CreateThread error");
+        }
+        ~WinThread()                {Join();}
+
+        //virtuals
+        void Join()
+        {
+            if(h_)
+            {
+                ::WaitForSingleObject(h_, INFINITE);
+                ::CloseHandle(h_);
+                h_ = NULL;
+            }
+        }
+    };
+
+    //-----------------------------------------------------------------------
+    Ptr<Monitor> FB2TOEPUB_DECL CreateMonitor()
+    {
+        return new WinMonitor();
+    }
+
+    //-----------------------------------------------------------------------
+    Ptr<Thread> FB2TOEPUB_DECL StartThread(Runnable *r)
+    {
+        return new WinThread(r);
+    }
+};  //namespace Fb2ToEpub
+
+#elif (defined unix)
+
+#include <pthread.h>
+namespace Fb2ToEpub
+{
+    //-----------------------------------------------------------------------
+    // OS-dependent Monitor implementation
+    //-----------------------------------------------------------------------
+    class UnixMonitor : public Monitor, Noncopyable
+    {
+        pthread_mutex_t mtx_;
+        pthread_cond_t  cv_;
+    public:
+        UnixMonitor()
+        {
+            if(::pthread_mutex_init(&mtx_, NULL))
+                ExternalError("pthread_mutex_init error");
+            if(::pthread_cond_init(&cv_, NULL))
+            {
+                ::pthread_mutex_destroy(&mtx_);
+                ExternalError("pthread_cond_init error");
+            }
+        }
+        ~UnixMonitor()
+        {
+            ::pthread_cond_destroy(&cv_);
+            ::pthread_mutex_destroy(&mtx_);
+        }
+
+        //virtuals
+        void Enter()                {::pthread_mutex_lock(&mtx_);}
+        void Leave()                {::pthread_mutex_unlock(&mtx_);}
+        void Wait()                 {::pthread_cond_wait(&cv_, &mtx_);}
+        void NotifyAll()            {::pthread_cond_broadcast(&cv_);}
+    };
+
+    //-----------------------------------------------------------------------
+    // OS-dependent Thread implementation
+    //-----------------------------------------------------------------------
+    class UnixThread : public Thread, Noncopyable
+    {
+        pthread_t   th_;
+        bool        joined_;
+
+        static void* Start(void *p)
+        {
+            reinterpret_cast<Runnable*>(p)->Run();
+            return NULL;
+        }
+
+    public:
+        explicit UnixThread(Runnable *r) : joined_(false)
+        {
+            if(::pthread_create(&th_, NULL, Start, r))
+                ExternalError("pthread_create error");
+        }
+        ~UnixThread()               {Join();}
+
+        //virtuals
+        void Join()
+        {
+            if(!joined_)
+            {
+                ::pthread_join(th_, NULL);
+                joined_ = true;
+            }
+        }
+    };
+
+    //-----------------------------------------------------------------------
+    Ptr<Monitor> FB2TOEPUB_DECL CreateMonitor()
+    {
+        return new UnixMonitor();
+    }
+
+    //-----------------------------------------------------------------------
+    Ptr<Thread> FB2TOEPUB_DECL StartThread(Runnable *r)
+    {
+        return new UnixThread(r);
+    }
+};  //namespace Fb2ToEpub
+
+#else
+
+#error Implement threads for your OS!!!
+
+#endif
@@ -0,0 +1,74 @@
+//
+//  Copyright (C) 2010 Alexey Bobkov
+//
+//  This file is part of Fb2toepub converter.
+//
+//  Fb2toepub converter is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Fb2toepub converter is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Fb2toepub converter.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef FB2TOEPUB__THREADS_H
+#define FB2TOEPUB__THREADS_H
+
+#include "types.h"
+
+namespace Fb2ToEpub
+{
+
+//-----------------------------------------------------------------------
+// MONITOR (MUTEX WITH CONDITION VARIABLE)
+//-----------------------------------------------------------------------
+class Monitor : public Object
+{
+public:
+    virtual void Enter()        = 0;
+    virtual void Leave()        = 0;
+    virtual void Wait()         = 0;    // must be called inside monitor
+    virtual void NotifyAll()    = 0;
+};
+
+Ptr<Monitor> FB2TOEPUB_DECL CreateMonitor();
+
+//-----------------------------------------------------------------------
+class MonitorLock : Noncopyable
+{
+    Monitor *m_;
+public:
+    explicit MonitorLock(Monitor *m) : m_(m)    {m_->Enter();}
+    ~MonitorLock()                              {m_->Leave();}
+};
+
+//-----------------------------------------------------------------------
+// THREAD
+//-----------------------------------------------------------------------
+class Runnable : public Object
+{
+public:
+    // Called in the new thread. Shouldn't throw exceptions.
+    virtual void Run() = 0;
+};
+
+class Thread : public Object
+{
+public:
+    virtual void Join() = 0;
+};
+
+// Runnable object must be alive until Join
+Ptr<Thread> FB2TOEPUB_DECL StartThread(Runnable *r);
+
+};  //namespace Fb2ToEpub
+
+#endif
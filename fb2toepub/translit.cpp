@@ -127,9 +127,9 @@ String XlitConvImpl::Convert(const String &s) const
 void XlitConvImpl::map(LexScanner *s)
 {
     AttrMap attrmap;
-    bool notempty = s->BeginElement("map", &attrmap);
+    bool notempty = s->BeginElement(E_MAP, &attrmap);
 
-    String in = attrmap["in"], out = attrmap["out"];
+    String in = attrmap.Get(A_IN), out = attrmap.Get(A_OUT);
     if(!in.empty() && !out.empty())
         xlit_[in] = out;
 
@@ -140,10 +140,10 @@ void XlitConvImpl::map(LexScanner *s)
 //-----------------------------------------------------------------------
 void XlitConvImpl::transtable(LexScanner *s)
 {
-    s->BeginNotEmptyElement("transtable");
+    s->BeginNotEmptyElement(E_TRANSTABLE);
 
     //<map>
-    while(s->IsNextElement("map"))
+    while(s->IsNextElement(E_MAP))
         map(s);
     //</map>
 }